@@ -19,6 +19,8 @@ LOCAL_SRC_FILES :=\
     base/colorutil.cpp \
     base/error_context.cpp \
     base/stringutil.cpp \
+    base/stats.cpp \
+    base/mutex.cpp \
     data/compression.cpp \
     ext/rg_etc1/rg_etc1.cpp \
     ext/cityhash/city.cpp \
@@ -68,11 +70,15 @@ LOCAL_SRC_FILES :=\
     math/lin/matrix4x4.cpp.arm \
     midi/midi_input.cpp \
     net/http_client.cpp \
+    net/connection_pool.cpp \
+    net/rate_limiter.cpp \
     net/http_server.cpp \
     net/http_headers.cpp \
     net/resolve.cpp \
     net/url.cpp \
+    net/http_metrics.cpp \
     profiler/profiler.cpp \
+    profiler/sampler.cpp \
     thread/executor.cpp \
     thread/threadutil.cpp \
     thread/prioritizedworkqueue.cpp \
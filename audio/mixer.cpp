@@ -111,11 +111,17 @@ Clip *clip_load(const char *filename) {
 		}
 	}
 
+	Clip *clip = clip_create_pcm16(data, num_samples, sample_rate);
+	clip->num_channels = num_channels;
+	return clip;
+}
+
+Clip *clip_create_pcm16(short *data, int num_samples, int sample_rate) {
 	Clip *clip = new Clip();
 	clip->type = CT_PCM16;
 	clip->data = data;
 	clip->length = num_samples;
-	clip->num_channels = num_channels;
+	clip->num_channels = 1;
 	clip->sample_rate = sample_rate;
 	clip->loop_start = 0;
 	clip->loop_end = 0;
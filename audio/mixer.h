@@ -29,6 +29,8 @@ void mixer_mix(Mixer *mixer, short *buffer, int num_samples);
 // Clip
 // ==========================
 Clip *clip_load(const char *filename);
+// Mono 16-bit samples, already in memory. Takes ownership of data, which must come from malloc.
+Clip *clip_create_pcm16(short *data, int num_samples, int sample_rate);
 void clip_destroy(Clip *clip);
 
 const short *clip_data(const Clip *clip);
@@ -1,5 +1,8 @@
 #include "base/backtrace.h"
 
+// Pulls in features.h, so that __GLIBC__ is defined by the time it's checked below.
+#include <stdio.h>
+
 #if defined(__GLIBC__) && !defined(__UCLIBC__)
 #include <execinfo.h>
 #include <unistd.h>
@@ -11,12 +14,26 @@ void PrintBacktraceToStderr() {
 	backtrace_symbols_fd(backtrace_buffer, num_addrs, STDERR_FILENO);
 }
 
-#else
+int GetBacktrace(void **addrs, int maxAddrs) {
+	void *buffer[128];
+	int num_addrs = backtrace(buffer, 128);
+	// Leave out this function itself. Doing it by hand also keeps the compiler from turning the
+	// backtrace() call into a tail call, which would make this frame disappear on its own.
+	int count = num_addrs - 1 < maxAddrs ? num_addrs - 1 : maxAddrs;
+	for (int i = 0; i < count; i++) {
+		addrs[i] = buffer[i + 1];
+	}
+	return count > 0 ? count : 0;
+}
 
-#include <stdio.h>
+#else
 
 void PrintBacktraceToStderr() {
 	fprintf(stderr, "No backtrace available to print on this platform\n");
 }
 
+int GetBacktrace(void **addrs, int maxAddrs) {
+	return 0;
+}
+
 #endif
@@ -1,3 +1,8 @@
 #pragma once
 
 void PrintBacktraceToStderr();
+
+// Fills addrs with the return addresses of the calling stack, innermost (the caller) first. Returns the
+// number of frames, 0 where not supported. Safe to call from a signal handler once it has been
+// called at least once outside of one (the first call may load the unwinder).
+int GetBacktrace(void **addrs, int maxAddrs);
@@ -3,27 +3,139 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <algorithm>
+#include <atomic>
+#include <new>
 
 #ifdef _WIN32
 #include <winsock2.h>
 #undef min
 #undef max
 #else
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
 #include "base/logging.h"
+#include "base/stats.h"
 #include "base/timeutil.h"
 #include "file/fd_util.h"
 
-Buffer::Buffer() { }
-Buffer::~Buffer() { }
+enum {
+	// Smallest block we allocate. Bigger appends get a block of their own size.
+	BLOCK_SIZE = 4096,
+	// Appending another Buffer copies slices smaller than this rather than sharing them, so
+	// lots of tiny appends don't turn into lots of tiny chunks.
+	MIN_SHARED_CHUNK = 256,
+	// Chunks per writev call.
+	MAX_IOVECS = 64,
+	// How long Flush waits for a full non-blocking fd to take something.
+	FLUSH_STALL_TIMEOUT_MS = 30000,
+};
+
+struct Buffer::Block {
+	std::atomic<int> refs;
+	size_t capacity;
+	// Bytes handed out so far. Only the sole owner may hand out more.
+	size_t used;
+	// Adopted memory lives elsewhere, otherwise the data follows right after the header.
+	char *external;
+	ReleaseFunc release;
+	char *data() { return external ? external : (char *)(this + 1); }
+};
+
+Buffer::Block *Buffer::NewBlock(size_t capacity) {
+	void *mem = malloc(sizeof(Block) + capacity);
+	Block *block = new (mem) Block();
+	block->refs = 1;
+	block->capacity = capacity;
+	block->used = 0;
+	block->external = 0;
+	return block;
+}
+
+void Buffer::AddRef(Block *block) {
+	block->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Buffer::Release(Block *block) {
+	if (block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		if (block->release)
+			block->release(block->external);
+		block->~Block();
+		free(block);
+	}
+}
+
+Buffer::Buffer() : size_(0), spare_(0) { }
+
+Buffer::~Buffer() {
+	clear();
+	if (spare_)
+		Release(spare_);
+}
+
+void Buffer::clear() {
+	for (size_t i = 0; i < chunks_.size(); i++) {
+		Release(chunks_[i].block);
+	}
+	chunks_.clear();
+	size_ = 0;
+}
+
+size_t Buffer::TailRoom() const {
+	if (chunks_.empty())
+		return 0;
+	// The last chunk can only grow in place if we're the only one using its block.
+	const Chunk &last = chunks_.back();
+	const Block *block = last.block;
+	if (last.end != block->used || block->refs.load(std::memory_order_acquire) != 1)
+		return 0;
+	return block->capacity - block->used;
+}
+
+char *Buffer::Reserve(size_t minLength, size_t *room) {
+	*room = TailRoom();
+	if (*room > 0 && *room >= minLength) {
+		const Chunk &last = chunks_.back();
+		return last.block->data() + last.end;
+	}
+	// Start an empty chunk in a new block, which Commit fills in or drops.
+	Chunk chunk;
+	chunk.block = NewBlock(std::max(minLength, (size_t)BLOCK_SIZE));
+	chunk.begin = 0;
+	chunk.end = 0;
+	chunks_.push_back(chunk);
+	*room = chunk.block->capacity;
+	return chunk.block->data();
+}
+
+void Buffer::Commit(size_t length) {
+	if (chunks_.empty())
+		return;
+	Chunk &last = chunks_.back();
+	last.end += length;
+	last.block->used += length;
+	size_ += length;
+	if (last.begin == last.end) {
+		Release(last.block);
+		chunks_.pop_back();
+	}
+}
 
 char *Buffer::Append(ssize_t length) {
-  size_t old_size = data_.size();
-  data_.resize(old_size + length);
-  return &data_[0] + old_size;
+	size_t len = (size_t)length;
+	if (len == 0) {
+		// Still need a valid pointer.
+		static char dummy;
+		return &dummy;
+	}
+	size_t room;
+	char *ptr = Reserve(len, &room);
+	Commit(len);
+	return ptr;
 }
 
 void Buffer::Append(const std::string &str) {
@@ -38,9 +150,45 @@ void Buffer::Append(const char *str) {
 }
 
 void Buffer::Append(const Buffer &other) {
-	size_t len = other.size();
-	char *dest = Append(len);
-	memcpy(dest, &other.data_[0], len);
+	if (&other == this) {
+		std::string copy;
+		PeekAll(&copy);
+		Append(copy);
+		return;
+	}
+	for (size_t i = 0; i < other.chunks_.size(); i++) {
+		const Chunk &chunk = other.chunks_[i];
+		size_t len = chunk.end - chunk.begin;
+		if (len < MIN_SHARED_CHUNK) {
+			memcpy(Append(len), chunk.block->data() + chunk.begin, len);
+		} else {
+			AddRef(chunk.block);
+			chunks_.push_back(chunk);
+			size_ += len;
+		}
+	}
+}
+
+void Buffer::Adopt(char *data, size_t length, ReleaseFunc release) {
+	if (length == 0) {
+		if (release)
+			release(data);
+		return;
+	}
+	void *mem = malloc(sizeof(Block));
+	Block *block = new (mem) Block();
+	block->refs = 1;
+	// Full, so nothing ever gets written into it.
+	block->capacity = length;
+	block->used = length;
+	block->external = data;
+	block->release = release;
+	Chunk chunk;
+	chunk.block = block;
+	chunk.begin = 0;
+	chunk.end = length;
+	chunks_.push_back(chunk);
+	size_ += length;
 }
 
 void Buffer::AppendValue(int value) {
@@ -51,9 +199,9 @@ void Buffer::AppendValue(int value) {
 }
 
 void Buffer::Take(size_t length, std::string *dest) {
-	if (length > data_.size()) {
+	if (length > size_) {
 		ELOG("Truncating length in Buffer::Take()");
-		length = data_.size();
+		length = size_;
 	}
 	dest->resize(length);
 	if (length > 0) {
@@ -62,8 +210,40 @@ void Buffer::Take(size_t length, std::string *dest) {
 }
 
 void Buffer::Take(size_t length, char *dest) {
-	memcpy(dest, &data_[0], length);
-	data_.erase(data_.begin(), data_.begin() + length);
+	if (length > size_) {
+		ELOG("Truncating length in Buffer::Take()");
+		length = size_;
+	}
+	size_t pos = 0;
+	while (pos < length) {
+		const Chunk &chunk = chunks_.front();
+		size_t n = std::min(length - pos, chunk.end - chunk.begin);
+		memcpy(dest + pos, chunk.block->data() + chunk.begin, n);
+		pos += n;
+		Skip(n);
+	}
+}
+
+void Buffer::Take(size_t length, Buffer *dest) {
+	if (length > size_) {
+		ELOG("Truncating length in Buffer::Take()");
+		length = size_;
+	}
+	while (length > 0) {
+		const Chunk &chunk = chunks_.front();
+		size_t n = std::min(length, chunk.end - chunk.begin);
+		if (n < MIN_SHARED_CHUNK) {
+			memcpy(dest->Append(n), chunk.block->data() + chunk.begin, n);
+		} else {
+			Chunk slice = chunk;
+			slice.end = slice.begin + n;
+			AddRef(slice.block);
+			dest->chunks_.push_back(slice);
+			dest->size_ += n;
+		}
+		length -= n;
+		Skip(n);
+	}
 }
 
 int Buffer::TakeLineCRLF(std::string *dest) {
@@ -78,11 +258,22 @@ int Buffer::TakeLineCRLF(std::string *dest) {
 }
 
 void Buffer::Skip(size_t length) {
-	if (length > data_.size()) {
+	if (length > size_) {
 		ELOG("Truncating length in Buffer::Skip()");
-		length = data_.size();
+		length = size_;
+	}
+	size_ -= length;
+	while (length > 0) {
+		Chunk &chunk = chunks_.front();
+		size_t chunkSize = chunk.end - chunk.begin;
+		if (length < chunkSize) {
+			chunk.begin += length;
+			return;
+		}
+		length -= chunkSize;
+		Release(chunk.block);
+		chunks_.pop_front();
 	}
-	data_.erase(data_.begin(), data_.begin() + length);
 }
 
 int Buffer::SkipLineCRLF() {
@@ -96,12 +287,19 @@ int Buffer::SkipLineCRLF() {
 }
 
 int Buffer::OffsetToAfterNextCRLF() {
-  for (int i = 0; i < (int)data_.size() - 1; i++) {
-    if (data_[i] == '\r' && data_[i + 1] == '\n') {
-      return i + 2;
-    }
-  }
-  return -1;
+	int offset = 0;
+	bool lastWasCR = false;
+	for (size_t c = 0; c < chunks_.size(); c++) {
+		const Chunk &chunk = chunks_[c];
+		const char *data = chunk.block->data();
+		for (size_t i = chunk.begin; i < chunk.end; i++, offset++) {
+			if (lastWasCR && data[i] == '\n') {
+				return offset + 1;
+			}
+			lastWasCR = data[i] == '\r';
+		}
+	}
+	return -1;
 }
 
 void Buffer::Printf(const char *fmt, ...) {
@@ -122,104 +320,234 @@ void Buffer::Printf(const char *fmt, ...) {
 }
 
 bool Buffer::Flush(int fd) {
-  // Look into using send() directly.
-  bool success = (ssize_t)data_.size() == fd_util::WriteLine(fd, &data_[0], data_.size());
-  if (success) {
-    data_.resize(0);
-  }
-  return success;
+#ifdef _WIN32
+	while (!chunks_.empty()) {
+		const Chunk &chunk = chunks_.front();
+		size_t len = chunk.end - chunk.begin;
+		if ((ssize_t)len != fd_util::WriteLine(fd, chunk.block->data() + chunk.begin, len)) {
+			return false;
+		}
+		Skip(len);
+	}
+	return true;
+#else
+	return WriteGathered(fd);
+#endif
+}
+
+ssize_t Buffer::WriteSome(uintptr_t fd) {
+	if (chunks_.empty())
+		return 0;
+#ifdef _WIN32
+	const Chunk &chunk = chunks_.front();
+	ssize_t written = send((SOCKET)fd, chunk.block->data() + chunk.begin, (int)(chunk.end - chunk.begin), 0);
+#else
+	iovec iov[MAX_IOVECS];
+	int count = (int)std::min(chunks_.size(), (size_t)MAX_IOVECS);
+	for (int i = 0; i < count; i++) {
+		const Chunk &chunk = chunks_[i];
+		iov[i].iov_base = chunk.block->data() + chunk.begin;
+		iov[i].iov_len = chunk.end - chunk.begin;
+	}
+	ssize_t written = writev((int)fd, iov, count);
+#endif
+	if (written > 0)
+		Skip(written);
+	return written;
+}
+
+#ifndef _WIN32
+bool Buffer::WriteGathered(int fd) {
+	while (!chunks_.empty()) {
+		ssize_t written = WriteSome(fd);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				// Non-blocking and full. Wait for room, but not forever.
+				pollfd pfd;
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				pfd.revents = 0;
+				int ready = poll(&pfd, 1, FLUSH_STALL_TIMEOUT_MS);
+				if (ready > 0 || (ready < 0 && errno == EINTR))
+					continue;
+				ELOG("writev: nothing taken for %d ms, giving up", FLUSH_STALL_TIMEOUT_MS);
+				return false;
+			}
+			ELOG("writev failed: %i", errno);
+			return false;
+		}
+	}
+	return true;
+}
+#endif
+
+bool Buffer::Flush(FILE *file) {
+	while (!chunks_.empty()) {
+		const Chunk &chunk = chunks_.front();
+		size_t len = chunk.end - chunk.begin;
+		if (fwrite(chunk.block->data() + chunk.begin, 1, len, file) != len) {
+			ELOG("fwrite failed");
+			return false;
+		}
+		Skip(len);
+	}
+	return true;
 }
 
 bool Buffer::FlushToFile(const char *filename) {
 	FILE *f = fopen(filename, "wb");
 	if (!f)
 		return false;
-	if (data_.size()) {
-		fwrite(&data_[0], 1, data_.size(), f);
+	for (size_t i = 0; i < chunks_.size(); i++) {
+		const Chunk &chunk = chunks_[i];
+		fwrite(chunk.block->data() + chunk.begin, 1, chunk.end - chunk.begin, f);
 	}
 	fclose(f);
 	return true;
 }
 
 bool Buffer::FlushSocket(uintptr_t sock) {
-	for (size_t pos = 0, end = data_.size(); pos < end; ) {
-		int sent = send(sock, &data_[pos], (int)(end - pos), 0);
-		if (sent < 0) {
+#ifdef _WIN32
+	while (!chunks_.empty()) {
+		WSABUF bufs[MAX_IOVECS];
+		DWORD count = (DWORD)std::min(chunks_.size(), (size_t)MAX_IOVECS);
+		for (DWORD i = 0; i < count; i++) {
+			const Chunk &chunk = chunks_[i];
+			bufs[i].buf = chunk.block->data() + chunk.begin;
+			bufs[i].len = (ULONG)(chunk.end - chunk.begin);
+		}
+		DWORD sent = 0;
+		if (WSASend((SOCKET)sock, bufs, count, &sent, 0, NULL, NULL) != 0) {
 			ELOG("FlushSocket failed");
 			return false;
 		}
-		pos += sent;
+		Skip(sent);
 
 		// Buffer full, don't spin.
 		if (sent == 0) {
 			sleep_ms(1);
 		}
 	}
-	data_.resize(0);
 	return true;
+#else
+	return WriteGathered((int)sock);
+#endif
 }
 
-bool Buffer::ReadAll(int fd, int hintSize) {
-	std::vector<char> buf;
+// Reads land directly in the blocks. Outside Windows, a read fills up what's left of the last
+// block and spills into a new one in the same call.
+int Buffer::ReadSome(int fd, size_t maxLength) {
+#ifdef _WIN32
+	size_t room;
+	char *p = Reserve(std::min(maxLength, (size_t)BLOCK_SIZE), &room);
+	int retval = recv(fd, p, (int)std::min(room, maxLength), 0);
+	Commit(retval > 0 ? retval : 0);
+	return retval;
+#else
+	iovec iov[2];
+	int count = 0;
+	size_t room = std::min(TailRoom(), maxLength);
+	if (room > 0) {
+		const Chunk &last = chunks_.back();
+		iov[count].iov_base = last.block->data() + last.end;
+		iov[count].iov_len = room;
+		count++;
+	}
+	Block *spill = 0;
+	if (room < maxLength) {
+		// Most reads fit in the tail, so the spill block usually goes unused. Keep it around
+		// rather than allocating a fresh one every time.
+		if (spare_ && spare_->capacity >= maxLength - room) {
+			spill = spare_;
+		} else {
+			if (spare_)
+				Release(spare_);
+			spill = NewBlock(std::max(maxLength - room, (size_t)BLOCK_SIZE));
+		}
+		spare_ = 0;
+		iov[count].iov_base = spill->data();
+		iov[count].iov_len = maxLength - room;
+		count++;
+	}
+	ssize_t retval;
+	do {
+		retval = readv(fd, iov, count);
+	} while (retval < 0 && errno == EINTR);
+	if (retval <= 0) {
+		spare_ = spill;
+		return (int)retval;
+	}
+	size_t inTail = std::min((size_t)retval, room);
+	if (inTail > 0)
+		Commit(inTail);
+	if ((size_t)retval > inTail) {
+		Chunk chunk;
+		chunk.block = spill;
+		chunk.begin = 0;
+		chunk.end = retval - inTail;
+		spill->used = chunk.end;
+		chunks_.push_back(chunk);
+		size_ += chunk.end;
+	} else {
+		spare_ = spill;
+	}
+	return (int)retval;
+#endif
+}
+
+static size_t ReadSizeForHint(int hintSize) {
 	if (hintSize >= 65536 * 16) {
-		buf.resize(65536);
+		return 65536;
 	} else if (hintSize >= 1024 * 16) {
-		buf.resize(hintSize / 16);
+		return hintSize / 16;
 	} else {
-		buf.resize(1024);
+		return 1024;
 	}
+}
 
+bool Buffer::ReadAll(int fd, int hintSize) {
+	size_t readSize = ReadSizeForHint(hintSize);
 	while (true) {
-		int retval = recv(fd, &buf[0], (int)buf.size(), 0);
+		int retval = ReadSome(fd, readSize);
 		if (retval == 0) {
 			break;
 		} else if (retval < 0) {
 			ELOG("Error reading from buffer: %i", retval);
 			return false;
 		}
-		char *p = Append((size_t)retval);
-		memcpy(p, &buf[0], retval);
 	}
 	return true;
 }
 
 bool Buffer::ReadAllWithProgress(int fd, int knownSize, float *progress) {
-	std::vector<char> buf;
-	if (knownSize >= 65536 * 16) {
-		buf.resize(65536);
-	} else if (knownSize >= 1024 * 16) {
-		buf.resize(knownSize / 16);
-	} else {
-		buf.resize(1024);
-	}
-
+	size_t readSize = ReadSizeForHint(knownSize);
 	int total = 0;
 	while (true) {
-		int retval = recv(fd, &buf[0], (int)buf.size(), 0);
+		int retval = ReadSome(fd, readSize);
 		if (retval == 0) {
 			return true;
 		} else if (retval < 0) {
 			ELOG("Error reading from buffer: %i", retval);
 			return false;
 		}
-		char *p = Append((size_t)retval);
-		memcpy(p, &buf[0], retval);
 		total += retval;
 		*progress = (float)total / (float)knownSize;
 	}
 	return true;
 }
 
+// Handles rather than INCSTAT, since this gets hit for every request.
+static StatCounter readCalls("buffer.read_calls");
+static StatHistogram readRecvBytes("buffer.read_recv_bytes");
+
 int Buffer::Read(int fd, size_t sz) {
-	char buf[1024];
 	int retval;
 	size_t received = 0;
-	while ((retval = recv(fd, buf, (int)std::min(sz, sizeof(buf)), 0)) > 0) {
-		if (retval < 0) {
-			return retval;
-		}
-		char *p = Append((size_t)retval);
-		memcpy(p, buf, retval);
+	readCalls.Add();
+	while ((retval = ReadSome(fd, std::min(sz, (size_t)65536))) > 0) {
+		readRecvBytes.Record(retval);
 		sz -= retval;
 		received += retval;
 		if (sz == 0)
@@ -229,6 +557,11 @@ int Buffer::Read(int fd, size_t sz) {
 }
 
 void Buffer::PeekAll(std::string *dest) {
-	dest->resize(data_.size());
-	memcpy(&(*dest)[0], &data_[0], data_.size());
+	dest->resize(size_);
+	size_t pos = 0;
+	for (size_t i = 0; i < chunks_.size(); i++) {
+		const Chunk &chunk = chunks_[i];
+		memcpy(&(*dest)[pos], chunk.block->data() + chunk.begin, chunk.end - chunk.begin);
+		pos += chunk.end - chunk.begin;
+	}
 }
@@ -1,19 +1,28 @@
 #ifndef _IO_BUFFER_H
 #define _IO_BUFFER_H
 
+#include <stdio.h>
+#include <deque>
 #include <string>
 #include <vector>
 
 #include "base/basictypes.h"
+#include "base/functional.h"
 #include "base/logging.h"
 
 // Acts as a queue. Intended to be as fast as possible for most uses.
 // Does not do synchronization, must use external mutexes.
+//
+// Internally a rope: a list of slices of refcounted blocks. Taking or skipping from the front
+// never moves the remaining data, and appending another Buffer shares its blocks rather than
+// copying them, so passing a large body along is cheap.
 class Buffer {
  public:
   Buffer();
   ~Buffer();
 
+  typedef std::function<void(char *data)> ReleaseFunc;
+
   // Write max [length] bytes to the returned pointer.
   // Any other operation on this Buffer invalidates the pointer.
   char *Append(ssize_t length);
@@ -24,6 +33,17 @@ class Buffer {
 	void Append(const std::string &str);
 	void Append(const Buffer &other);
 
+	// Takes over memory owned by someone else without copying it. release gets called with
+	// data once no Buffer refers to it anymore - possibly on another thread, if the data got
+	// passed along. Leave it empty for data that outlives all buffers, like string literals.
+	void Adopt(char *data, size_t length, ReleaseFunc release = ReleaseFunc());
+
+	// For writing straight into the buffer, like recv() does: returns room for at least
+	// minLength bytes at the end, and how much room there actually is in *room. Nothing gets
+	// added until Commit, which must come before any other operation on the buffer.
+	char *Reserve(size_t minLength, size_t *room);
+	void Commit(size_t length);
+
   // Various types. Useful for varz etc. Appends a string representation of the
   // value, rather than a binary representation.
   void AppendValue(int value);
@@ -39,6 +59,8 @@ class Buffer {
 
   void Take(size_t length, std::string *dest);
   void Take(size_t length, char *dest);
+  // Moves the data over, sharing blocks rather than copying where they're big enough.
+  void Take(size_t length, Buffer *dest);
   void TakeAll(std::string *dest) { Take(size(), dest); }
   // On failure, return value < 0 and *dest is unchanged.
   // Strips off the actual CRLF from the result.
@@ -59,12 +81,19 @@ class Buffer {
 
   // Simple I/O.
 
-  // Writes the entire buffer to the file descriptor. Also resets the
-  // size to zero. On failure, data remains in buffer and nothing is
-  // written.
+  // Writes the entire buffer to the file descriptor, gathering the chunks with writev where
+  // available. Also resets the size to zero. On failure, whatever wasn't written remains
+  // in the buffer.
 	bool Flush(int fd);
+	bool Flush(FILE *file);  // Same, for stdio files.
 	bool FlushToFile(const char *filename);
   bool FlushSocket(uintptr_t sock);  // Windows portability
+  // A single write of as much as the fd or socket takes right now, for non-blocking ones.
+  // Returns the number of bytes written and taken out of the buffer, or < 0 on error (check
+  // errno for EAGAIN), like write().
+  ssize_t WriteSome(uintptr_t fd);
+  // A single read of up to maxLength, straight into the buffer. Same return value as recv.
+  int ReadSome(int fd, size_t maxLength);
 
   bool ReadAll(int fd, int hintSize = 0);
   bool ReadAllWithProgress(int fd, int knownSize, float *progress);
@@ -74,13 +103,32 @@ class Buffer {
   int Read(int fd, size_t sz);
 
   // Utilities. Try to avoid checking for size.
-  size_t size() const { return data_.size(); }
+  size_t size() const { return size_; }
   bool empty() const { return size() == 0; }
-  void clear() { data_.resize(0); }
+  void clear();
 
  private:
-  // TODO: Find a better internal representation, like a cord.
-  std::vector<char> data_;
+  struct Block;
+  // A slice [begin, end) of a block.
+  struct Chunk {
+    Block *block;
+    size_t begin;
+    size_t end;
+  };
+
+  static Block *NewBlock(size_t capacity);
+  static void AddRef(Block *block);
+  static void Release(Block *block);
+  // Room at the end of the last chunk's block, if we may write there.
+  size_t TailRoom() const;
+#ifndef _WIN32
+  bool WriteGathered(int fd);
+#endif
+
+  std::deque<Chunk> chunks_;
+  size_t size_;
+  // A block ReadSome set up to spill into but didn't need, kept for the next call.
+  Block *spare_;
 
   DISALLOW_COPY_AND_ASSIGN(Buffer);
 };
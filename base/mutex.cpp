@@ -0,0 +1,154 @@
+#include <string.h>
+#include <algorithm>
+
+#include "base/logging.h"
+#include "base/mutex.h"
+
+#ifdef MUTEX_INSTRUMENTATION
+
+#include <atomic>
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+#define MAX_LOCK_SITES 256
+
+struct LockSite {
+	std::atomic<const char *> name;
+	std::atomic<int64_t> acquisitions;
+	std::atomic<int64_t> contended;
+	std::atomic<int64_t> waitTime;
+	std::atomic<int64_t> maxWaitTime;
+	std::atomic<int64_t> holdTime;
+	std::atomic<int64_t> maxHoldTime;
+};
+
+// Plain zero-initialized statics, since mutexes get constructed during static init too.
+// Sites are only ever added, and the spinlock only guards adding them.
+static LockSite sites[MAX_LOCK_SITES];
+static std::atomic<int> numSites;
+static std::atomic_flag sitesLock = ATOMIC_FLAG_INIT;
+
+static const char *const UNNAMED = "(unnamed)";
+
+LockSite *GetLockSite(const char *name) {
+	if (!name)
+		name = UNNAMED;
+	while (sitesLock.test_and_set(std::memory_order_acquire)) {
+	}
+	LockSite *site = 0;
+	int count = numSites.load(std::memory_order_relaxed);
+	for (int i = 0; i < count; i++) {
+		if (!strcmp(sites[i].name.load(std::memory_order_relaxed), name)) {
+			site = &sites[i];
+			break;
+		}
+	}
+	if (!site) {
+		// Out of room: lump the rest together rather than failing.
+		site = &sites[count < MAX_LOCK_SITES ? count : MAX_LOCK_SITES - 1];
+		if (count < MAX_LOCK_SITES) {
+			site->name.store(name, std::memory_order_relaxed);
+			numSites.store(count + 1, std::memory_order_release);
+		}
+	}
+	sitesLock.clear(std::memory_order_release);
+	return site;
+}
+
+int64_t LockStatsNow() {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency;
+	if (frequency.QuadPart == 0)
+		QueryPerformanceFrequency(&frequency);
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	return (int64_t)((double)counter.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+#else
+	timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (int64_t)time.tv_sec * 1000000000LL + time.tv_nsec;
+#endif
+}
+
+static void UpdateMax(std::atomic<int64_t> &max, int64_t value) {
+	int64_t current = max.load(std::memory_order_relaxed);
+	while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+	}
+}
+
+void LockStatsRecordAcquire(LockSite *site, bool contended, int64_t waitTime) {
+	site->acquisitions.fetch_add(1, std::memory_order_relaxed);
+	if (contended) {
+		site->contended.fetch_add(1, std::memory_order_relaxed);
+		site->waitTime.fetch_add(waitTime, std::memory_order_relaxed);
+		UpdateMax(site->maxWaitTime, waitTime);
+	}
+}
+
+void LockStatsRecordHold(LockSite *site, int64_t holdTime) {
+	site->holdTime.fetch_add(holdTime, std::memory_order_relaxed);
+	UpdateMax(site->maxHoldTime, holdTime);
+}
+
+static bool CompareWaitTime(const LockStatsEntry &a, const LockStatsEntry &b) {
+	return a.waitTime > b.waitTime;
+}
+
+void GetLockStats(std::vector<LockStatsEntry> *stats) {
+	stats->clear();
+	int count = numSites.load(std::memory_order_acquire);
+	for (int i = 0; i < count; i++) {
+		const LockSite &site = sites[i];
+		LockStatsEntry entry;
+		entry.name = site.name.load(std::memory_order_relaxed);
+		entry.acquisitions = site.acquisitions.load(std::memory_order_relaxed);
+		entry.contended = site.contended.load(std::memory_order_relaxed);
+		entry.waitTime = site.waitTime.load(std::memory_order_relaxed) / 1e9;
+		entry.maxWaitTime = site.maxWaitTime.load(std::memory_order_relaxed) / 1e9;
+		entry.holdTime = site.holdTime.load(std::memory_order_relaxed) / 1e9;
+		entry.maxHoldTime = site.maxHoldTime.load(std::memory_order_relaxed) / 1e9;
+		stats->push_back(entry);
+	}
+	std::sort(stats->begin(), stats->end(), &CompareWaitTime);
+}
+
+void ResetLockStats() {
+	int count = numSites.load(std::memory_order_acquire);
+	for (int i = 0; i < count; i++) {
+		LockSite &site = sites[i];
+		site.acquisitions.store(0, std::memory_order_relaxed);
+		site.contended.store(0, std::memory_order_relaxed);
+		site.waitTime.store(0, std::memory_order_relaxed);
+		site.maxWaitTime.store(0, std::memory_order_relaxed);
+		site.holdTime.store(0, std::memory_order_relaxed);
+		site.maxHoldTime.store(0, std::memory_order_relaxed);
+	}
+}
+
+#else
+
+void GetLockStats(std::vector<LockStatsEntry> *stats) {
+	stats->clear();
+}
+
+void ResetLockStats() {
+}
+
+#endif
+
+void LogLockStats() {
+	std::vector<LockStatsEntry> stats;
+	GetLockStats(&stats);
+	if (stats.empty()) {
+		ILOG("No lock stats (build with MUTEX_INSTRUMENTATION)");
+		return;
+	}
+	ILOG("%-32s %12s %10s %10s %10s %10s %10s", "lock (times in ms)", "acquired", "contended", "wait", "max wait", "hold", "max hold");
+	for (size_t i = 0; i < stats.size(); i++) {
+		const LockStatsEntry &e = stats[i];
+		ILOG("%-32s %12lld %10lld %10.3f %10.3f %10.3f %10.3f", e.name, (long long)e.acquisitions, (long long)e.contended,
+			e.waitTime * 1000.0, e.maxWaitTime * 1000.0, e.holdTime * 1000.0, e.maxHoldTime * 1000.0);
+	}
+}
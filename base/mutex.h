@@ -7,6 +7,11 @@
 
 // TODO: Need to clean up these primitives and put them in a reasonable namespace.
 
+// Build with MUTEX_INSTRUMENTATION defined to record acquisitions, contention, wait time and hold
+// time per named lock (mutexes sharing a name share the stats, so name them after the site,
+// like "PrioritizedWorkQueue"). Read them back with GetLockStats / LogLockStats. Without it,
+// names are ignored and the stats stay empty.
+
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #define NOMINMAX
@@ -26,8 +31,38 @@
 #include <sys/time.h>
 #endif
 
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <vector>
+
 #include "base/basictypes.h"
 
+struct LockStatsEntry {
+	const char *name;  // "(unnamed)" for all the mutexes without a name.
+	int64_t acquisitions;  // Not counting recursive ones.
+	int64_t contended;  // Acquisitions that had to wait.
+	// In seconds.
+	double waitTime;
+	double maxWaitTime;
+	double holdTime;
+	double maxHoldTime;
+};
+
+// Sorted by total wait time, worst first.
+void GetLockStats(std::vector<LockStatsEntry> *stats);
+void ResetLockStats();
+// Dumps the table with ILOG, say at shutdown.
+void LogLockStats();
+
+#ifdef MUTEX_INSTRUMENTATION
+struct LockSite;
+LockSite *GetLockSite(const char *name);
+int64_t LockStatsNow();  // Nanoseconds.
+void LockStatsRecordAcquire(LockSite *site, bool contended, int64_t waitTime);
+void LockStatsRecordHold(LockSite *site, int64_t holdTime);
+#endif
+
 struct atomic_flag_init {
 	atomic_flag_init() : v(false) {
 	}
@@ -75,7 +110,8 @@ class recursive_mutex {
 	typedef pthread_mutex_t mutexType;
 #endif
 public:
-	recursive_mutex() {
+	// The name only matters with MUTEX_INSTRUMENTATION.
+	explicit recursive_mutex(const char *name = 0) {
 #ifdef _WIN32
 		InitializeCriticalSection(&mut_);
 #else
@@ -84,6 +120,11 @@ public:
 		pthread_mutexattr_init(&attr);
 		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
 		pthread_mutex_init(&mut_, &attr);
+#endif
+#ifdef MUTEX_INSTRUMENTATION
+		site_ = GetLockSite(name);
+		depth_ = 0;
+		lockedAt_ = 0;
 #endif
 	}
 	~recursive_mutex() {
@@ -95,22 +136,37 @@ public:
 	}
 
 	bool trylock() {
-#ifdef _WIN32
-		return TryEnterCriticalSection(&mut_) != FALSE;
+#ifdef MUTEX_INSTRUMENTATION
+		if (!native_trylock())
+			return false;
+		acquired(false, 0);
+		return true;
 #else
-		return pthread_mutex_trylock(&mut_) != EBUSY;
+		return native_trylock();
 #endif
 	}
 
 	void lock() {
-#ifdef _WIN32
-		EnterCriticalSection(&mut_);
+#ifdef MUTEX_INSTRUMENTATION
+		if (native_trylock()) {
+			acquired(false, 0);
+		} else {
+			int64_t start = LockStatsNow();
+			native_lock();
+			acquired(true, LockStatsNow() - start);
+		}
 #else
-		pthread_mutex_lock(&mut_);
+		native_lock();
 #endif
 	}
 
 	void unlock() {
+#ifdef MUTEX_INSTRUMENTATION
+		// Still holding it, so these are safe to touch.
+		if (--depth_ == 0) {
+			LockStatsRecordHold(site_, LockStatsNow() - lockedAt_);
+		}
+#endif
 #ifdef _WIN32
 		LeaveCriticalSection(&mut_);
 #else
@@ -123,6 +179,44 @@ public:
 	}
 
 private:
+	bool native_trylock() {
+#ifdef _WIN32
+		return TryEnterCriticalSection(&mut_) != FALSE;
+#else
+		return pthread_mutex_trylock(&mut_) != EBUSY;
+#endif
+	}
+
+	void native_lock() {
+#ifdef _WIN32
+		EnterCriticalSection(&mut_);
+#else
+		pthread_mutex_lock(&mut_);
+#endif
+	}
+
+#ifdef MUTEX_INSTRUMENTATION
+	void acquired(bool contended, int64_t waitTime) {
+		if (depth_++ == 0) {
+			lockedAt_ = LockStatsNow();
+			LockStatsRecordAcquire(site_, contended, waitTime);
+		}
+	}
+
+	// Waiting on a condition variable lets go of the mutex, which shouldn't count as holding it.
+	friend class condition_variable;
+	void release_for_wait() {
+		LockStatsRecordHold(site_, LockStatsNow() - lockedAt_);
+	}
+	void reacquired_after_wait() {
+		lockedAt_ = LockStatsNow();
+	}
+
+	LockSite *site_;
+	int depth_;
+	int64_t lockedAt_;
+#endif
+
 	mutexType mut_;
 	recursive_mutex(const recursive_mutex &other);
 };
@@ -136,6 +230,120 @@ private:
 	recursive_mutex &mtx_;
 };
 
+// Reader-writer lock, for read-mostly data. Any number of readers at once, or one writer.
+// Unlike recursive_mutex, not recursive - not even for readers, since a writer queued up in
+// between would deadlock them. 32-bit Windows builds (XP) fall back to a critical section,
+// so readers don't run in parallel there.
+class rw_mutex {
+public:
+	rw_mutex() {
+#ifdef _WIN32
+#ifdef _M_X64
+		InitializeSRWLock(&lock_);
+#else
+		InitializeCriticalSection(&lock_);
+#endif
+#else
+		pthread_rwlockattr_t attr;
+		pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+		// The default lets a steady stream of readers starve writers forever.
+		pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+		pthread_rwlock_init(&lock_, &attr);
+		pthread_rwlockattr_destroy(&attr);
+#endif
+	}
+	~rw_mutex() {
+#ifdef _WIN32
+#ifndef _M_X64
+		DeleteCriticalSection(&lock_);
+#endif
+#else
+		pthread_rwlock_destroy(&lock_);
+#endif
+	}
+
+	void lock() {
+#ifdef _WIN32
+#ifdef _M_X64
+		AcquireSRWLockExclusive(&lock_);
+#else
+		EnterCriticalSection(&lock_);
+#endif
+#else
+		pthread_rwlock_wrlock(&lock_);
+#endif
+	}
+
+	void unlock() {
+#ifdef _WIN32
+#ifdef _M_X64
+		ReleaseSRWLockExclusive(&lock_);
+#else
+		LeaveCriticalSection(&lock_);
+#endif
+#else
+		pthread_rwlock_unlock(&lock_);
+#endif
+	}
+
+	void lock_shared() {
+#ifdef _WIN32
+#ifdef _M_X64
+		AcquireSRWLockShared(&lock_);
+#else
+		EnterCriticalSection(&lock_);
+#endif
+#else
+		pthread_rwlock_rdlock(&lock_);
+#endif
+	}
+
+	void unlock_shared() {
+#ifdef _WIN32
+#ifdef _M_X64
+		ReleaseSRWLockShared(&lock_);
+#else
+		LeaveCriticalSection(&lock_);
+#endif
+#else
+		pthread_rwlock_unlock(&lock_);
+#endif
+	}
+
+private:
+#ifdef _WIN32
+#ifdef _M_X64
+	SRWLOCK lock_;
+#else
+	CRITICAL_SECTION lock_;
+#endif
+#else
+	pthread_rwlock_t lock_;
+#endif
+
+	DISALLOW_COPY_AND_ASSIGN(rw_mutex);
+};
+
+class read_lock_guard {
+public:
+	read_lock_guard(rw_mutex &mtx) : mtx_(mtx) {mtx_.lock_shared();}
+	~read_lock_guard() {mtx_.unlock_shared();}
+
+private:
+	rw_mutex &mtx_;
+};
+
+class write_lock_guard {
+public:
+	write_lock_guard(rw_mutex &mtx) : mtx_(mtx) {mtx_.lock();}
+	~write_lock_guard() {mtx_.unlock();}
+
+private:
+	rw_mutex &mtx_;
+};
+
 
 // Like a Windows event, or a modern condition variable.
 
@@ -269,8 +477,43 @@ public:
 
 	// notify_all is not really possible to implement with win32 events?
 	// Can be done just fine using WakeAllConditionVariable though.
+	void notify_all() {
+#ifdef _WIN32
+#ifdef _M_X64
+		WakeAllConditionVariable(&cond_);
+#else
+		// Should be locked at this time.
+		if (waiting_ != 0) {
+			ReleaseSemaphore(sema_, waiting_, NULL);
+		}
+#endif
+#else
+		pthread_cond_broadcast(&event_);
+#endif
+	}
 
 	void wait(recursive_mutex &mtx) {
+#ifdef MUTEX_INSTRUMENTATION
+		mtx.release_for_wait();
+		native_wait(mtx);
+		mtx.reacquired_after_wait();
+#else
+		native_wait(mtx);
+#endif
+	}
+
+	void wait_for(recursive_mutex &mtx, int milliseconds) {
+#ifdef MUTEX_INSTRUMENTATION
+		mtx.release_for_wait();
+		native_wait_for(mtx, milliseconds);
+		mtx.reacquired_after_wait();
+#else
+		native_wait_for(mtx, milliseconds);
+#endif
+	}
+
+private:
+	void native_wait(recursive_mutex &mtx) {
 		// broken http://msdn.microsoft.com/en-us/library/windows/desktop/ms686301(v=vs.85).aspx
 #ifdef _WIN32
 #ifdef _M_X64
@@ -279,10 +522,11 @@ public:
 		// Since a semaphore keeps a count, the window between unlock and lock won't cause us to deadlock.
 		// However, we could wake early incorrectly (if the semaphore is signalled already.)
 		// That's better than deadlocking or forgetting to wake.
+		// Straight to the critical section, so that this doesn't show up in the lock stats.
 		waiting_++;
-		mtx.unlock();
+		LeaveCriticalSection(&mtx.native_handle());
 		WaitForSingleObject(sema_, INFINITE);
-		mtx.lock();
+		EnterCriticalSection(&mtx.native_handle());
 		waiting_--;
 #endif
 #else
@@ -290,7 +534,7 @@ public:
 #endif
 	}
 
-	void wait_for(recursive_mutex &mtx, int milliseconds) {
+	void native_wait_for(recursive_mutex &mtx, int milliseconds) {
 #ifdef _WIN32
 #ifdef _M_X64
 		SleepConditionVariableCS(&cond_, &mtx.native_handle(), milliseconds);
@@ -299,9 +543,9 @@ public:
 		// However, we could wake early incorrectly (if the semaphore is signalled already.)
 		// That's better than deadlocking or forgetting to wake.
 		waiting_++;
-		mtx.unlock();
+		LeaveCriticalSection(&mtx.native_handle());
 		WaitForSingleObject(sema_, milliseconds);
-		mtx.lock();
+		EnterCriticalSection(&mtx.native_handle());
 		waiting_--;
 #endif
 #else
@@ -320,7 +564,6 @@ public:
 #endif
 	}
 
-private:
 #ifdef _WIN32
 #ifdef _M_X64
 	CONDITION_VARIABLE cond_;
@@ -332,3 +575,124 @@ private:
 	pthread_cond_t event_;
 #endif
 };
+
+// Tells the CPU we're spinning, which saves power and lets a hyperthread sibling run.
+inline void cpu_relax() {
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+	_mm_pause();
+#elif defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || (defined(__ARM_ARCH) && __ARM_ARCH >= 7)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+// For short critical sections, where going to sleep costs more than the wait itself. Spins a
+// while first, and only parks the thread if the owner still hasn't let go. Not recursive.
+class spin_mutex {
+public:
+	spin_mutex() : state_(UNLOCKED), parkMutex_("spin_mutex::park") {}
+
+	bool trylock() {
+		int expected = UNLOCKED;
+		return state_.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire);
+	}
+
+	void lock() {
+		for (int i = 0; i < SPIN_COUNT; i++) {
+			if (state_.load(std::memory_order_relaxed) == UNLOCKED && trylock())
+				return;
+			cpu_relax();
+		}
+		// Slow path. Marking it as having sleepers makes unlock() wake someone up. We can't know
+		// if there's anyone else still asleep after waking, so assume there is.
+		lock_guard guard(parkMutex_);
+		while (state_.exchange(PARKED, std::memory_order_acquire) != UNLOCKED) {
+			parked_.wait(parkMutex_);
+		}
+	}
+
+	void unlock() {
+		if (state_.exchange(UNLOCKED, std::memory_order_release) == PARKED) {
+			// Taking the mutex makes sure the sleeper is actually waiting before we signal.
+			lock_guard guard(parkMutex_);
+			parked_.notify_one();
+		}
+	}
+
+private:
+	enum {
+		UNLOCKED = 0,
+		LOCKED = 1,
+		PARKED = 2,  // Locked, and someone may be asleep waiting for it.
+		SPIN_COUNT = 100,
+	};
+	std::atomic<int> state_;
+	recursive_mutex parkMutex_;
+	condition_variable parked_;
+
+	DISALLOW_COPY_AND_ASSIGN(spin_mutex);
+};
+
+class spin_lock_guard {
+public:
+	spin_lock_guard(spin_mutex &mtx) : mtx_(mtx) {mtx_.lock();}
+	~spin_lock_guard() {mtx_.unlock();}
+
+private:
+	spin_mutex &mtx_;
+};
+
+// Sequence lock for small plain-old-data snapshots, like the latest input state. Readers never
+// block the writer and never write anything themselves, they just retry if a write happened
+// while they were copying. One writer at a time - if there can be several, put a mutex around
+// write(). T must be trivially copyable.
+template <typename T>
+class seqlock {
+public:
+	seqlock() : sequence_(0) {
+		T value = T();
+		write(value);
+	}
+
+	void write(const T &value) {
+		uint64_t words[WORDS];
+		words[WORDS - 1] = 0;
+		memcpy(words, &value, sizeof(T));
+		unsigned int seq = sequence_.load(std::memory_order_relaxed);
+		// Odd while writing. Release on the data keeps the odd store from moving after it.
+		sequence_.store(seq + 1, std::memory_order_relaxed);
+		for (int i = 0; i < WORDS; i++) {
+			data_[i].store(words[i], std::memory_order_release);
+		}
+		sequence_.store(seq + 2, std::memory_order_release);
+	}
+
+	T read() const {
+		uint64_t words[WORDS];
+		while (true) {
+			unsigned int seq = sequence_.load(std::memory_order_acquire);
+			if (seq & 1) {
+				cpu_relax();
+				continue;
+			}
+			// Acquire keeps the second sequence load from moving up before the data.
+			for (int i = 0; i < WORDS; i++) {
+				words[i] = data_[i].load(std::memory_order_acquire);
+			}
+			if (sequence_.load(std::memory_order_relaxed) == seq)
+				break;
+		}
+		T value;
+		memcpy(&value, words, sizeof(T));
+		return value;
+	}
+
+private:
+	enum { WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t) };
+	std::atomic<unsigned int> sequence_;
+	// Atomic words rather than a T, so that reading while it's being written is well defined.
+	std::atomic<uint64_t> data_[WORDS];
+
+	DISALLOW_COPY_AND_ASSIGN(seqlock);
+};
@@ -0,0 +1,217 @@
+// Compares the lock flavors in base/mutex.h on the workloads they're meant for:
+// read-mostly lookups (rw_mutex), tiny critical sections (spin_mutex) and small snapshots
+// read by many threads while one thread keeps updating them (seqlock). Each one is measured
+// against plain recursive_mutex + lock_guard, which is what everything used before.
+
+#include <stdio.h>
+#include <map>
+#include <vector>
+
+#include "base/functional.h"
+#include "base/mutex.h"
+#include "base/timeutil.h"
+#include "thread/thread.h"
+
+#define RUN_SECONDS 0.5
+#define TABLE_SIZE 256
+// One write per this many lookups in the read-mostly test.
+#define WRITE_EVERY 1000
+
+struct BenchState {
+	std::atomic<bool> stop;
+	std::atomic<long long> ops;
+};
+
+// Keeps the lookups from being optimized away.
+static std::atomic<long long> benchSink;
+
+// Read-mostly table.
+
+struct Table {
+	std::map<int, int> values;
+	recursive_mutex mutex;
+	rw_mutex rwMutex;
+};
+
+static void TableWorker(Table *table, bool useRw, BenchState *state) {
+	long long ops = 0;
+	int key = 0;
+	long long sink = 0;
+	while (!state->stop) {
+		for (int i = 0; i < 100; i++) {
+			key = (key * 1103515245 + 12345) & (TABLE_SIZE - 1);
+			bool write = (ops + i) % WRITE_EVERY == 0;
+			if (useRw) {
+				if (write) {
+					write_lock_guard guard(table->rwMutex);
+					table->values[key]++;
+				} else {
+					read_lock_guard guard(table->rwMutex);
+					sink += table->values.find(key)->second;
+				}
+			} else {
+				lock_guard guard(table->mutex);
+				if (write)
+					table->values[key]++;
+				else
+					sink += table->values.find(key)->second;
+			}
+		}
+		ops += 100;
+	}
+	benchSink += sink;
+	state->ops += ops;
+}
+
+// Tiny critical section.
+
+struct Counter {
+	long long value;
+	recursive_mutex mutex;
+	spin_mutex spin;
+};
+
+static void CounterWorker(Counter *counter, bool useSpin, BenchState *state) {
+	long long ops = 0;
+	while (!state->stop) {
+		for (int i = 0; i < 100; i++) {
+			if (useSpin) {
+				spin_lock_guard guard(counter->spin);
+				counter->value++;
+			} else {
+				lock_guard guard(counter->mutex);
+				counter->value++;
+			}
+		}
+		ops += 100;
+	}
+	state->ops += ops;
+}
+
+// Snapshot.
+
+struct Snapshot {
+	float x;
+	float y;
+	uint32_t buttons;
+	uint32_t frame;
+};
+
+struct Shared {
+	Snapshot snapshot;
+	recursive_mutex mutex;
+	seqlock<Snapshot> seq;
+};
+
+static void SnapshotWriter(Shared *shared, bool useSeq, BenchState *state) {
+	uint32_t frame = 0;
+	while (!state->stop) {
+		Snapshot s;
+		s.x = (float)frame;
+		s.y = (float)frame;
+		s.buttons = frame;
+		s.frame = frame++;
+		if (useSeq) {
+			shared->seq.write(s);
+		} else {
+			lock_guard guard(shared->mutex);
+			shared->snapshot = s;
+		}
+	}
+}
+
+static void SnapshotReader(Shared *shared, bool useSeq, BenchState *state) {
+	long long ops = 0;
+	long long torn = 0;
+	while (!state->stop) {
+		for (int i = 0; i < 100; i++) {
+			Snapshot s;
+			if (useSeq) {
+				s = shared->seq.read();
+			} else {
+				lock_guard guard(shared->mutex);
+				s = shared->snapshot;
+			}
+			if (s.buttons != s.frame)
+				torn++;
+		}
+		ops += 100;
+	}
+	if (torn)
+		printf("torn snapshots: %lld\n", torn);
+	state->ops += ops;
+}
+
+// Runs the threads for RUN_SECONDS, returns millions of operations per second.
+static double Run(const std::vector<std::function<void()> > &funcs, BenchState *state) {
+	state->stop = false;
+	state->ops = 0;
+	std::vector<std::thread *> threads;
+	double start = real_time_now();
+	for (size_t i = 0; i < funcs.size(); i++) {
+		threads.push_back(new std::thread(funcs[i]));
+	}
+	sleep_ms((int)(RUN_SECONDS * 1000));
+	state->stop = true;
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+	double elapsed = real_time_now() - start;
+	return state->ops / elapsed / 1000000.0;
+}
+
+int main() {
+	const int threadCounts[] = { 1, 2, 4, 8 };
+	BenchState state;
+
+	printf("Read-mostly map lookups, 1 write per %d (M ops/s)\n", WRITE_EVERY);
+	printf("%8s %14s %14s\n", "threads", "mutex", "rw_mutex");
+	for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) {
+		double results[2];
+		for (int rw = 0; rw < 2; rw++) {
+			Table table;
+			for (int i = 0; i < TABLE_SIZE; i++)
+				table.values[i] = i;
+			std::vector<std::function<void()> > funcs;
+			for (int i = 0; i < threadCounts[t]; i++)
+				funcs.push_back(std::bind(&TableWorker, &table, rw != 0, &state));
+			results[rw] = Run(funcs, &state);
+		}
+		printf("%8d %14.2f %14.2f\n", threadCounts[t], results[0], results[1]);
+	}
+
+	printf("\nShared counter increments (M ops/s)\n");
+	printf("%8s %14s %14s\n", "threads", "mutex", "spin_mutex");
+	for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) {
+		double results[2];
+		for (int spin = 0; spin < 2; spin++) {
+			Counter counter;
+			counter.value = 0;
+			std::vector<std::function<void()> > funcs;
+			for (int i = 0; i < threadCounts[t]; i++)
+				funcs.push_back(std::bind(&CounterWorker, &counter, spin != 0, &state));
+			results[spin] = Run(funcs, &state);
+			if (counter.value != state.ops)
+				printf("lost increments!\n");
+		}
+		printf("%8d %14.2f %14.2f\n", threadCounts[t], results[0], results[1]);
+	}
+
+	printf("\nSnapshot reads with one busy writer (M reads/s)\n");
+	printf("%8s %14s %14s\n", "readers", "mutex", "seqlock");
+	for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) {
+		double results[2];
+		for (int seq = 0; seq < 2; seq++) {
+			Shared shared;
+			memset(&shared.snapshot, 0, sizeof(shared.snapshot));
+			std::vector<std::function<void()> > funcs;
+			funcs.push_back(std::bind(&SnapshotWriter, &shared, seq != 0, &state));
+			for (int i = 0; i < threadCounts[t]; i++)
+				funcs.push_back(std::bind(&SnapshotReader, &shared, seq != 0, &state));
+			results[seq] = Run(funcs, &state);
+		}
+		printf("%8d %14.2f %14.2f\n", threadCounts[t], results[0], results[1]);
+	}
+	return 0;
+}
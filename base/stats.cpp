@@ -0,0 +1,238 @@
+#include <limits>
+#include <vector>
+
+#include "base/mutex.h"
+#include "base/stats.h"
+
+namespace {
+
+// Handles are often globals in other files, so the registry has to exist before any of them
+// gets constructed - hence the function static rather than plain globals.
+struct StatsRegistry {
+	recursive_mutex mutex;
+	std::vector<StatCounter *> counters;
+	std::vector<StatGauge *> gauges;
+	std::vector<StatHistogram *> histograms;
+	// INCSTAT.
+	std::map<std::string, int64_t> named;
+};
+
+StatsRegistry &Registry() {
+	static StatsRegistry registry;
+	return registry;
+}
+
+template <typename T>
+void Unregister(std::vector<T *> &list, T *item) {
+	lock_guard guard(Registry().mutex);
+	for (size_t i = 0; i < list.size(); i++) {
+		if (list[i] == item) {
+			list.erase(list.begin() + i);
+			return;
+		}
+	}
+}
+
+std::atomic<int> nextShard;
+// Shard + 1, so that zero means unassigned.
+__THREAD int threadShard;
+
+}  // namespace
+
+int GetStatShard() {
+	int shard = threadShard;
+	if (shard == 0) {
+		shard = (nextShard++ & 0xFFFF) + 1;
+		threadShard = shard;
+	}
+	return shard - 1;
+}
+
+#ifdef STATS_ENABLE
+
+void IncrementStat(const char *name) {
+	StatsRegistry &registry = Registry();
+	lock_guard guard(registry.mutex);
+	registry.named[name]++;
+}
+
+#endif
+
+StatCounter::StatCounter(const char *name) : name_(name) {
+	lock_guard guard(Registry().mutex);
+	Registry().counters.push_back(this);
+}
+
+StatCounter::~StatCounter() {
+	Unregister(Registry().counters, this);
+}
+
+int64_t StatCounter::Get() const {
+	int64_t total = 0;
+	for (int i = 0; i < STAT_SHARDS; i++) {
+		total += shards_[i].value.load(std::memory_order_relaxed);
+	}
+	return total;
+}
+
+void StatCounter::Reset() {
+	for (int i = 0; i < STAT_SHARDS; i++) {
+		shards_[i].value.store(0, std::memory_order_relaxed);
+	}
+}
+
+StatGauge::StatGauge(const char *name) : name_(name), value_(0) {
+	lock_guard guard(Registry().mutex);
+	Registry().gauges.push_back(this);
+}
+
+StatGauge::~StatGauge() {
+	Unregister(Registry().gauges, this);
+}
+
+StatHistogram::Shard::Shard() : sum(0) {
+	for (int i = 0; i < STAT_HISTOGRAM_BUCKETS; i++) {
+		buckets[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+StatHistogram::StatHistogram(const char *name)
+	: name_(name), min_(std::numeric_limits<int64_t>::max()), max_(0) {
+	lock_guard guard(Registry().mutex);
+	Registry().histograms.push_back(this);
+}
+
+StatHistogram::~StatHistogram() {
+	Unregister(Registry().histograms, this);
+}
+
+// Values below 2^SUB_BITS get a bucket each. Above that, each power of two is split into
+// 2^SUB_BITS equal buckets, picked by the bits right below the highest set bit.
+int StatHistogram::BucketForValue(int64_t value) {
+	const int64_t subCount = 1 << STAT_HISTOGRAM_SUB_BITS;
+	if (value < subCount)
+		return value < 0 ? 0 : (int)value;
+	int msb = 0;
+	uint64_t v = (uint64_t)value;
+	while (v >>= 1)
+		msb++;
+	int shift = msb - STAT_HISTOGRAM_SUB_BITS;
+	int bucket = (shift + 1) * (int)subCount + (int)((value >> shift) - subCount);
+	return bucket < STAT_HISTOGRAM_BUCKETS ? bucket : STAT_HISTOGRAM_BUCKETS - 1;
+}
+
+int64_t StatHistogram::BucketMaxValue(int bucket) {
+	const int64_t subCount = 1 << STAT_HISTOGRAM_SUB_BITS;
+	if (bucket < subCount)
+		return bucket;
+	int shift = bucket / (int)subCount - 1;
+	int64_t lower = (subCount + bucket % subCount) << shift;
+	return lower + ((int64_t)1 << shift) - 1;
+}
+
+void StatHistogram::Record(int64_t value) {
+#ifdef STATS_ENABLE
+	if (value < 0)
+		value = 0;
+	Shard &shard = shards_[GetStatShard() & (STAT_HISTOGRAM_SHARDS - 1)];
+	shard.sum.fetch_add(value, std::memory_order_relaxed);
+	shard.buckets[BucketForValue(value)].fetch_add(1, std::memory_order_relaxed);
+
+	// These only get written when there's a new extreme, which quickly becomes rare.
+	int64_t current = min_.load(std::memory_order_relaxed);
+	while (value < current && !min_.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+	}
+	current = max_.load(std::memory_order_relaxed);
+	while (value > current && !max_.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+	}
+#endif
+}
+
+void StatHistogram::GetSnapshot(StatHistogramSnapshot *snapshot) const {
+	std::vector<int64_t> buckets(STAT_HISTOGRAM_BUCKETS);
+	snapshot->sum = 0;
+	for (int s = 0; s < STAT_HISTOGRAM_SHARDS; s++) {
+		snapshot->sum += shards_[s].sum.load(std::memory_order_relaxed);
+		for (int i = 0; i < STAT_HISTOGRAM_BUCKETS; i++) {
+			buckets[i] += shards_[s].buckets[i].load(std::memory_order_relaxed);
+		}
+	}
+	int64_t count = 0;
+	for (int i = 0; i < STAT_HISTOGRAM_BUCKETS; i++) {
+		count += buckets[i];
+	}
+	snapshot->count = count;
+	snapshot->min = count ? min_.load(std::memory_order_relaxed) : 0;
+	snapshot->max = count ? max_.load(std::memory_order_relaxed) : 0;
+
+	const double percentiles[] = { 0.50, 0.90, 0.99, 0.999 };
+	int64_t *results[] = { &snapshot->p50, &snapshot->p90, &snapshot->p99, &snapshot->p999 };
+	int bucket = 0;
+	int64_t seen = 0;
+	for (int p = 0; p < 4; p++) {
+		if (count == 0) {
+			*results[p] = 0;
+			continue;
+		}
+		// Nearest rank.
+		int64_t rank = (int64_t)(percentiles[p] * count + 0.999999);
+		if (rank < 1)
+			rank = 1;
+		while (bucket < STAT_HISTOGRAM_BUCKETS - 1 && seen + buckets[bucket] < rank) {
+			seen += buckets[bucket];
+			bucket++;
+		}
+		int64_t value = BucketMaxValue(bucket);
+		*results[p] = value < snapshot->max ? value : snapshot->max;
+	}
+}
+
+void StatHistogram::Reset() {
+	for (int s = 0; s < STAT_HISTOGRAM_SHARDS; s++) {
+		shards_[s].sum.store(0, std::memory_order_relaxed);
+		for (int i = 0; i < STAT_HISTOGRAM_BUCKETS; i++) {
+			shards_[s].buckets[i].store(0, std::memory_order_relaxed);
+		}
+	}
+	min_.store(std::numeric_limits<int64_t>::max(), std::memory_order_relaxed);
+	max_.store(0, std::memory_order_relaxed);
+}
+
+void GetStatsSnapshot(StatsSnapshot *snapshot, bool reset) {
+	StatsRegistry &registry = Registry();
+	lock_guard guard(registry.mutex);
+	snapshot->counters = registry.named;
+	snapshot->gauges.clear();
+	snapshot->histograms.clear();
+	for (size_t i = 0; i < registry.counters.size(); i++) {
+		// Several handles with the same name (say, one per instance) add up.
+		snapshot->counters[registry.counters[i]->name()] += registry.counters[i]->Get();
+	}
+	for (size_t i = 0; i < registry.gauges.size(); i++) {
+		snapshot->gauges[registry.gauges[i]->name()] = registry.gauges[i]->Get();
+	}
+	for (size_t i = 0; i < registry.histograms.size(); i++) {
+		registry.histograms[i]->GetSnapshot(&snapshot->histograms[registry.histograms[i]->name()]);
+	}
+	if (reset) {
+		ResetStats();
+	}
+}
+
+void ResetStats() {
+	StatsRegistry &registry = Registry();
+	lock_guard guard(registry.mutex);
+	registry.named.clear();
+	for (size_t i = 0; i < registry.counters.size(); i++) {
+		registry.counters[i]->Reset();
+	}
+	for (size_t i = 0; i < registry.histograms.size(); i++) {
+		registry.histograms[i]->Reset();
+	}
+}
+
+void GetStats(std::map<std::string, int64_t> *stats) {
+	StatsSnapshot snapshot;
+	GetStatsSnapshot(&snapshot);
+	stats->swap(snapshot.counters);
+}
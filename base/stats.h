@@ -1,9 +1,36 @@
 #pragma once
 
-// Statistics collection. Not very developed.
+// Statistics collection.
+//
+// INCSTAT("name") is the quick and dirty way, keyed by string on every call. For anything hot,
+// register a handle once and update that instead:
+//
+//   static StatCounter flushes("drawbuffer.flushes");
+//   static StatHistogram vertexCount("drawbuffer.flush_vertices");
+//   flushes.Add();
+//   vertexCount.Record(count);
+//
+// Counters are sharded per thread, so Add is one uncontended relaxed atomic add. The shards are
+// only summed up when taking a snapshot. Histograms are log-linear (like HdrHistogram), with 16
+// buckets per power of two, so percentiles are within about 6% of the real value over the whole
+// range of 0 to 2^40. For latencies, record microseconds.
+//
+// Handles are meant to be static or otherwise long-lived, they unregister on destruction.
+
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <string>
+
+#include "base/basictypes.h"
 
 #define STATS_ENABLE
 
+#define STAT_SHARDS 16          // Counters. Must be power of 2
+#define STAT_HISTOGRAM_SHARDS 4 // Histograms are much bigger. Must be power of 2
+#define STAT_HISTOGRAM_SUB_BITS 4
+#define STAT_HISTOGRAM_BUCKETS ((40 - STAT_HISTOGRAM_SUB_BITS + 1) << STAT_HISTOGRAM_SUB_BITS)
+
 #ifdef STATS_ENABLE
 
 void IncrementStat(const char *name);
@@ -16,3 +43,113 @@ void IncrementStat(const char *name);
 
 #endif
 
+// Which shard the calling thread updates. Threads are spread round robin.
+int GetStatShard();
+
+class StatCounter {
+public:
+	explicit StatCounter(const char *name);
+	~StatCounter();
+
+	void Add(int64_t value = 1) {
+#ifdef STATS_ENABLE
+		shards_[GetStatShard() & (STAT_SHARDS - 1)].value.fetch_add(value, std::memory_order_relaxed);
+#endif
+	}
+	// Sums up the shards.
+	int64_t Get() const;
+	void Reset();
+
+	const char *name() const { return name_; }
+
+private:
+	struct Shard {
+		Shard() : value(0) {}
+		std::atomic<int64_t> value;
+		// Keeps threads from fighting over the same cache line.
+		char pad[64 - sizeof(std::atomic<int64_t>)];
+	};
+	const char *name_;
+	Shard shards_[STAT_SHARDS];
+
+	DISALLOW_COPY_AND_ASSIGN(StatCounter);
+};
+
+// A value that is set rather than accumulated, like a queue depth. Not sharded, since the
+// last write wins anyway.
+class StatGauge {
+public:
+	explicit StatGauge(const char *name);
+	~StatGauge();
+
+	void Set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+	void Add(int64_t value) { value_.fetch_add(value, std::memory_order_relaxed); }
+	int64_t Get() const { return value_.load(std::memory_order_relaxed); }
+
+	const char *name() const { return name_; }
+
+private:
+	const char *name_;
+	std::atomic<int64_t> value_;
+
+	DISALLOW_COPY_AND_ASSIGN(StatGauge);
+};
+
+struct StatHistogramSnapshot {
+	int64_t count;
+	int64_t sum;
+	int64_t min;
+	int64_t max;
+	int64_t p50;
+	int64_t p90;
+	int64_t p99;
+	int64_t p999;
+
+	double Mean() const { return count ? (double)sum / (double)count : 0.0; }
+};
+
+class StatHistogram {
+public:
+	explicit StatHistogram(const char *name);
+	~StatHistogram();
+
+	// Negative values count as 0, values above 2^40 end up in the last bucket.
+	void Record(int64_t value);
+
+	void GetSnapshot(StatHistogramSnapshot *snapshot) const;
+	void Reset();
+
+	const char *name() const { return name_; }
+
+	static int BucketForValue(int64_t value);
+	// The highest value that ends up in the bucket.
+	static int64_t BucketMaxValue(int bucket);
+
+private:
+	struct Shard {
+		Shard();
+		std::atomic<int64_t> sum;
+		std::atomic<int64_t> buckets[STAT_HISTOGRAM_BUCKETS];
+	};
+	const char *name_;
+	Shard shards_[STAT_HISTOGRAM_SHARDS];
+	std::atomic<int64_t> min_;
+	std::atomic<int64_t> max_;
+
+	DISALLOW_COPY_AND_ASSIGN(StatHistogram);
+};
+
+struct StatsSnapshot {
+	// Registered counters and INCSTAT ones together.
+	std::map<std::string, int64_t> counters;
+	std::map<std::string, int64_t> gauges;
+	std::map<std::string, StatHistogramSnapshot> histograms;
+};
+
+// Collects everything registered. With reset, counters and histograms start over from zero
+// afterwards (gauges are left alone). Updates racing with the reset may land on either side.
+void GetStatsSnapshot(StatsSnapshot *snapshot, bool reset = false);
+void ResetStats();
+
+// Current value of every counter, by name.
+void GetStats(std::map<std::string, int64_t> *stats);
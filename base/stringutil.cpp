@@ -39,7 +39,7 @@ void OutputDebugStringUTF8(const char *p) {
 
 void StringTrimEndNonAlphaNum(char *str) {
 	ssize_t n = strlen(str);
-	while (!isalnum(str[n]) && n >= 0) {
+	while (n >= 0 && !isalnum(str[n])) {
 		str[n--] = '\0';
 	}
 }
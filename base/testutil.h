@@ -0,0 +1,41 @@
+#pragma once
+
+// For the small test programs that sit next to the code they test. Each check prints a line,
+// and main ends with return TestResult(), so the program fails if any check did.
+
+#include <stdio.h>
+#include <string>
+
+inline int &TestFailures() {
+	static int failures = 0;
+	return failures;
+}
+
+inline bool Check(const char *name, bool ok) {
+	printf("%s: %s\n", name, ok ? "ok" : "FAILED");
+	fflush(stdout);
+	if (!ok)
+		TestFailures()++;
+	return ok;
+}
+
+// Prints the total, and returns the number of failed checks.
+inline int TestResult() {
+	printf("%d failed\n", TestFailures());
+	fflush(stdout);
+	return TestFailures();
+}
+
+// The whole file, or "<missing>" if it can't be opened.
+inline std::string ReadTestFile(const std::string &filename) {
+	FILE *file = fopen(filename.c_str(), "rb");
+	if (!file)
+		return "<missing>";
+	std::string contents;
+	char buf[65536];
+	size_t count;
+	while ((count = fread(buf, 1, sizeof(buf), file)) > 0)
+		contents.append(buf, count);
+	fclose(file);
+	return contents;
+}
@@ -0,0 +1,165 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+
+#include "base/logging.h"
+#include "base/timeutil.h"
+#include "bench/bench.h"
+#include "json/json_writer.h"
+
+#define DEFAULT_REPETITIONS 15
+#define DEFAULT_MIN_TIME 0.02
+#define DEFAULT_WARMUP_TIME 0.1
+
+static volatile uint64_t sinkValue;
+static const void *volatile sinkPtr;
+
+void BenchSink(uint64_t value) {
+	sinkValue = value;
+}
+
+void BenchSinkPtr(const void *ptr) {
+	sinkPtr = ptr;
+}
+
+double BenchResult::MBPerSecond() const {
+	if (bytesPerIteration == 0 || medianNs <= 0.0)
+		return 0.0;
+	return (double)bytesPerIteration / medianNs * 1000000000.0 / (1024.0 * 1024.0);
+}
+
+static double Median(std::vector<double> values) {
+	std::sort(values.begin(), values.end());
+	size_t n = values.size();
+	if (n == 0)
+		return 0.0;
+	return n & 1 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) * 0.5;
+}
+
+BenchRunner::BenchRunner()
+	: repetitions_(DEFAULT_REPETITIONS), minTime_(DEFAULT_MIN_TIME), warmupTime_(DEFAULT_WARMUP_TIME) {
+}
+
+bool BenchRunner::ParseArgs(int argc, const char *argv[]) {
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (!strncmp(arg, "--filter=", 9)) {
+			filter_ = arg + 9;
+		} else if (!strncmp(arg, "--reps=", 7)) {
+			repetitions_ = std::max(1, atoi(arg + 7));
+		} else if (!strncmp(arg, "--min-time=", 11)) {
+			minTime_ = std::max(0.001, atof(arg + 11));
+		} else if (!strncmp(arg, "--json=", 7)) {
+			jsonFilename_ = arg + 7;
+		} else {
+			fprintf(stderr, "Usage: %s [--filter=substring] [--reps=%d] [--min-time=%g] [--json=file]\n",
+				argv[0], DEFAULT_REPETITIONS, DEFAULT_MIN_TIME);
+			return false;
+		}
+	}
+	return true;
+}
+
+void BenchRunner::Add(const char *name, BenchFunc func, int64_t bytesPerIteration) {
+	Bench bench;
+	bench.name = name;
+	bench.func = func;
+	bench.bytesPerIteration = bytesPerIteration;
+	benches_.push_back(bench);
+}
+
+BenchResult BenchRunner::RunOne(const Bench &bench) {
+	// Warmup doubles as calibration: keep doubling until a run takes at least minTime_,
+	// and keep going at that count until the warmup time is up.
+	int64_t iterations = 1;
+	double warmupStart = real_time_now();
+	while (true) {
+		double start = real_time_now();
+		bench.func(iterations);
+		double elapsed = real_time_now() - start;
+		if (elapsed < minTime_) {
+			// Jump most of the way there right away when it's clear how far off we are.
+			int64_t scale = elapsed > minTime_ / 100.0 ? (int64_t)(minTime_ / elapsed * 1.2) + 1 : 2;
+			iterations *= std::max((int64_t)2, scale);
+			continue;
+		}
+		if (real_time_now() - warmupStart >= warmupTime_)
+			break;
+	}
+
+	std::vector<double> times;
+	for (int rep = 0; rep < repetitions_; rep++) {
+		double start = real_time_now();
+		bench.func(iterations);
+		double elapsed = real_time_now() - start;
+		times.push_back(elapsed * 1000000000.0 / (double)iterations);
+	}
+
+	BenchResult result;
+	result.name = bench.name;
+	result.iterations = iterations;
+	result.repetitions = repetitions_;
+	result.bytesPerIteration = bench.bytesPerIteration;
+	result.medianNs = Median(times);
+	result.minNs = *std::min_element(times.begin(), times.end());
+	std::vector<double> deviations;
+	for (size_t i = 0; i < times.size(); i++) {
+		deviations.push_back(fabs(times[i] - result.medianNs));
+	}
+	result.madNs = Median(deviations);
+	return result;
+}
+
+void BenchRunner::Run() {
+	results_.clear();
+	printf("%-36s %14s %12s %8s %14s %10s\n", "benchmark", "median ns", "mad ns", "mad %", "min ns", "MB/s");
+	for (size_t i = 0; i < benches_.size(); i++) {
+		const Bench &bench = benches_[i];
+		if (!filter_.empty() && bench.name.find(filter_) == std::string::npos)
+			continue;
+		BenchResult result = RunOne(bench);
+		results_.push_back(result);
+		double madPercent = result.medianNs > 0.0 ? result.madNs / result.medianNs * 100.0 : 0.0;
+		printf("%-36s %14.1f %12.1f %7.1f%% %14.1f", result.name.c_str(), result.medianNs, result.madNs, madPercent, result.minNs);
+		if (result.bytesPerIteration)
+			printf(" %10.1f", result.MBPerSecond());
+		printf("\n");
+		fflush(stdout);
+	}
+
+	if (!jsonFilename_.empty()) {
+		std::ofstream out(jsonFilename_.c_str());
+		if (!out) {
+			ELOG("Failed to open %s for writing", jsonFilename_.c_str());
+			return;
+		}
+		WriteJson(out);
+	}
+}
+
+void BenchRunner::WriteJson(std::ostream &out) const {
+	JsonWriter j(out);
+	j.begin();
+	j.writeInt("repetitions", repetitions_);
+	j.writeFloat("min_time", minTime_);
+	j.pushArray("benchmarks");
+	for (size_t i = 0; i < results_.size(); i++) {
+		const BenchResult &result = results_[i];
+		j.pushDict();
+		j.writeString("name", result.name.c_str());
+		j.writeInt64("iterations", result.iterations);
+		j.writeFloat("median_ns", result.medianNs);
+		j.writeFloat("mad_ns", result.madNs);
+		j.writeFloat("min_ns", result.minNs);
+		if (result.bytesPerIteration) {
+			j.writeInt64("bytes_per_iteration", result.bytesPerIteration);
+			j.writeFloat("mb_per_s", result.MBPerSecond());
+		}
+		j.pop();
+	}
+	j.pop();
+	j.end();
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+// Minimal microbenchmark harness, for native_bench.
+//
+// A benchmark is a function that runs its kernel a given number of times. The harness first
+// warms up while finding an iteration count that makes one repetition take long enough to time
+// reliably, then runs a number of repetitions and reports the median time per iteration and
+// the median absolute deviation (MAD) around it. Median and MAD rather than mean and stddev,
+// since a single descheduling or page fault doesn't move them.
+//
+//   static void BenchAdler32(int64_t iterations) {
+//     for (int64_t i = 0; i < iterations; i++)
+//       BenchSink(hash::Adler32(data, sizeof(data)));
+//   }
+//
+//   BenchRunner runner;
+//   runner.Add("hash::Adler32 64KB", &BenchAdler32, sizeof(data));
+//   runner.Run();
+
+#include <stdint.h>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/functional.h"
+
+// Keeps the compiler from optimizing away results that are otherwise unused.
+void BenchSink(uint64_t value);
+void BenchSinkPtr(const void *ptr);
+
+struct BenchResult {
+	std::string name;
+	int64_t iterations;  // Per repetition.
+	int repetitions;
+	double medianNs;  // Per iteration.
+	double madNs;
+	double minNs;
+	int64_t bytesPerIteration;
+
+	// Throughput at the median, or 0 if the benchmark didn't say how many bytes it processes.
+	double MBPerSecond() const;
+};
+
+class BenchRunner {
+public:
+	typedef std::function<void(int64_t iterations)> BenchFunc;
+
+	BenchRunner();
+
+	// Handles --filter=substring, --reps=N, --min-time=seconds and --json=file. Returns false
+	// (after printing usage) on anything it doesn't understand.
+	bool ParseArgs(int argc, const char *argv[]);
+
+	void Add(const char *name, BenchFunc func, int64_t bytesPerIteration = 0);
+
+	// Runs everything matching the filter, printing a line per benchmark as it goes, and writes
+	// the JSON file if one was asked for.
+	void Run();
+
+	const std::vector<BenchResult> &Results() const { return results_; }
+	void WriteJson(std::ostream &out) const;
+
+private:
+	struct Bench {
+		std::string name;
+		BenchFunc func;
+		int64_t bytesPerIteration;
+	};
+
+	BenchResult RunOne(const Bench &bench);
+
+	std::vector<Bench> benches_;
+	std::vector<BenchResult> results_;
+	std::string filter_;
+	std::string jsonFilename_;
+	int repetitions_;
+	double minTime_;  // Per repetition, in seconds.
+	double warmupTime_;
+
+	DISALLOW_COPY_AND_ASSIGN(BenchRunner);
+};
@@ -0,0 +1,250 @@
+// Load generator for http::Server. Starts a server on the loopback interface and hammers a
+// small fixed response from a number of client threads, once per connection mode:
+//
+//   close       A new connection for every request, like HTTP/1.0.
+//   keep-alive  One persistent connection per client, one request at a time.
+//   pipelined   One persistent connection per client, --depth requests sent back to back
+//               before reading the responses.
+//
+//   http_bench --clients=4 --seconds=2 --depth=8
+//
+// Prints requests per second for each, which is the number to compare before and after
+// touching the server's connection handling.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "base/buffer.h"
+#include "base/functional.h"
+#include "base/timeutil.h"
+#include "net/http_server.h"
+#include "thread/executor.h"
+#include "thread/thread.h"
+
+#define DEFAULT_PORT 18080
+#define DEFAULT_CLIENTS 4
+#define DEFAULT_SECONDS 2.0
+#define DEFAULT_DEPTH 8
+
+enum Mode {
+	MODE_CLOSE,
+	MODE_KEEP_ALIVE,
+	MODE_PIPELINED,
+};
+
+struct BenchConfig {
+	int port;
+	int depth;
+	double seconds;
+};
+
+static const char *const responseBody = "{\"status\":\"ok\",\"items\":[1,2,3,4,5,6,7,8]}\n";
+
+static void HandleSmall(const http::Request &request) {
+	request.WriteHttpResponseHeader(200, (int)strlen(responseBody), "application/json");
+	request.out_buffer()->Append(responseBody);
+}
+
+static void RunServer(http::Server *server, int port) {
+	server->Run(port);
+}
+
+static int ConnectLocal(int port) {
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (connect(sock, (sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+	// Small requests, we don't want Nagle holding them back.
+	int opt = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&opt, sizeof(opt));
+	return sock;
+}
+
+static bool SendAll(int sock, const std::string &data) {
+	size_t pos = 0;
+	while (pos < data.size()) {
+		ssize_t n = send(sock, data.data() + pos, data.size() - pos, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		pos += n;
+	}
+	return true;
+}
+
+// Reads one response off the socket, leaving anything after it in the buffer. Returns false if
+// the connection closed or broke first.
+static bool ReadResponse(int sock, Buffer *in, bool *keepAlive) {
+	int contentLength = -1;
+	*keepAlive = false;
+	bool firstLine = true;
+	while (true) {
+		std::string line;
+		if (in->TakeLineCRLF(&line) < 0) {
+			if (in->ReadSome(sock, 65536) <= 0)
+				return false;
+			continue;
+		}
+		if (line.empty())
+			break;
+		if (firstLine) {
+			if (line.compare(0, 12, "HTTP/1.1 200") != 0)
+				return false;
+			firstLine = false;
+		} else if (!strncasecmp(line.c_str(), "Content-Length:", 15)) {
+			contentLength = atoi(line.c_str() + 15);
+		} else if (!strncasecmp(line.c_str(), "Connection:", 11)) {
+			*keepAlive = strstr(line.c_str(), "keep-alive") != 0;
+		}
+	}
+	if (contentLength < 0)
+		return false;
+	while (in->size() < (size_t)contentLength) {
+		if (in->ReadSome(sock, 65536) <= 0)
+			return false;
+	}
+	in->Skip(contentLength);
+	return true;
+}
+
+static void RunClient(Mode mode, const BenchConfig *config, double endTime, std::atomic<long long> *completed, std::atomic<long long> *failed) {
+	std::string request = "GET /small HTTP/1.1\r\nHost: localhost\r\n";
+	request += mode == MODE_CLOSE ? "Connection: close\r\n\r\n" : "\r\n";
+	int batch = mode == MODE_PIPELINED ? config->depth : 1;
+	std::string batchData;
+	for (int i = 0; i < batch; i++)
+		batchData += request;
+
+	long long done = 0;
+	long long errors = 0;
+	int sock = -1;
+	Buffer in;
+	while (real_time_now() < endTime) {
+		if (sock < 0) {
+			in.clear();
+			sock = ConnectLocal(config->port);
+			if (sock < 0) {
+				errors++;
+				continue;
+			}
+		}
+		bool ok = SendAll(sock, batchData);
+		bool keepAlive = false;
+		for (int i = 0; ok && i < batch; i++) {
+			ok = ReadResponse(sock, &in, &keepAlive);
+			if (ok)
+				done++;
+		}
+		if (!ok)
+			errors++;
+		// Also reconnects when the server hits its per-connection request cap.
+		if (!ok || !keepAlive || mode == MODE_CLOSE) {
+			close(sock);
+			sock = -1;
+		}
+	}
+	if (sock >= 0)
+		close(sock);
+	in.clear();
+	*completed += done;
+	*failed += errors;
+}
+
+static void RunMode(const char *name, Mode mode, int clients, const BenchConfig &config) {
+	std::atomic<long long> completed(0);
+	std::atomic<long long> failed(0);
+	double start = real_time_now();
+	double endTime = start + config.seconds;
+	std::vector<std::thread *> threads;
+	for (int i = 0; i < clients; i++) {
+		threads.push_back(new std::thread(std::bind(&RunClient, mode, &config, endTime, &completed, &failed)));
+	}
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+	double elapsed = real_time_now() - start;
+	printf("%-12s %14.0f %10lld\n", name, (double)completed / elapsed, (long long)failed);
+	fflush(stdout);
+}
+
+int main(int argc, const char *argv[]) {
+	BenchConfig config;
+	config.port = DEFAULT_PORT;
+	config.depth = DEFAULT_DEPTH;
+	config.seconds = DEFAULT_SECONDS;
+	int clients = DEFAULT_CLIENTS;
+	int loops = 1;
+	int threads = 2;
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		if (!strncmp(arg, "--clients=", 10)) {
+			clients = std::max(1, atoi(arg + 10));
+		} else if (!strncmp(arg, "--seconds=", 10)) {
+			config.seconds = std::max(0.1, atof(arg + 10));
+		} else if (!strncmp(arg, "--depth=", 8)) {
+			config.depth = std::max(1, atoi(arg + 8));
+		} else if (!strncmp(arg, "--port=", 7)) {
+			config.port = atoi(arg + 7);
+		} else if (!strncmp(arg, "--loops=", 8)) {
+			loops = std::max(1, atoi(arg + 8));
+		} else if (!strncmp(arg, "--threads=", 10)) {
+			threads = std::max(1, atoi(arg + 10));
+		} else {
+			fprintf(stderr, "Usage: %s [--clients=%d] [--seconds=%g] [--depth=%d] [--port=%d] [--loops=1] [--threads=2]\n",
+				argv[0], DEFAULT_CLIENTS, DEFAULT_SECONDS, DEFAULT_DEPTH, DEFAULT_PORT);
+			return 1;
+		}
+	}
+
+	threading::ThreadPoolExecutor executor(threads, 1024);
+	http::Server server(&executor);
+	server.SetEventLoops(loops);
+	server.RegisterHandler("/small", &HandleSmall);
+	std::thread serverThread(std::bind(&RunServer, &server, config.port));
+	serverThread.detach();
+
+	// Wait for the listener.
+	int probe = -1;
+	for (int i = 0; i < 100 && probe < 0; i++) {
+		probe = ConnectLocal(config.port);
+		if (probe < 0)
+			sleep_ms(10);
+	}
+	if (probe < 0) {
+		fprintf(stderr, "Server didn't come up on port %d\n", config.port);
+		return 1;
+	}
+	close(probe);
+
+	printf("%d clients, %.1f s each, pipeline depth %d\n", clients, config.seconds, config.depth);
+	printf("%-12s %14s %10s\n", "mode", "requests/s", "errors");
+	RunMode("close", MODE_CLOSE, clients, config);
+	RunMode("keep-alive", MODE_KEEP_ALIVE, clients, config);
+	RunMode("pipelined", MODE_PIPELINED, clients, config);
+
+	// The server has no way to stop, so don't wait for it.
+	fflush(stdout);
+	_exit(0);
+}
@@ -0,0 +1,327 @@
+// Microbenchmarks for native's hot kernels. Run before and after touching any of them:
+//
+//   native_bench --json=before.json
+//   native_bench --filter=Adler32 --reps=30
+//
+// Everything runs on synthetic in-memory data, so no assets, GL context or audio device are
+// needed. Sizes are picked to match typical use - a line of UI text, a 256x256 texture, a
+// 1024 sample audio buffer.
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "audio/mixer.h"
+#include "base/arch.h"
+#include "base/buffer.h"
+#include "bench/bench.h"
+#include "ext/vjson/json.h"
+#include "gfx/texture_atlas.h"
+#include "gfx_es2/draw_buffer.h"
+#include "image/zim_load.h"
+#include "json/json_writer.h"
+#include "math/fast/fast_matrix.h"
+#include "util/hash/hash.h"
+#include "util/text/utf8.h"
+
+// UTF-8
+
+static std::string utf8Text;
+
+static void SetupUTF8() {
+	// Mostly ASCII with some two and three byte sequences mixed in, like a translated UI string.
+	const char *pieces[] = {
+		"Save state ", "Sauvegarder l\xc3\xa9tat ", "Spielstand speichern ", "\xe3\x82\xbb\xe3\x83\xbc\xe3\x83\x96 ",
+		"\xd0\xa1\xd0\xbe\xd1\x85\xd1\x80\xd0\xb0\xd0\xbd\xd0\xb8\xd1\x82\xd1\x8c ", "Guardar partida ",
+	};
+	while (utf8Text.size() < 4096) {
+		utf8Text += pieces[utf8Text.size() % (sizeof(pieces) / sizeof(pieces[0]))];
+	}
+}
+
+static void BenchU8NextChar(int64_t iterations) {
+	const char *text = utf8Text.c_str();
+	int length = (int)utf8Text.size();
+	uint64_t sum = 0;
+	for (int64_t n = 0; n < iterations; n++) {
+		int i = 0;
+		while (i < length) {
+			sum += u8_nextchar(text, &i);
+		}
+	}
+	BenchSink(sum);
+}
+
+// Hashing
+
+#define HASH_SIZE (64 * 1024)
+static std::vector<uint8_t> hashData;
+
+static void SetupHash() {
+	hashData.resize(HASH_SIZE);
+	for (size_t i = 0; i < hashData.size(); i++) {
+		hashData[i] = (uint8_t)(i * 2654435761U >> 24);
+	}
+}
+
+static void BenchAdler32(int64_t iterations) {
+	for (int64_t n = 0; n < iterations; n++) {
+		BenchSink(hash::Adler32(&hashData[0], hashData.size()));
+	}
+}
+
+// Buffer
+
+#define BUFFER_TOTAL (64 * 1024)
+#define BUFFER_CHUNK 1024
+
+// Fill up, then drain in chunks, like the HTTP code does with a response body.
+static void BenchBufferTake(int64_t iterations) {
+	std::string chunk(BUFFER_CHUNK, 'x');
+	char dest[BUFFER_CHUNK];
+	for (int64_t n = 0; n < iterations; n++) {
+		Buffer buffer;
+		for (int i = 0; i < BUFFER_TOTAL / BUFFER_CHUNK; i++) {
+			buffer.Append(chunk);
+		}
+		while (buffer.size() > 0) {
+			buffer.Take(BUFFER_CHUNK, dest);
+		}
+		BenchSink(dest[0]);
+	}
+}
+
+// JSON
+
+static std::string jsonText;
+
+static void SetupJson() {
+	JsonWriter j;
+	j.begin();
+	j.writeString("name", "native_bench");
+	j.writeInt("version", 3);
+	j.pushArray("entries");
+	for (int i = 0; i < 200; i++) {
+		j.pushDict();
+		j.writeInt("id", i);
+		j.writeString("title", "Some game title (USA) [v1.02]");
+		j.writeFloat("rating", 3.5 + (i % 3) * 0.5);
+		j.writeBool("favorite", (i & 7) == 0);
+		j.pushArray("tags");
+		j.writeString("action");
+		j.writeString("multiplayer");
+		j.pop();
+		j.pop();
+	}
+	j.pop();
+	j.end();
+	jsonText = j.str();
+}
+
+static void BenchJsonParse(int64_t iterations) {
+	// json_parse works in place, so every run needs a fresh copy.
+	std::vector<char> source(jsonText.size() + 1);
+	for (int64_t n = 0; n < iterations; n++) {
+		memcpy(&source[0], jsonText.c_str(), jsonText.size() + 1);
+		block_allocator allocator(1 << 12);
+		char *errorPos;
+		char *errorDesc;
+		int errorLine;
+		BenchSinkPtr(json_parse(&source[0], &errorPos, &errorDesc, &errorLine, &allocator));
+	}
+}
+
+// Matrix
+
+static float matrixA[16];
+static float matrixB[16];
+
+static void SetupMatrix() {
+	for (int i = 0; i < 16; i++) {
+		matrixA[i] = (i % 5 == 0) ? 1.0f : 0.01f * i;
+		matrixB[i] = (i % 5 == 0) ? 0.99f : -0.01f * i;
+	}
+}
+
+static void BenchMatrixMul(int64_t iterations) {
+	float dest[16];
+	float a[16];
+	memcpy(a, matrixA, sizeof(a));
+	for (int64_t n = 0; n < iterations; n++) {
+		// Chained, so each multiply depends on the previous one like in a transform stack.
+		fast_matrix_mul_4x4(dest, a, matrixB);
+		memcpy(a, dest, sizeof(a));
+	}
+	BenchSink((uint64_t)dest[0]);
+}
+
+static void BenchMatrixMulC(int64_t iterations) {
+	float dest[16];
+	float a[16];
+	memcpy(a, matrixA, sizeof(a));
+	for (int64_t n = 0; n < iterations; n++) {
+		fast_matrix_mul_4x4_c(dest, a, matrixB);
+		memcpy(a, dest, sizeof(a));
+	}
+	BenchSink((uint64_t)dest[0]);
+}
+
+// Mixer
+
+#define MIXER_CHANNELS 8
+#define MIXER_SAMPLES 1024
+
+static Mixer *mixer;
+static Clip *clip;
+
+static void SetupMixer() {
+	int length = 44100;
+	short *data = (short *)malloc(length * sizeof(short));
+	for (int i = 0; i < length; i++) {
+		data[i] = (short)((i * 37) % 20000 - 10000);
+	}
+	clip = clip_create_pcm16(data, length, 44100);
+	mixer = mixer_create(44100, MIXER_CHANNELS, MIXER_CHANNELS);
+}
+
+static void BenchMixerMix(int64_t iterations) {
+	short buffer[MIXER_SAMPLES * 2];
+	for (int64_t n = 0; n < iterations; n++) {
+		// Restart every channel so there's always a full buffer's worth to mix.
+		for (int c = 0; c < MIXER_CHANNELS; c++) {
+			mixer_play_clip(mixer, clip, c);
+		}
+		mixer_mix(mixer, buffer, MIXER_SAMPLES);
+	}
+	BenchSink(buffer[0]);
+}
+
+// ZIM
+
+#define ZIM_SIZE 256
+
+static std::vector<uint8_t> zimData;
+
+static void SetupZIM() {
+	std::vector<uint8_t> pixels(ZIM_SIZE * ZIM_SIZE * 4);
+	for (int y = 0; y < ZIM_SIZE; y++) {
+		for (int x = 0; x < ZIM_SIZE; x++) {
+			uint8_t *p = &pixels[(y * ZIM_SIZE + x) * 4];
+			p[0] = (uint8_t)x;
+			p[1] = (uint8_t)y;
+			p[2] = (uint8_t)((x ^ y) & 0xF0);
+			p[3] = 0xFF;
+		}
+	}
+	uLongf compressedSize = compressBound((uLong)pixels.size());
+	zimData.resize(16 + compressedSize);
+	compress(&zimData[16], &compressedSize, &pixels[0], (uLong)pixels.size());
+	zimData.resize(16 + compressedSize);
+
+	int width = ZIM_SIZE;
+	int height = ZIM_SIZE;
+	int flags = ZIM_RGBA8888 | ZIM_ZLIB_COMPRESSED;
+	memcpy(&zimData[0], "ZIMG", 4);
+	memcpy(&zimData[4], &width, 4);
+	memcpy(&zimData[8], &height, 4);
+	memcpy(&zimData[12], &flags, 4);
+}
+
+static void BenchLoadZIM(int64_t iterations) {
+	for (int64_t n = 0; n < iterations; n++) {
+		// Room for mip levels, which LoadZIMPtr writes into.
+		int width[ZIM_MAX_MIP_LEVELS];
+		int height[ZIM_MAX_MIP_LEVELS];
+		int flags;
+		uint8_t *image[ZIM_MAX_MIP_LEVELS];
+		if (LoadZIMPtr(&zimData[0], zimData.size(), width, height, &flags, image)) {
+			BenchSink(image[0][0]);
+			free(image[0]);
+		}
+	}
+}
+
+// Text
+
+static AtlasChar fontChars[96];
+static const AtlasCharRange fontRanges[] = { { 32, 128, 0 } };
+static AtlasFont font;
+static const AtlasFont *fonts[] = { &font };
+static Atlas atlas;
+static DrawBuffer *drawBuffer;
+
+static void SetupText() {
+	// A fixed width font, good enough since only the vertex generation is measured.
+	for (int i = 0; i < 96; i++) {
+		AtlasChar &c = fontChars[i];
+		c.sx = (i % 16) / 16.0f;
+		c.sy = (i / 16) / 8.0f;
+		c.ex = c.sx + 1.0f / 16.0f;
+		c.ey = c.sy + 1.0f / 8.0f;
+		c.ox = 1.0f;
+		c.oy = -14.0f;
+		c.wx = 10.0f;
+		c.pw = 9;
+		c.ph = 16;
+	}
+	font.padding = 1.0f;
+	font.height = 18.0f;
+	font.ascend = 14.0f;
+	font.distslope = 0.0f;
+	font.charData = fontChars;
+	font.ranges = fontRanges;
+	font.numRanges = 1;
+	font.name = "bench";
+
+	atlas.filename = "bench";
+	atlas.fonts = fonts;
+	atlas.num_fonts = 1;
+	atlas.images = 0;
+	atlas.num_images = 0;
+
+	drawBuffer = new DrawBuffer();
+	drawBuffer->SetAtlas(&atlas);
+}
+
+static const char *const textLine = "Press the button to continue. Settings > Graphics > Rendering resolution: 2x PSP";
+
+static void BenchDrawText(int64_t iterations) {
+	for (int64_t n = 0; n < iterations; n++) {
+		// Begin() just resets the vertex count, no GL calls unless we Flush.
+		drawBuffer->Begin(0);
+		drawBuffer->DrawText(0, textLine, 10.0f, 20.0f, 0xFFFFFFFF, ALIGN_HCENTER);
+	}
+}
+
+int main(int argc, const char *argv[]) {
+	BenchRunner runner;
+	if (!runner.ParseArgs(argc, argv))
+		return 1;
+
+	SetupUTF8();
+	SetupHash();
+	SetupJson();
+	SetupMatrix();
+	SetupMixer();
+	SetupZIM();
+	SetupText();
+
+	runner.Add("u8_nextchar 4KB", &BenchU8NextChar, utf8Text.size());
+	runner.Add("hash::Adler32 64KB", &BenchAdler32, HASH_SIZE);
+	runner.Add("Buffer::Take 64KB in 1KB chunks", &BenchBufferTake, BUFFER_TOTAL);
+	runner.Add("json_parse 200 entries", &BenchJsonParse, jsonText.size());
+	runner.Add("fast_matrix_mul_4x4", &BenchMatrixMul);
+	runner.Add("fast_matrix_mul_4x4_c", &BenchMatrixMulC);
+	runner.Add("mixer_mix 8ch x 1024", &BenchMixerMix);
+	runner.Add("LoadZIMPtr 256x256 zlib", &BenchLoadZIM, zimData.size());
+	runner.Add("DrawBuffer::DrawText 80 chars", &BenchDrawText);
+	runner.Run();
+
+	delete drawBuffer;
+	mixer_destroy(mixer);
+	clip_destroy(clip);
+	return 0;
+}
@@ -12,14 +12,15 @@
 #include <zlib.h>
 
 #include "base/logging.h"
+#include "data/compression.h"
 
 /** Compress a STL string using zlib with given compression level and return
 * the binary data. */
-bool compress_string(const std::string& str, std::string *dest, int compressionlevel) {
+static bool deflate_string(const std::string& str, std::string *dest, int compressionlevel, int windowBits) {
 	z_stream zs;                        // z_stream is zlib's control structure
 	memset(&zs, 0, sizeof(zs));
 
-	if (deflateInit(&zs, compressionlevel) != Z_OK) {
+	if (deflateInit2(&zs, compressionlevel, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
 		ELOG("deflateInit failed while compressing.");
 		return false;
 	}
@@ -57,6 +58,15 @@ bool compress_string(const std::string& str, std::string *dest, int compressionl
 	return true;
 }
 
+bool compress_string(const std::string& str, std::string *dest, int compressionlevel) {
+	return deflate_string(str, dest, compressionlevel, MAX_WBITS);
+}
+
+bool gzip_string(const std::string& str, std::string *dest, int compressionlevel) {
+	// 16 + MAX_WBITS asks for a gzip wrapper.
+	return deflate_string(str, dest, compressionlevel, 16 + MAX_WBITS);
+}
+
 /** Decompress an STL string using zlib and return the original data. */
 bool decompress_string(const std::string& str, std::string *dest) {
 	if (!str.size())
@@ -103,3 +113,73 @@ bool decompress_string(const std::string& str, std::string *dest) {
 	*dest = outstring;
 	return true;
 }
+
+StreamInflater::StreamInflater() : zs_(new z_stream), raw_(false), done_(false), failed_(false) {
+	memset(zs_, 0, sizeof(z_stream));
+	// 32 + MAX_WBITS detects zlib or gzip from the header.
+	failed_ = !Init(32 + MAX_WBITS);
+}
+
+StreamInflater::~StreamInflater() {
+	inflateEnd(zs_);
+	delete zs_;
+}
+
+bool StreamInflater::Init(int windowBits) {
+	if (inflateInit2(zs_, windowBits) != Z_OK) {
+		ELOG("inflateInit failed while decompressing.");
+		return false;
+	}
+	return true;
+}
+
+bool StreamInflater::Inflate(const char *data, size_t size, std::string *dest) {
+	if (failed_)
+		return false;
+	if (done_)
+		return true;
+
+	zs_->next_in = (Bytef *)data;
+	zs_->avail_in = (uInt)size;
+	char outbuffer[32768];
+	int ret;
+	do {
+		zs_->next_out = reinterpret_cast<Bytef *>(outbuffer);
+		zs_->avail_out = sizeof(outbuffer);
+		ret = inflate(zs_, Z_NO_FLUSH);
+		dest->append(outbuffer, sizeof(outbuffer) - zs_->avail_out);
+	} while (ret == Z_OK && (zs_->avail_in > 0 || zs_->avail_out == 0));
+
+	if (ret == Z_DATA_ERROR && !raw_ && zs_->total_out == 0) {
+		// No zlib or gzip header, so try it as raw deflate from the start. The header can be
+		// spread over several pieces, so the error may only show up in a later one.
+		std::string replay;
+		replay.swap(seen_);
+		replay.append(data, size);
+		inflateEnd(zs_);
+		memset(zs_, 0, sizeof(z_stream));
+		raw_ = true;
+		if (!Init(-MAX_WBITS)) {
+			failed_ = true;
+			return false;
+		}
+		return Inflate(replay.data(), replay.size(), dest);
+	}
+	if (!raw_ && zs_->total_out == 0) {
+		seen_.append(data, size);
+	} else if (!seen_.empty()) {
+		// It's decided, no need to hold on to it.
+		std::string().swap(seen_);
+	}
+	if (ret == Z_STREAM_END) {
+		done_ = true;
+		return true;
+	}
+	// Z_BUF_ERROR just means it needs more input.
+	if (ret != Z_OK && ret != Z_BUF_ERROR) {
+		ELOG("Exception during zlib decompression: (%i) %s", ret, zs_->msg ? zs_->msg : "");
+		failed_ = true;
+		return false;
+	}
+	return true;
+}
@@ -2,9 +2,43 @@
 
 #include <string>
 
+#include "base/basictypes.h"
+
 bool compress_string(const std::string& str, std::string *dest, int compressionlevel = 9);
+// Same, but with a gzip header and trailer instead of zlib's, as HTTP prefers.
+bool gzip_string(const std::string& str, std::string *dest, int compressionlevel = 6);
+// Takes zlib and gzip data.
 bool decompress_string(const std::string& str, std::string *dest);
 
+struct z_stream_s;
+
+// Decompresses data that comes in pieces, like an HTTP response body, without having to wait
+// for all of it. Takes zlib and gzip data, and raw deflate data too since that's what some
+// servers send when they say "deflate".
+class StreamInflater {
+public:
+	StreamInflater();
+	~StreamInflater();
+
+	// Appends what the next piece decompresses to, which may be nothing yet. Returns false if
+	// the data is corrupt. Anything after the end of the compressed data is ignored.
+	bool Inflate(const char *data, size_t size, std::string *dest);
+	// Whether the end of the compressed data has been seen. If not, it was cut short.
+	bool Done() const { return done_; }
+
+private:
+	bool Init(int windowBits);
+
+	z_stream_s *zs_;
+	// What came in before any output, to start over with if it turns out to be raw deflate.
+	std::string seen_;
+	bool raw_;
+	bool done_;
+	bool failed_;
+
+	DISALLOW_COPY_AND_ASSIGN(StreamInflater);
+};
+
 
 // Delta encoding/decoding - many formats benefit from a pass of this before zlibbing.
 // WARNING : Do not use these with floating point data, especially not float16...
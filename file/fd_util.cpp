@@ -3,9 +3,18 @@
 #include <errno.h>
 #include <math.h>
 #include <stdio.h>
+#include <algorithm>
 #ifndef _WIN32
+#include <poll.h>
 #include <unistd.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#if defined(__linux__) || defined(ANDROID)
+#include <sys/sendfile.h>
+#elif defined(__APPLE__)
+#include <sys/uio.h>
+#endif
 #else
 #include <io.h>
 #include <winsock2.h>
@@ -13,6 +22,7 @@
 #include <fcntl.h>
 
 #include "base/logging.h"
+#include "base/timeutil.h"
 
 namespace fd_util {
 
@@ -119,4 +129,117 @@ void SetNonBlocking(int sock, bool non_blocking) {
 #endif
 }
 
+// The socket may be non-blocking, like the server's. False once the deadline has passed.
+static bool WaitUntilWritable(int sock, double deadline) {
+	double remaining = deadline - real_time_now();
+	if (remaining <= 0.0)
+		return false;
+	remaining = std::min(remaining, 1.0);
+#ifndef _WIN32
+	pollfd pfd;
+	pfd.fd = sock;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	poll(&pfd, 1, (int)ceil(remaining * 1000.0));
+#else
+	// No poll on older Windows, and select there ignores its first argument.
+	struct timeval tv;
+	tv.tv_sec = 0;
+	tv.tv_usec = (long)(remaining * 1000000.0);
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET((SOCKET)sock, &fds);
+	select(0, NULL, &fds, NULL, &tv);
+#endif
+	return true;
+}
+
+// Whether a failed send should just be tried again once the socket is writable.
+static bool SendWouldBlock() {
+#ifdef _WIN32
+	// Winsock doesn't set errno.
+	int error = WSAGetLastError();
+	return error == WSAEWOULDBLOCK || error == WSAEINTR;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+// Plain read and send, for where there's no sendfile.
+static int64_t SendFileCopying(int sock, int fd, int64_t offset, int64_t length, double deadline) {
+	char buf[65536];
+	int64_t sent = 0;
+	if (lseek(fd, (off_t)offset, SEEK_SET) < 0)
+		return 0;
+	while (sent < length) {
+		int toRead = (int)std::min(length - sent, (int64_t)sizeof(buf));
+		int got = (int)read(fd, buf, toRead);
+		if (got <= 0)
+			break;
+		for (int pos = 0; pos < got; ) {
+			int n = send(sock, buf + pos, got - pos, 0);
+			if (n < 0 && SendWouldBlock() && WaitUntilWritable(sock, deadline))
+				continue;
+			if (n < 0) {
+				// What was read but not sent is picked up by the next call, from its offset.
+				return sent + pos;
+			}
+			pos += n;
+		}
+		sent += got;
+	}
+	return sent;
+}
+
+int64_t SendFile(int sock, int fd, int64_t offset, int64_t length, double timeout) {
+	double deadline = real_time_now() + timeout;
+#if defined(__linux__) || defined(ANDROID)
+	int64_t sent = 0;
+	while (sent < length) {
+		off_t off = (off_t)(offset + sent);
+		// Stay under what a 32-bit size_t and the kernel's per call limit can take.
+		size_t count = (size_t)std::min(length - sent, (int64_t)0x40000000);
+		ssize_t n = sendfile(sock, fd, &off, count);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				if (WaitUntilWritable(sock, deadline))
+					continue;
+				break;
+			}
+			if (sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+				// Not a regular file, or not supported by the filesystem.
+				return SendFileCopying(sock, fd, offset, length, deadline);
+			}
+			ELOG("sendfile failed: %i", errno);
+			break;
+		}
+		if (n == 0)
+			break;
+		sent += n;
+	}
+	return sent;
+#elif defined(__APPLE__)
+	int64_t sent = 0;
+	while (sent < length) {
+		off_t len = (off_t)(length - sent);
+		int result = sendfile(fd, sock, (off_t)(offset + sent), &len, NULL, 0);
+		sent += len;
+		if (result < 0 && (errno == EINTR || errno == EAGAIN)) {
+			if (WaitUntilWritable(sock, deadline))
+				continue;
+			break;
+		}
+		if (result < 0) {
+			ELOG("sendfile failed: %i", errno);
+			break;
+		}
+		if (result == 0 && len == 0)
+			break;
+	}
+	return sent;
+#else
+	return SendFileCopying(sock, fd, offset, length, deadline);
+#endif
+}
+
 }  // fd_util
@@ -22,6 +22,13 @@ bool WaitUntilReady(int fd, double timeout);
 
 void SetNonBlocking(int fd, bool non_blocking);
 
+// Sends length bytes of the file fd, starting at offset, to the socket sock. Uses sendfile
+// where there is one, so the data never gets copied through user space. Returns the number
+// of bytes sent, which is less than length on error, if the file was shorter, or if it all
+// took longer than timeout seconds. A non-blocking socket that fills up is waited on until
+// then, with a timeout of 0 it just returns what fit.
+int64_t SendFile(int sock, int fd, int64_t offset, int64_t length, double timeout);
+
 }  // fd_util
 
 #endif  // _FD_UTIL
@@ -13,6 +13,7 @@
 
 #include "base/basictypes.h"
 #include "base/logging.h"
+#include "base/mutex.h"
 #include "file/zip_read.h"
 
 #ifdef ANDROID
@@ -316,8 +317,11 @@ struct VFSEntry {
 
 static VFSEntry entries[16];
 static int num_entries = 0;
+// Lookups come from loader threads too. Registering only happens at startup and shutdown.
+static rw_mutex entriesLock;
 
 void VFSRegister(const char *prefix, AssetReader *reader) {
+	write_lock_guard guard(entriesLock);
 	entries[num_entries].prefix = prefix;
 	entries[num_entries].reader = reader;
 	DLOG("Registered VFS for prefix %s: %s", prefix, reader->toString().c_str());
@@ -325,6 +329,7 @@ void VFSRegister(const char *prefix, AssetReader *reader) {
 }
 
 void VFSShutdown() {
+	write_lock_guard guard(entriesLock);
 	for (int i = 0; i < num_entries; i++) {
 		delete entries[i].reader;
 	}
@@ -340,6 +345,7 @@ uint8_t *VFSReadFile(const char *filename, size_t *size) {
 
 	int fn_len = (int)strlen(filename);
 	bool fileSystemFound = false;
+	read_lock_guard guard(entriesLock);
 	for (int i = 0; i < num_entries; i++) {
 		int prefix_len = (int)strlen(entries[i].prefix);
 		if (prefix_len >= fn_len) continue;
@@ -374,6 +380,7 @@ bool VFSGetFileListing(const char *path, std::vector<FileInfo> *listing, const c
 	
 	int fn_len = (int)strlen(path);
 	bool fileSystemFound = false;
+	read_lock_guard guard(entriesLock);
 	for (int i = 0; i < num_entries; i++) {
 		int prefix_len = (int)strlen(entries[i].prefix);
 		if (prefix_len >= fn_len) continue;
@@ -404,6 +411,7 @@ bool VFSGetFileInfo(const char *path, FileInfo *info) {
 
 	bool fileSystemFound = false;
 	int fn_len = (int)strlen(path);
+	read_lock_guard guard(entriesLock);
 	for (int i = 0; i < num_entries; i++) {
 		int prefix_len = (int)strlen(entries[i].prefix);
 		if (prefix_len >= fn_len) continue;
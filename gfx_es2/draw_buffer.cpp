@@ -5,6 +5,7 @@
 
 #include "base/display.h"
 #include "base/logging.h"
+#include "base/stats.h"
 #include "math/math_util.h"
 #include "gfx/texture_atlas.h"
 #include "gfx/gl_debug_log.h"
@@ -82,6 +83,11 @@ void DrawBuffer::Flush(bool set_blend_state) {
 	if (count_ == 0)
 		return;
 
+	static StatCounter flushes("drawbuffer.flushes");
+	static StatHistogram flushVertices("drawbuffer.flush_vertices");
+	flushes.Add();
+	flushVertices.Record(count_);
+
 	shaderSet_->SetMatrix4x4("WorldViewProj", drawMatrix_);
 #ifdef USE_VBO
 	vbuf_->SubData((const uint8_t *)verts_, 0, sizeof(Vertex) * count_);
@@ -24,21 +24,30 @@ const char *I18NCategory::T(const char *key, const char *def) {
 	std::string modifiedKey = key;
 	modifiedKey = ReplaceAll(modifiedKey, "\n", "\\n");
 
+	{
+		read_lock_guard guard(lock_);
+		auto iter = map_.find(modifiedKey);
+		if (iter != map_.end()) {
+//			ILOG("translation key found in %s: %s", name_.c_str(), key);
+			return iter->second.text.c_str();
+		}
+		// The same keys miss every frame, and they only need logging once.
+		if (missedKeyLog_.find(key) != missedKeyLog_.end())
+			return def ? def : key;
+	}
+	write_lock_guard guard(lock_);
+	// SetMap may have added it, or another thread logged it, while we weren't holding the lock.
 	auto iter = map_.find(modifiedKey);
-	if (iter != map_.end()) {
-//		ILOG("translation key found in %s: %s", name_.c_str(), key);
+	if (iter != map_.end())
 		return iter->second.text.c_str();
-	} else {
-		if (def)
-			missedKeyLog_[key] = def;
-		else
-			missedKeyLog_[key] = modifiedKey.c_str();
-//		ILOG("Missed translation key in %s: %s", name_.c_str(), key);
-		return def ? def : key;
-	}
+	if (missedKeyLog_.find(key) == missedKeyLog_.end())
+		missedKeyLog_[key] = def ? def : modifiedKey.c_str();
+//	ILOG("Missed translation key in %s: %s", name_.c_str(), key);
+	return def ? def : key;
 }
 
 void I18NCategory::SetMap(const std::map<std::string, std::string> &m) {
+	write_lock_guard guard(lock_);
 	for (auto iter = m.begin(); iter != m.end(); ++iter) {
 		if (map_.find(iter->first) == map_.end()) {
 			std::string text = ReplaceAll(iter->second, "\\n", "\n");
@@ -49,14 +58,20 @@ void I18NCategory::SetMap(const std::map<std::string, std::string> &m) {
 }
 
 I18NCategory *I18NRepo::GetCategory(const char *category) {
+	{
+		read_lock_guard guard(catsLock_);
+		auto iter = cats_.find(category);
+		if (iter != cats_.end())
+			return iter->second;
+	}
+	write_lock_guard guard(catsLock_);
+	// Someone else may have added it while we weren't holding the lock.
 	auto iter = cats_.find(category);
-	if (iter != cats_.end()) {
+	if (iter != cats_.end())
 		return iter->second;
-	} else {
-		I18NCategory *c = new I18NCategory(this, category);
-		cats_[category] = c;
-		return c;
-	}
+	I18NCategory *c = new I18NCategory(this, category);
+	cats_[category] = c;
+	return c;
 }
 
 std::string I18NRepo::GetIniPath(const std::string &languageID) const {
@@ -86,6 +101,7 @@ bool I18NRepo::LoadIni(const std::string &languageID, const std::string &overrid
 	if (!ini.LoadFromVFS(iniPath))
 		return false;
 
+	write_lock_guard guard(catsLock_);
 	Clear();
 
 	const std::vector<IniFile::Section> &sections = ini.Sections();
@@ -110,6 +126,7 @@ I18NCategory *I18NRepo::LoadSection(const IniFile::Section *section, const char
 void I18NRepo::SaveIni(const std::string &languageID) {
 	IniFile ini;
 	ini.Load(GetIniPath(languageID));
+	read_lock_guard guard(catsLock_);
 	for (auto iter = cats_.begin(); iter != cats_.end(); ++iter) {
 		std::string categoryName = iter->first;
 		IniFile::Section *section = ini.GetOrCreateSection(categoryName.c_str());
@@ -119,7 +136,7 @@ void I18NRepo::SaveIni(const std::string &languageID) {
 }
 
 void I18NRepo::SaveSection(IniFile &ini, IniFile::Section *section, I18NCategory *cat) {
-	const std::map<std::string, std::string> &missed = cat->Missed();
+	const std::map<std::string, std::string> missed = cat->Missed();
 
 	for (auto iter = missed.begin(); iter != missed.end(); ++iter) {
 		if (!section->Exists(iter->first.c_str())) {
@@ -128,7 +145,7 @@ void I18NRepo::SaveSection(IniFile &ini, IniFile::Section *section, I18NCategory
 		}
 	}
 
-	const std::map<std::string, I18NEntry> &entries = cat->GetMap();
+	const std::map<std::string, I18NEntry> entries = cat->GetMap();
 	for (auto iter = entries.begin(); iter != entries.end(); ++iter) {
 		std::string text = ReplaceAll(iter->second.text, "\n", "\\n");
 		section->Set(iter->first, text);
@@ -12,6 +12,7 @@
 #include <string>
 #include <vector>
 
+#include "base/mutex.h"
 #include "base/stringutil.h"
 #include "file/ini_file.h"
 
@@ -41,13 +42,21 @@ public:
 		return T(key.c_str(), nullptr);
 	}
 
-	const std::map<std::string, std::string> &Missed() const {
+	// Copies, since other threads may be adding to them.
+	std::map<std::string, std::string> Missed() const {
+		read_lock_guard guard(lock_);
 		return missedKeyLog_;
 	}
 
 	void SetMap(const std::map<std::string, std::string> &m);
-	const std::map<std::string, I18NEntry> &GetMap() { return map_; }
-	void ClearMissed() { missedKeyLog_.clear(); }
+	std::map<std::string, I18NEntry> GetMap() const {
+		read_lock_guard guard(lock_);
+		return map_;
+	}
+	void ClearMissed() {
+		write_lock_guard guard(lock_);
+		missedKeyLog_.clear();
+	}
 
 private:
 	I18NCategory(I18NRepo *repo, const char *name) : name_(name) {}
@@ -56,6 +65,8 @@ private:
 
 	std::map<std::string, I18NEntry> map_;
 	std::map<std::string, std::string> missedKeyLog_;
+	// T() gets called from all over, every frame. Only misses need the write lock.
+	mutable rw_mutex lock_;
 
 	// Noone else can create these.
 	friend class I18NRepo;
@@ -82,6 +93,8 @@ private:
 	void SaveSection(IniFile &ini, IniFile::Section *section, I18NCategory *cat);
 
 	std::map<std::string, I18NCategory *> cats_;
+	// Held for writing only while adding categories or loading a language.
+	rw_mutex catsLock_;
 
 	DISALLOW_COPY_AND_ASSIGN(I18NRepo);
 };
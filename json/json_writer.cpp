@@ -1,11 +1,40 @@
+#include <stdio.h>
+
 #include "json/json_writer.h"
 
-JsonWriter::JsonWriter() {
+JsonWriter::JsonWriter() : str_(buf_) {
+}
+
+JsonWriter::JsonWriter(std::ostream &out) : str_(out) {
 }
 
 JsonWriter::~JsonWriter() {
 }
 
+// Quotes, backslashes and control characters. Anything else goes through as is.
+std::string JsonWriter::escape(const char *str) {
+	std::string escaped;
+	for (const char *p = str; *p; p++) {
+		switch (*p) {
+		case '"': escaped += "\\\""; break;
+		case '\\': escaped += "\\\\"; break;
+		case '\n': escaped += "\\n"; break;
+		case '\r': escaped += "\\r"; break;
+		case '\t': escaped += "\\t"; break;
+		default:
+			if ((unsigned char)*p < 0x20) {
+				char temp[8];
+				snprintf(temp, sizeof(temp), "\\u%04x", (unsigned char)*p);
+				escaped += temp;
+			} else {
+				escaped += *p;
+			}
+			break;
+		}
+	}
+	return escaped;
+}
+
 void JsonWriter::begin() {
 	str_ << "{";
 	stack_.push_back(StackEntry(DICT));
@@ -17,7 +46,7 @@ void JsonWriter::end() {
 }
 
 const char *JsonWriter::indent(int n) const {
-	static const char * const whitespace = "															";
+	static const char * const whitespace = "                                ";
 	return whitespace + (32 - n);
 }
 
@@ -50,12 +79,18 @@ const char *JsonWriter::arrayComma() const {
 }
 
 void JsonWriter::pushDict(const char *name) {
-	str_ << comma() << "\n" << indent() << "\"" << name << "\": {";
+	str_ << comma() << "\n" << indent() << "\"" << escape(name) << "\": {";
+	stack_.push_back(StackEntry(DICT));
+}
+
+void JsonWriter::pushDict() {
+	str_ << comma() << "\n" << indent() << "{";
+	stack_.back().first = false;
 	stack_.push_back(StackEntry(DICT));
 }
 
 void JsonWriter::pushArray(const char *name) {
-	str_ << comma() << "\n" << indent() << "\"" << name << "\": [";
+	str_ << comma() << "\n" << indent() << "\"" << escape(name) << "\": [";
 	stack_.push_back(StackEntry(ARRAY));
 }
 
@@ -65,7 +100,7 @@ void JsonWriter::writeBool(bool value) {
 }
 
 void JsonWriter::writeBool(const char *name, bool value) {
-	str_ << comma() << "\n" << indent() << "\"" << name << "\": " << (value ? "true" : "false");
+	str_ << comma() << "\n" << indent() << "\"" << escape(name) << "\": " << (value ? "true" : "false");
 	stack_.back().first = false;
 }
 
@@ -75,7 +110,12 @@ void JsonWriter::writeInt(int value) {
 }
 
 void JsonWriter::writeInt(const char *name, int value) {
-	str_ << comma() << "\n" << indent() << "\"" << name << "\": " << value;
+	str_ << comma() << "\n" << indent() << "\"" << escape(name) << "\": " << value;
+	stack_.back().first = false;
+}
+
+void JsonWriter::writeInt64(const char *name, int64_t value) {
+	str_ << comma() << "\n" << indent() << "\"" << escape(name) << "\": " << (long long)value;
 	stack_.back().first = false;
 }
 
@@ -85,17 +125,17 @@ void JsonWriter::writeFloat(double value) {
 }
 
 void JsonWriter::writeFloat(const char *name, double value) {
-	str_ << comma() << "\n" << indent() << "\"" << name << "\": " << value;
+	str_ << comma() << "\n" << indent() << "\"" << escape(name) << "\": " << value;
 	stack_.back().first = false;
 }
 
 void JsonWriter::writeString(const char *value) {
-	str_ << arrayComma() << arrayIndent() << "\"" << value << "\"";
+	str_ << arrayComma() << arrayIndent() << "\"" << escape(value) << "\"";
 	stack_.back().first = false;
 }
 
 void JsonWriter::writeString(const char *name, const char *value) {
-	str_ << comma() << "\n" << indent() << "\"" << name << "\": \"" << value << "\"";
+	str_ << comma() << "\n" << indent() << "\"" << escape(name) << "\": \"" << escape(value) << "\"";
 	stack_.back().first = false;
 }
 
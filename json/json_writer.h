@@ -1,15 +1,19 @@
 // Minimal-state JSON writer. Consumes almost no memory
-// apart from the string being built-up, which could easily be replaced
-// with a file stream (although I've chosen not to do that just yet).
+// apart from the string being built-up. Can also write straight to a
+// stream (like a file) as it goes, for big outputs like profiler traces.
 //
 // Writes nicely 2-space indented output with correct comma-placement
 // in arrays and dictionaries.
 //
-// Does not deal with encodings in any way.
+// Does not deal with encodings in any way, but does escape quotes, backslashes and control
+// characters in names and strings.
 //
 // Zero dependencies apart from stdlib.
 // See json_writer_test.cpp for usage.
 
+#pragma once
+
+#include <stdint.h>
 #include <string>
 #include <vector>
 #include <sstream>
@@ -17,26 +21,32 @@
 class JsonWriter {
 public:
 	JsonWriter();
+	// Streaming mode: output goes to out as it's written, and str() stays empty.
+	JsonWriter(std::ostream &out);
 	~JsonWriter();
 	void begin();
 	void end();
 	void pushDict(const char *name);
+	// Anonymous dict, as an array element.
+	void pushDict();
 	void pushArray(const char *name);
 	void pop();
 	void writeBool(bool value);
 	void writeBool(const char *name, bool value);
 	void writeInt(int value);
 	void writeInt(const char *name, int value);
+	void writeInt64(const char *name, int64_t value);
 	void writeFloat(double value);
 	void writeFloat(const char *name, double value);
 	void writeString(const char *value);
 	void writeString(const char *name, const char *value);
 
 	std::string str() const {
-		return str_.str();
+		return buf_.str();
 	}
 
 private:
+	static std::string escape(const char *str);
 	const char *indent(int n) const;
 	const char *comma() const;
 	const char *arrayComma() const;
@@ -52,5 +62,6 @@ private:
 		bool first;
 	};
 	std::vector<StackEntry> stack_;
-	std::ostringstream str_;
+	std::ostringstream buf_;
+	std::ostream &str_;
 };
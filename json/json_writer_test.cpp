@@ -18,8 +18,23 @@ int main() {
   j.writeInt(4);
   j.writeInt(6);
   j.pop();
+  j.pushArray("dicts");
+  j.pushDict();
+  j.writeInt64("big", 12345678901LL);
+  j.pop();
+  j.pushDict();
+  j.writeString("name", "second");
+  j.pop();
+  j.pop();
   j.writeString("yo!", "yo");
+  j.writeString("quoted", "say \"hi\"\n");
   j.end();
   std::cout << j.str();
+
+  // Same thing, streamed.
+  JsonWriter s(std::cout);
+  s.begin();
+  s.writeInt("streamed", 1);
+  s.end();
   return 0;
 }
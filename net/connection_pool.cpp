@@ -0,0 +1,140 @@
+#include "net/connection_pool.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+#define closesocket close
+#else
+#include <winsock2.h>
+#endif
+
+#include <stdio.h>
+
+#include "base/logging.h"
+#include "base/stats.h"
+#include "base/timeutil.h"
+#include "file/fd_util.h"
+
+namespace net {
+
+#define DEFAULT_MAX_IDLE_PER_HOST 4
+#define DEFAULT_IDLE_TIMEOUT 4.0
+
+static StatCounter poolHits("http.client.pool_hits");
+static StatCounter poolMisses("http.client.pool_misses");
+static StatCounter poolStale("http.client.pool_stale");
+
+ConnectionPool::ConnectionPool()
+	: maxIdlePerHost_(DEFAULT_MAX_IDLE_PER_HOST), idleTimeout_(DEFAULT_IDLE_TIMEOUT) {
+}
+
+ConnectionPool::~ConnectionPool() {
+	Clear();
+}
+
+ConnectionPool *ConnectionPool::Default() {
+	// Never deleted, so it's still around for downloads finishing during shutdown.
+	static ConnectionPool *pool = new ConnectionPool();
+	return pool;
+}
+
+std::string ConnectionPool::Key(const std::string &host, int port) {
+	char portStr[16];
+	snprintf(portStr, sizeof(portStr), ":%d", port);
+	return host + portStr;
+}
+
+uintptr_t ConnectionPool::Acquire(const std::string &host, int port) {
+	lock_guard guard(mutex_);
+	double now = real_time_now();
+	EvictExpired(now);
+	auto iter = idle_.find(Key(host, port));
+	if (iter != idle_.end()) {
+		IdleList &list = iter->second;
+		while (!list.empty()) {
+			// Most recently used first, it's the least likely to have been closed by the server.
+			uintptr_t sock = list.back().sock;
+			list.pop_back();
+			// An idle connection has nothing to say. If it's readable, that's the server closing it.
+			if (fd_util::WaitUntilReady((int)sock, 0.0)) {
+				poolStale.Add();
+				closesocket(sock);
+				continue;
+			}
+			if (list.empty())
+				idle_.erase(iter);
+			poolHits.Add();
+			return sock;
+		}
+		idle_.erase(iter);
+	}
+	poolMisses.Add();
+	return (uintptr_t)-1;
+}
+
+bool ConnectionPool::HasIdle(const std::string &host, int port) {
+	lock_guard guard(mutex_);
+	EvictExpired(real_time_now());
+	return idle_.find(Key(host, port)) != idle_.end();
+}
+
+void ConnectionPool::Release(const std::string &host, int port, uintptr_t sock) {
+	lock_guard guard(mutex_);
+	double now = real_time_now();
+	EvictExpired(now);
+	IdleList &list = idle_[Key(host, port)];
+	IdleConnection conn;
+	conn.sock = sock;
+	conn.since = now;
+	list.push_back(conn);
+	while ((int)list.size() > maxIdlePerHost_) {
+		closesocket(list.front().sock);
+		list.pop_front();
+	}
+}
+
+void ConnectionPool::Clear() {
+	lock_guard guard(mutex_);
+	for (auto iter = idle_.begin(); iter != idle_.end(); ++iter) {
+		for (size_t i = 0; i < iter->second.size(); i++) {
+			closesocket(iter->second[i].sock);
+		}
+	}
+	idle_.clear();
+}
+
+void ConnectionPool::SetMaxIdlePerHost(int count) {
+	lock_guard guard(mutex_);
+	maxIdlePerHost_ = count;
+}
+
+void ConnectionPool::SetIdleTimeout(double seconds) {
+	lock_guard guard(mutex_);
+	idleTimeout_ = seconds;
+}
+
+int ConnectionPool::IdleCount() {
+	lock_guard guard(mutex_);
+	int count = 0;
+	for (auto iter = idle_.begin(); iter != idle_.end(); ++iter) {
+		count += (int)iter->second.size();
+	}
+	return count;
+}
+
+void ConnectionPool::EvictExpired(double now) {
+	for (auto iter = idle_.begin(); iter != idle_.end(); ) {
+		IdleList &list = iter->second;
+		while (!list.empty() && now - list.front().since > idleTimeout_) {
+			closesocket(list.front().sock);
+			list.pop_front();
+		}
+		if (list.empty()) {
+			idle_.erase(iter++);
+		} else {
+			++iter;
+		}
+	}
+}
+
+}	// namespace net
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <string>
+
+#include "base/basictypes.h"
+#include "base/mutex.h"
+
+namespace net {
+
+// Keeps connections around after a keep-alive response, so the next request to the same host
+// and port can skip the DNS lookup and TCP handshake. http::Client uses the default pool unless
+// told otherwise, which makes every Client and so every Download share it.
+//
+// Sockets are handed out to one user at a time: Acquire takes an idle one out of the pool,
+// Release puts it back once a response has been read completely. A server may close an idle
+// connection at any time, so Acquire skips ones that already have something to read (that is,
+// EOF), and callers should still be prepared to retry once on a fresh connection.
+//
+// Thread safe.
+class ConnectionPool {
+public:
+	ConnectionPool();
+	// Closes whatever is idle.
+	~ConnectionPool();
+
+	static ConnectionPool *Default();
+
+	// Returns a connected socket to host:port, or -1 if there's no usable idle one.
+	uintptr_t Acquire(const std::string &host, int port);
+	// Whether Acquire would likely succeed. Lets callers skip resolving the host.
+	bool HasIdle(const std::string &host, int port);
+	// Hands a socket back for reuse. Must be between requests, with nothing left unread.
+	void Release(const std::string &host, int port, uintptr_t sock);
+	// Closes all idle connections.
+	void Clear();
+
+	// Idle connections kept per host and port, most recently used ones first. Default 4.
+	void SetMaxIdlePerHost(int count);
+	// Idle connections older than this get closed. Should be below what servers allow, which
+	// is often only a few seconds. Default 4.
+	void SetIdleTimeout(double seconds);
+
+	int IdleCount();
+
+private:
+	struct IdleConnection {
+		uintptr_t sock;
+		double since;
+	};
+	typedef std::deque<IdleConnection> IdleList;
+
+	static std::string Key(const std::string &host, int port);
+	// Lock must be held.
+	void EvictExpired(double now);
+
+	recursive_mutex mutex_;
+	// Oldest first.
+	std::map<std::string, IdleList> idle_;
+	int maxIdlePerHost_;
+	double idleTimeout_;
+
+	DISALLOW_COPY_AND_ASSIGN(ConnectionPool);
+};
+
+}	// namespace net
@@ -0,0 +1,155 @@
+// Keep-alive connections through a ConnectionPool: reuse, connections that can't be reused,
+// the limits on idle ones, and what happens when the server has closed a pooled connection,
+// which only GET gets retried for.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "base/buffer.h"
+#include "base/testutil.h"
+#include "base/timeutil.h"
+#include "net/connection_pool.h"
+#include "net/http_client.h"
+#include "net/resolve.h"
+#include "net/test_server.h"
+
+#define TEST_PORT 18565
+
+static bool Respond(int fd, bool keepAlive) {
+	TestServer::Send(fd, keepAlive ?
+		"HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok" :
+		"HTTP/1.1 200 OK\r\nConnection: close\r\nContent-Length: 2\r\n\r\nok");
+	return keepAlive;
+}
+
+// /keep answers and keeps the connection, /close doesn't. /drop answers as if it kept it but
+// closes anyway, like a server with a shorter idle timeout than ours. /once only answers the
+// first request on a connection, later ones find it closed, as if the server had closed it
+// just as they were sent.
+static bool Handle(int fd, const std::string &request, int previous) {
+	size_t start = request.find(' ') + 1;
+	std::string path = request.substr(start, request.find(' ', start) - start);
+	if (path == "/keep")
+		return Respond(fd, true);
+	if (path == "/drop") {
+		Respond(fd, true);
+		return false;
+	}
+	if (path == "/once") {
+		if (previous > 0)
+			return false;
+		return Respond(fd, true);
+	}
+	return Respond(fd, false);
+}
+
+static http::Client *NewClient(net::ConnectionPool *pool) {
+	http::Client *client = new http::Client();
+	client->SetConnectionPool(pool);
+	if (!client->Resolve("127.0.0.1", TEST_PORT) || !client->Connect()) {
+		delete client;
+		return nullptr;
+	}
+	return client;
+}
+
+// A new client each time, which gets its connection from the pool if there's one.
+static int Get(net::ConnectionPool *pool, const char *resource, std::string *body = nullptr) {
+	http::Client *client = NewClient(pool);
+	if (!client)
+		return -1;
+	Buffer output;
+	int code = client->GET(resource, &output);
+	if (body)
+		output.TakeAll(body);
+	delete client;
+	return code;
+}
+
+static int Post(net::ConnectionPool *pool, const char *resource) {
+	http::Client *client = NewClient(pool);
+	if (!client)
+		return -1;
+	Buffer output;
+	int code = client->POST(resource, "data", &output);
+	delete client;
+	return code;
+}
+
+int main() {
+	net::AutoInit netInit;
+	TestServer server(TEST_PORT, &Handle);
+
+	// Three requests in a row, one connection.
+	{
+		net::ConnectionPool pool;
+		int connections = server.Connections();
+		std::string a, b, c;
+		bool ok = Get(&pool, "/keep", &a) == 200 && Get(&pool, "/keep", &b) == 200 && Get(&pool, "/keep", &c) == 200;
+		Check("reused", ok && a == "ok" && b == "ok" && c == "ok" && server.Connections() - connections == 1 && pool.IdleCount() == 1);
+	}
+
+	{
+		net::ConnectionPool pool;
+		int connections = server.Connections();
+		bool ok = Get(&pool, "/close") == 200 && Get(&pool, "/close") == 200;
+		Check("Connection: close", ok && server.Connections() - connections == 2 && pool.IdleCount() == 0);
+	}
+
+	// Closed while idle: noticed before sending anything on it.
+	{
+		net::ConnectionPool pool;
+		int connections = server.Connections();
+		int requests = server.Requests();
+		bool ok = Get(&pool, "/drop") == 200;
+		sleep_ms(50);
+		ok = ok && Get(&pool, "/keep") == 200;
+		Check("stale skipped", ok && server.Connections() - connections == 2 && server.Requests() - requests == 2);
+	}
+
+	// Closed as the request went out: a GET can go again on a new connection...
+	{
+		net::ConnectionPool pool;
+		int connections = server.Connections();
+		int requests = server.Requests();
+		std::string body;
+		bool ok = Get(&pool, "/once") == 200 && Get(&pool, "/once", &body) == 200;
+		Check("GET retried", ok && body == "ok" && server.Connections() - connections == 2 && server.Requests() - requests == 3);
+	}
+
+	// ... but a POST may have been processed already, so it fails instead.
+	{
+		net::ConnectionPool pool;
+		int connections = server.Connections();
+		int requests = server.Requests();
+		bool ok = Post(&pool, "/once") == 200 && Post(&pool, "/once") < 0;
+		Check("POST not retried", ok && server.Connections() - connections == 1 && server.Requests() - requests == 2);
+	}
+
+	// Three at once, but only two kept, and not for long.
+	{
+		net::ConnectionPool pool;
+		pool.SetMaxIdlePerHost(2);
+		pool.SetIdleTimeout(0.2);
+		int connections = server.Connections();
+		http::Client *clients[3];
+		bool ok = true;
+		for (int i = 0; i < 3; i++) {
+			clients[i] = NewClient(&pool);
+			ok = ok && clients[i];
+		}
+		for (int i = 0; i < 3 && ok; i++) {
+			Buffer output;
+			ok = clients[i]->GET("/keep", &output) == 200;
+		}
+		for (int i = 0; i < 3; i++)
+			delete clients[i];
+		Check("max idle per host", ok && server.Connections() - connections == 3 && pool.IdleCount() == 2);
+		sleep_ms(300);
+		Check("idle timeout", !pool.HasIdle("127.0.0.1", TEST_PORT) && pool.IdleCount() == 0);
+	}
+
+	// The server threads never return, so don't wait for them.
+	_Exit(TestResult());
+}
@@ -0,0 +1,256 @@
+// Downloader's queue: the limits on connections in total and per host, segments included,
+// priorities, the bandwidth limit and what happens to queued downloads when it goes away.
+// Runs against two http::Servers in the same process.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "base/buffer.h"
+#include "base/mutex.h"
+#include "base/testutil.h"
+#include "base/timeutil.h"
+#include "net/http_client.h"
+#include "net/http_server.h"
+#include "thread/executor.h"
+#include "thread/thread.h"
+
+#define PORT_A 18561
+#define PORT_B 18562
+// How long each request keeps its connection busy before answering.
+#define REQUEST_TIME_MS 80
+
+static const char *segmentedFile = "downloader_test_src.bin";
+
+// Requests being handled right now, per server and in total, and the most there ever were.
+static std::atomic<int> inFlight[2];
+static std::atomic<int> maxInFlight[2];
+static std::atomic<int> totalInFlight(0);
+static std::atomic<int> maxTotalInFlight(0);
+static recursive_mutex orderLock;
+static std::vector<std::string> order;
+static std::string big(3000000, 'x');
+
+static void UpdateMax(std::atomic<int> *highest, int value) {
+	int current = *highest;
+	while (value > current && !highest->compare_exchange_weak(current, value)) {
+	}
+}
+
+static void ResetCounts() {
+	for (int i = 0; i < 2; i++) {
+		inFlight[i] = 0;
+		maxInFlight[i] = 0;
+	}
+	totalInFlight = 0;
+	maxTotalInFlight = 0;
+}
+
+static void Busy(int server) {
+	UpdateMax(&maxTotalInFlight, ++totalInFlight);
+	UpdateMax(&maxInFlight[server], ++inFlight[server]);
+	sleep_ms(REQUEST_TIME_MS);
+	inFlight[server]--;
+	totalInFlight--;
+}
+
+static void HandleSlow(const http::Request &request, int server) {
+	std::string n;
+	if (request.GetParamValue("n", &n)) {
+		lock_guard guard(orderLock);
+		order.push_back(n);
+	}
+	Busy(server);
+	request.WriteHttpResponseHeader(200, 2, "text/plain");
+	request.out_buffer()->Append("ok");
+}
+
+static void HandleSlowA(const http::Request &request) {
+	HandleSlow(request, 0);
+}
+
+static void HandleSlowB(const http::Request &request) {
+	HandleSlow(request, 1);
+}
+
+// Takes ranges, so file downloads of it get split in segments.
+static void HandleSegmentedA(const http::Request &request) {
+	Busy(0);
+	request.WriteFile(segmentedFile, "application/octet-stream");
+}
+
+static void HandleSegmentedB(const http::Request &request) {
+	Busy(1);
+	request.WriteFile(segmentedFile, "application/octet-stream");
+}
+
+static void HandleBig(const http::Request &request) {
+	request.WriteHttpResponseHeader(200, big.size(), "application/octet-stream");
+	request.out_buffer()->Append(big);
+}
+
+static void RunServer(http::Server *server, int port) {
+	server->Run(port);
+}
+
+static void WaitAll(http::Downloader *downloader, const std::vector<std::shared_ptr<http::Download>> &downloads) {
+	while (true) {
+		downloader->Update();
+		bool done = true;
+		for (size_t i = 0; i < downloads.size(); i++)
+			done = done && downloads[i]->Done();
+		if (done)
+			break;
+		sleep_ms(5);
+	}
+	downloader->Update();
+}
+
+int main() {
+	std::string segmented;
+	for (int i = 0; i < 4 * 1024 * 1024; i++)
+		segmented.push_back((char)(i * 13 + (i >> 11)));
+	FILE *file = fopen(segmentedFile, "wb");
+	fwrite(segmented.data(), 1, segmented.size(), file);
+	fclose(file);
+
+	threading::ThreadPoolExecutor executor(32, 256);
+	http::Server serverA(&executor), serverB(&executor);
+	serverA.RegisterHandler("/slow", &HandleSlowA);
+	serverA.RegisterHandler("/segmented", &HandleSegmentedA);
+	serverA.RegisterHandler("/big", &HandleBig);
+	serverB.RegisterHandler("/slow", &HandleSlowB);
+	serverB.RegisterHandler("/segmented", &HandleSegmentedB);
+	std::thread threadA(std::bind(&RunServer, &serverA, PORT_A));
+	threadA.detach();
+	std::thread threadB(std::bind(&RunServer, &serverB, PORT_B));
+	threadB.detach();
+	sleep_ms(200);
+
+	// 100 queued over two hosts: never more than 3 at once, 2 per host.
+	{
+		ResetCounts();
+		http::Downloader downloader;
+		downloader.SetMaxConcurrent(3);
+		downloader.SetMaxPerHost(2);
+		std::vector<std::shared_ptr<http::Download>> downloads;
+		int callbacks = 0;
+		for (int i = 0; i < 100; i++) {
+			char url[64];
+			snprintf(url, sizeof(url), "http://127.0.0.1:%d/slow", i % 2 ? PORT_B : PORT_A);
+			downloads.push_back(downloader.StartDownloadWithCallback(url, "", [&](http::Download &) { callbacks++; }));
+		}
+		WaitAll(&downloader, downloads);
+		int ok = 0;
+		for (size_t i = 0; i < downloads.size(); i++)
+			ok += downloads[i]->ResultCode() == 200;
+		printf("  at most %d at once, %d and %d per host\n", (int)maxTotalInFlight, (int)maxInFlight[0], (int)maxInFlight[1]);
+		Check("limits", maxTotalInFlight == 3 && maxInFlight[0] <= 2 && maxInFlight[1] <= 2 && ok == 100 && callbacks == 100);
+	}
+
+	// 4 files in 4 segments each: the segments share the same limits.
+	{
+		ResetCounts();
+		http::Downloader downloader;
+		downloader.SetMaxConcurrent(3);
+		downloader.SetMaxPerHost(2);
+		std::vector<std::shared_ptr<http::Download>> downloads;
+		for (int i = 0; i < 4; i++) {
+			char url[64], outfile[64];
+			snprintf(url, sizeof(url), "http://127.0.0.1:%d/segmented", i % 2 ? PORT_B : PORT_A);
+			snprintf(outfile, sizeof(outfile), "downloader_test_out%d.bin", i);
+			remove(outfile);
+			downloads.push_back(downloader.StartDownload(url, outfile));
+		}
+		WaitAll(&downloader, downloads);
+		bool same = true;
+		for (int i = 0; i < 4; i++) {
+			same = same && downloads[i]->ResultCode() == 200 && ReadTestFile(downloads[i]->outfile()) == segmented;
+			remove(downloads[i]->outfile().c_str());
+		}
+		printf("  at most %d at once, %d and %d per host\n", (int)maxTotalInFlight, (int)maxInFlight[0], (int)maxInFlight[1]);
+		Check("segments within limits", maxTotalInFlight <= 3 && maxInFlight[0] <= 2 && maxInFlight[1] <= 2 && same);
+	}
+
+	// Alone on the queue, one file still gets its segments in parallel.
+	{
+		ResetCounts();
+		http::Downloader downloader;
+		downloader.SetMaxPerHost(4);
+		std::vector<std::shared_ptr<http::Download>> downloads;
+		remove("downloader_test_out.bin");
+		char url[64];
+		snprintf(url, sizeof(url), "http://127.0.0.1:%d/segmented", PORT_A);
+		downloads.push_back(downloader.StartDownload(url, "downloader_test_out.bin"));
+		WaitAll(&downloader, downloads);
+		printf("  at most %d at once\n", (int)maxTotalInFlight);
+		Check("segments in parallel", maxTotalInFlight > 1 && maxTotalInFlight <= 4 && downloads[0]->ResultCode() == 200 &&
+			ReadTestFile("downloader_test_out.bin") == segmented);
+		remove("downloader_test_out.bin");
+	}
+
+	// Lower priority values first, the same ones in the order they were added.
+	{
+		http::Downloader downloader;
+		downloader.SetMaxConcurrent(1);
+		order.clear();
+		std::vector<std::shared_ptr<http::Download>> downloads;
+		int priorities[] = { 0, 5, 3, 3, -1, 5, 0 };
+		for (int i = 0; i < 7; i++) {
+			char url[64];
+			snprintf(url, sizeof(url), "http://127.0.0.1:%d/slow?n=%d", PORT_A, i);
+			downloads.push_back(downloader.StartDownload(url, "", priorities[i]));
+			// Let the first one start before the rest are there.
+			if (i == 0)
+				sleep_ms(30);
+		}
+		WaitAll(&downloader, downloads);
+		std::string started;
+		for (size_t i = 0; i < order.size(); i++)
+			started += order[i];
+		printf("  started in order %s\n", started.c_str());
+		Check("priority", started == "0462315");
+	}
+
+	{
+		http::Downloader downloader;
+		downloader.SetBandwidthLimit(1000000);
+		std::vector<std::shared_ptr<http::Download>> downloads;
+		char url[64];
+		snprintf(url, sizeof(url), "http://127.0.0.1:%d/big", PORT_A);
+		double start = real_time_now();
+		downloads.push_back(downloader.StartDownload(url, ""));
+		downloads.push_back(downloader.StartDownload(url, ""));
+		WaitAll(&downloader, downloads);
+		double elapsed = real_time_now() - start;
+		printf("  6MB at 1MB/s took %.2f s\n", elapsed);
+		// Only a lower bound: a loaded machine can always make it slower.
+		Check("bandwidth", elapsed > 5.3 && downloads[0]->ResultCode() == 200 && downloads[1]->ResultCode() == 200 &&
+			downloads[0]->buffer().size() == big.size());
+	}
+
+	// Whatever is still queued fails when the Downloader goes away.
+	std::vector<std::shared_ptr<http::Download>> leftover;
+	{
+		http::Downloader downloader;
+		downloader.SetMaxConcurrent(1);
+		char url[64];
+		snprintf(url, sizeof(url), "http://127.0.0.1:%d/slow", PORT_A);
+		for (int i = 0; i < 10; i++)
+			leftover.push_back(downloader.StartDownload(url, ""));
+		sleep_ms(30);
+	}
+	sleep_ms(300);
+	int done = 0, failed = 0;
+	for (size_t i = 0; i < leftover.size(); i++) {
+		done += leftover[i]->Done();
+		failed += leftover[i]->Failed();
+	}
+	Check("destroyed", done == 10 && failed >= 9);
+
+	remove(segmentedFile);
+	// The servers never return from Run, so don't wait for them.
+	_Exit(TestResult());
+}
@@ -0,0 +1,153 @@
+// Streamed response bodies: chunked ones split across reads at every awkward place, trailers,
+// bodies bigger than a read, and how the body ending early or the sink giving up is told apart
+// from the server closing to end it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "base/buffer.h"
+#include "base/testutil.h"
+#include "net/connection_pool.h"
+#include "net/http_client.h"
+#include "net/resolve.h"
+#include "net/test_server.h"
+
+#define TEST_PORT 18566
+
+static std::string big;
+
+static std::string Chunk(const std::string &data) {
+	char size[16];
+	snprintf(size, sizeof(size), "%x\r\n", (int)data.size());
+	return size + data + "\r\n";
+}
+
+static bool Handle(int fd, const std::string &request, int previous) {
+	size_t start = request.find(' ') + 1;
+	std::string path = request.substr(start, request.find(' ', start) - start);
+	const std::string chunked = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+	if (path == "/split") {
+		// Size lines, data, the CRLFs after it and the trailers, all cut in two. One size has
+		// an extension.
+		std::vector<std::string> pieces;
+		pieces.push_back(chunked + "5");
+		pieces.push_back("\r\nhel");
+		pieces.push_back("lo\r");
+		pieces.push_back("\n6;name=value\r\n world\r\n");
+		pieces.push_back("0\r\nX-Tr");
+		pieces.push_back("ailer: yes\r\n");
+		pieces.push_back("\r\n");
+		TestServer::SendPieces(fd, pieces);
+		return true;
+	}
+	if (path == "/big") {
+		// Chunks of all sizes in one go, so reads end in the middle of them.
+		std::string response = chunked;
+		size_t pos = 0;
+		for (int size = 1; pos < big.size(); size = size * 3 + 7) {
+			response += Chunk(big.substr(pos, size));
+			pos += size;
+		}
+		TestServer::Send(fd, response + "0\r\n\r\n");
+		return true;
+	}
+	if (path == "/cut") {
+		TestServer::Send(fd, chunked + "a\r\nhello");
+		return false;
+	}
+	if (path == "/short") {
+		TestServer::Send(fd, "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nhello");
+		return false;
+	}
+	// Ends when the connection does.
+	std::vector<std::string> pieces;
+	pieces.push_back("HTTP/1.1 200 OK\r\nConnection: close\r\n\r\nhel");
+	pieces.push_back("lo");
+	TestServer::SendPieces(fd, pieces);
+	return false;
+}
+
+// Keeps the body, and how big the biggest piece of it was.
+class CollectingSink : public http::ResponseSink {
+public:
+	CollectingSink() : maxPiece(0), refuseAfter(-1) {}
+	bool Write(Buffer *data) override {
+		std::string piece;
+		data->TakeAll(&piece);
+		if (piece.size() > maxPiece)
+			maxPiece = piece.size();
+		body += piece;
+		return refuseAfter < 0 || (int64_t)body.size() <= refuseAfter;
+	}
+	std::string body;
+	size_t maxPiece;
+	// Gives up once it's had more than this, -1 for never.
+	int64_t refuseAfter;
+};
+
+static int Get(net::ConnectionPool *pool, const char *resource, CollectingSink *sink) {
+	http::Client client;
+	client.SetConnectionPool(pool);
+	if (!client.Resolve("127.0.0.1", TEST_PORT) || !client.Connect())
+		return -1;
+	return client.GET(resource, sink);
+}
+
+int main() {
+	net::AutoInit netInit;
+	for (int i = 0; i < 300000; i++)
+		big.push_back((char)(i * 7 + (i >> 8)));
+	TestServer server(TEST_PORT, &Handle);
+
+	// Twice on the same connection: the first one has to stop right after its trailers.
+	{
+		http::Client client;
+		net::ConnectionPool pool;
+		client.SetConnectionPool(&pool);
+		int connections = server.Connections();
+		CollectingSink first, second;
+		bool ok = client.Resolve("127.0.0.1", TEST_PORT) && client.Connect();
+		ok = ok && client.GET("/split", &first) == 200 && client.GET("/split", &second) == 200;
+		Check("split chunks", ok && first.body == "hello world" && second.body == "hello world");
+		Check("trailers skipped", server.Connections() - connections == 1);
+	}
+
+	{
+		net::ConnectionPool pool;
+		CollectingSink sink;
+		Check("chunks across reads", Get(&pool, "/big", &sink) == 200 && sink.body == big && pool.IdleCount() == 1);
+		printf("  largest piece %d bytes\n", (int)sink.maxPiece);
+		Check("pieces bounded", sink.maxPiece <= 65536);
+	}
+
+	{
+		net::ConnectionPool pool;
+		CollectingSink sink;
+		Check("cut off chunk", Get(&pool, "/cut", &sink) < 0 && pool.IdleCount() == 0);
+	}
+
+	{
+		net::ConnectionPool pool;
+		CollectingSink sink;
+		Check("closing ends the body", Get(&pool, "/eof", &sink) == 200 && sink.body == "hello" && pool.IdleCount() == 0);
+	}
+
+	{
+		net::ConnectionPool pool;
+		CollectingSink sink;
+		Check("closing before the length", Get(&pool, "/short", &sink) < 0);
+	}
+
+	// What's left of the body is never read, so the connection can't be used again.
+	{
+		net::ConnectionPool pool;
+		CollectingSink sink;
+		sink.refuseAfter = 1000;
+		Check("sink refuses", Get(&pool, "/big", &sink) < 0 && sink.body.size() < big.size() && pool.IdleCount() == 0);
+	}
+
+	// The server threads never return, so don't wait for them.
+	_Exit(TestResult());
+}
@@ -3,6 +3,7 @@
 
 #ifndef _WIN32
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #define closesocket close
@@ -14,18 +15,26 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
 
 #include "base/logging.h"
 #include "base/buffer.h"
+#include "base/mutex.h"
 #include "base/stringutil.h"
 #include "data/compression.h"
+#include "net/connection_pool.h"
+#include "net/rate_limiter.h"
 #include "net/resolve.h"
 #include "net/url.h"
+#include "thread/threadutil.h"
 
 namespace net {
 
 Connection::Connection() 
-		: port_(-1), resolved_(NULL), sock_(-1) {
+		: port_(-1), resolved_(NULL), pool_(NULL), sock_(-1), reused_(false), reusable_(false) {
 }
 
 Connection::~Connection() {
@@ -50,12 +59,20 @@ bool Connection::Resolve(const char *host, int port) {
 	host_ = host;
 	port_ = port;
 
+	if (pool_ && pool_->HasIdle(host_, port_)) {
+		// Connect will most likely not need the address.
+		return true;
+	}
+	return DoResolve();
+}
+
+bool Connection::DoResolve() {
 	char port_str[10];
-	snprintf(port_str, sizeof(port_str), "%d", port);
+	snprintf(port_str, sizeof(port_str), "%d", port_);
 
 	std::string err;
-	if (!net::DNSResolve(host, port_str, &resolved_, err)) {
-		ELOG("Failed to resolve host %s: %s", host, err.c_str());
+	if (!net::Resolver::Default()->Resolve(host_, port_str, &resolved_, err)) {
+		ELOG("Failed to resolve host %s: %s", host_.c_str(), err.c_str());
 		// So that future calls fail.
 		port_ = 0;
 		return false;
@@ -69,6 +86,19 @@ bool Connection::Connect(int maxTries) {
 		ELOG("Bad port");
 		return false;
 	}
+	reusable_ = false;
+	if (pool_) {
+		sock_ = pool_->Acquire(host_, port_);
+		if ((intptr_t)sock_ != -1) {
+			reused_ = true;
+			return true;
+		}
+	}
+	reused_ = false;
+	if (resolved_ == NULL && !DoResolve()) {
+		return false;
+	}
+
 	sock_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if ((intptr_t)sock_ == -1) {
 		ELOG("Bad socket");
@@ -96,8 +126,13 @@ bool Connection::Connect(int maxTries) {
 
 void Connection::Disconnect() {
 	if ((intptr_t)sock_ != -1) {
-		closesocket(sock_);
+		if (pool_ && reusable_) {
+			pool_->Release(host_, port_, sock_);
+		} else {
+			closesocket(sock_);
+		}
 		sock_ = -1;
+		reusable_ = false;
 	}
 }
 
@@ -108,63 +143,145 @@ namespace http {
 // TODO: do something sane here
 #define USERAGENT "NATIVEAPP 1.0"
 
-Client::Client() {
+Client::Client() : limiter_(nullptr), keepAlive_(false), headRequest_(false) {
 	httpVersion_ = "1.1";
 	userAgent_ = USERAGENT;
+	SetConnectionPool(net::ConnectionPool::Default());
 }
 
 Client::~Client() {
 	Disconnect();
 }
 
+// Same return value as Buffer::ReadSome: 0 when the server has closed, < 0 on error.
+static int ReadMore(uintptr_t sock, Buffer *readbuf, net::RateLimiter *limiter) {
+	int n = readbuf->ReadSome((int)sock, 65536);
+	if (n > 0 && limiter) {
+		limiter->Consume(n);
+	}
+	return n;
+}
+
+enum {
+	FORWARD_EOF = -1,
+	FORWARD_READ_ERROR = -2,
+	FORWARD_SINK_REFUSED = -3,
+};
+
+// Passes on up to length bytes of the body, whatever is in readbuf already or else what the
+// next read brings. Returns how many, or one of the FORWARD_ codes.
+static int64_t ForwardSome(uintptr_t sock, Buffer *readbuf, net::RateLimiter *limiter, int64_t length, ResponseSink *sink) {
+	if (readbuf->empty()) {
+		int got = ReadMore(sock, readbuf, limiter);
+		if (got == 0)
+			return FORWARD_EOF;
+		if (got < 0)
+			return FORWARD_READ_ERROR;
+	}
+	size_t n = (size_t)std::min((int64_t)readbuf->size(), length);
+	Buffer piece;
+	readbuf->Take(n, &piece);
+	if (!sink->Write(&piece)) {
+		piece.clear();
+		return FORWARD_SINK_REFUSED;
+	}
+	piece.clear();
+	return n;
+}
 
-void DeChunk(Buffer *inbuffer, Buffer *outbuffer, int contentLength, float *progress) {
-	int dechunkedBytes = 0;
+// Decodes the chunks as they come in, never holding more than a read's worth. Stops right after
+// the last chunk, so a kept-alive connection is ready for the next response.
+static bool ReadChunked(uintptr_t sock, Buffer *readbuf, net::RateLimiter *limiter, ResponseSink *sink) {
+	std::string line;
 	while (true) {
-		std::string line;
-		inbuffer->TakeLineCRLF(&line);
-		if (!line.size())
-			return;
-		int chunkSize;
-		sscanf(line.c_str(), "%x", &chunkSize);
-		if (chunkSize) {
-			std::string data;
-			inbuffer->Take(chunkSize, &data);
-			outbuffer->Append(data);
-		} else {
-			// a zero size chunk should mean the end.
-			inbuffer->clear();
-			return;
+		while (readbuf->TakeLineCRLF(&line) < 0) {
+			if (ReadMore(sock, readbuf, limiter) <= 0)
+				return false;
 		}
-		dechunkedBytes += chunkSize;
-		if (progress && contentLength) {
-			*progress = (float)dechunkedBytes / contentLength;
+		// Anything after a ; is a chunk extension, which strtoll stops at.
+		int64_t chunkSize = strtoll(line.c_str(), NULL, 16);
+		if (chunkSize < 0)
+			return false;
+		if (chunkSize == 0) {
+			// Skip the trailers, if any, up to the final empty line.
+			while (true) {
+				int len = readbuf->TakeLineCRLF(&line);
+				if (len == 0)
+					return true;
+				if (len < 0 && ReadMore(sock, readbuf, limiter) <= 0)
+					return false;
+			}
+		}
+		while (chunkSize > 0) {
+			int64_t n = ForwardSome(sock, readbuf, limiter, chunkSize, sink);
+			if (n < 0)
+				return false;
+			chunkSize -= n;
+		}
+		// The CRLF after the data.
+		while (readbuf->size() < 2) {
+			if (ReadMore(sock, readbuf, limiter) <= 0)
+				return false;
 		}
-		inbuffer->Skip(2);
+		readbuf->Skip(2);
+	}
+}
+
+// Decompresses gzip or deflate bodies on the way through, a read at a time.
+class InflatingSink : public ResponseSink {
+public:
+	explicit InflatingSink(ResponseSink *sink) : sink_(sink), received_(0) {}
+
+	bool Write(Buffer *data) override {
+		std::string in, out;
+		data->TakeAll(&in);
+		received_ += in.size();
+		if (!inflater_.Inflate(in.data(), in.size(), &out))
+			return false;
+		if (out.empty())
+			return true;
+		Buffer piece;
+		piece.Append(out);
+		return sink_->Write(&piece);
 	}
+	// An empty body is fine too, like for a HEAD request.
+	bool Done() const { return received_ == 0 || inflater_.Done(); }
+
+private:
+	ResponseSink *sink_;
+	StreamInflater inflater_;
+	int64_t received_;
+};
+
+bool BufferSink::Write(Buffer *data) {
+	data->Take(data->size(), output_);
+	return true;
+}
+
+bool FileSink::Write(Buffer *data) {
+	return data->Flush(file_);
 }
 
 int Client::GET(const char *resource, Buffer *output, float *progress) {
+	BufferSink sink(output);
+	return GET(resource, &sink, progress);
+}
+
+int Client::GET(const char *resource, ResponseSink *sink, float *progress) {
 	const char *otherHeaders =
 		"Accept: */*\r\n"
-		"Accept-Encoding: gzip\r\n";
-	int err = SendRequest("GET", resource, otherHeaders, progress);
-	if (err < 0) {
-		return err;
-	}
-
-	Buffer readbuf;
-	std::vector<std::string> responseHeaders;
-	int code = ReadResponseHeaders(&readbuf, responseHeaders, progress);
-	if (code < 0) {
-		return code;
-	}
+		"Accept-Encoding: gzip, deflate\r\n";
+	return Exchange("GET", resource, "", otherHeaders, sink, progress);
+}
 
-	err = ReadResponseEntity(&readbuf, responseHeaders, output, progress);
-	if (err < 0) {
-		return err;
+int Client::GETRange(const char *resource, int64_t start, int64_t end, ResponseSink *sink, float *progress) {
+	char otherHeaders[128];
+	if (end >= 0) {
+		snprintf(otherHeaders, sizeof(otherHeaders), "Accept: */*\r\nRange: bytes=%lld-%lld\r\n", (long long)start, (long long)end - 1);
+	} else {
+		snprintf(otherHeaders, sizeof(otherHeaders), "Accept: */*\r\nRange: bytes=%lld-\r\n", (long long)start);
 	}
-	return code;
+	return Exchange("GET", resource, "", otherHeaders, sink, progress);
 }
 
 int Client::POST(const char *resource, const std::string &data, const std::string &mime, Buffer *output, float *progress) {
@@ -174,29 +291,59 @@ int Client::POST(const char *resource, const std::string &data, const std::strin
 	} else {
 		snprintf(otherHeaders, sizeof(otherHeaders), "Content-Length: %lld\r\nContent-Type: %s\r\n", (long long)data.size(), mime.c_str());
 	}
-	int err = SendRequestWithData("POST", resource, data, otherHeaders, progress);
-	if (err < 0) {
-		return err;
-	}
+	BufferSink sink(output);
+	return Exchange("POST", resource, data, otherHeaders, &sink, progress);
+}
+
+int Client::POST(const char *resource, const std::string &data, Buffer *output, float *progress) {
+	return POST(resource, data, "", output, progress);
+}
 
+int Client::Exchange(const char *method, const char *resource, const std::string &data, const char *otherHeaders, ResponseSink *sink, float *progress) {
 	Buffer readbuf;
 	std::vector<std::string> responseHeaders;
-	int code = ReadResponseHeaders(&readbuf, responseHeaders, progress);
-	if (code < 0) {
-		return code;
+	int code = -1;
+	bool idempotent = !strcmp(method, "GET") || !strcmp(method, "HEAD");
+	for (int attempt = 0; attempt < 2; attempt++) {
+		bool reused = IsReused();
+		int err = SendRequestWithData(method, resource, data, otherHeaders, progress);
+		if (err >= 0) {
+			code = ReadResponseHeaders(&readbuf, responseHeaders, progress);
+		}
+		if (err >= 0 && code >= 0) {
+			break;
+		}
+		// A server can close a kept-alive connection just as we send on it, and then nothing
+		// comes back. Usually the request wasn't processed, but it may have been, with the
+		// server closing before answering. So only requests that can safely happen twice are
+		// tried again on a new connection.
+		if (!reused || !idempotent || !readbuf.empty() || attempt > 0) {
+			return err < 0 ? err : code;
+		}
+		ILOG("Pooled connection to %s was closed, reconnecting", host_.c_str());
+		Disconnect();
+		// Straight to a new connection, the pool may have more stale ones.
+		net::ConnectionPool *pool = pool_;
+		pool_ = nullptr;
+		bool connected = Connect();
+		pool_ = pool;
+		if (!connected) {
+			return -1;
+		}
+		responseHeaders.clear();
 	}
 
-	err = ReadResponseEntity(&readbuf, responseHeaders, output, progress);
+	if (!sink->Begin(code, responseHeaders)) {
+		// Leaving the body unread, so the connection won't go back to the pool.
+		return code;
+	}
+	int err = ReadResponseEntity(&readbuf, responseHeaders, sink, progress);
 	if (err < 0) {
 		return err;
 	}
 	return code;
 }
 
-int Client::POST(const char *resource, const std::string &data, Buffer *output, float *progress) {
-	return POST(resource, data, "", output, progress);
-}
-
 int Client::SendRequest(const char *method, const char *resource, const char *otherHeaders, float *progress) {
 	return SendRequestWithData(method, resource, "", otherHeaders, progress);
 }
@@ -205,13 +352,16 @@ int Client::SendRequestWithData(const char *method, const char *resource, const
 	if (progress) {
 		*progress = 0.01f;
 	}
+	// Not reusable until the whole response is in.
+	SetReusable(false);
+	headRequest_ = !strcmp(method, "HEAD");
 
 	Buffer buffer;
 	const char *tpl =
 		"%s %s HTTP/%s\r\n"
 		"Host: %s\r\n"
 		"User-Agent: %s\r\n"
-		"Connection: close\r\n"
+		"%s"
 		"%s"
 		"\r\n";
 
@@ -219,6 +369,8 @@ int Client::SendRequestWithData(const char *method, const char *resource, const
 		method, resource, httpVersion_,
 		host_.c_str(),
 		userAgent_,
+		// HTTP/1.1 keeps the connection open by default, only worth it if it gets reused.
+		pool_ ? "" : "Connection: close\r\n",
 		otherHeaders ? otherHeaders : "");
 	buffer.Append(data);
 	bool flushed = buffer.FlushSocket(sock());
@@ -229,17 +381,17 @@ int Client::SendRequestWithData(const char *method, const char *resource, const
 }
 
 int Client::ReadResponseHeaders(Buffer *readbuf, std::vector<std::string> &responseHeaders, float *progress) {
-	// Snarf all the data we can into RAM. A little unsafe but hey.
-	if (readbuf->Read(sock(), 4096) < 0) {
-		ELOG("Failed to read HTTP headers :(");
-		return -1;
+	// Read only as much as we need, the entity may be right behind.
+	std::string line;
+	while (readbuf->TakeLineCRLF(&line) < 0) {
+		if (ReadMore(sock(), readbuf, limiter_) <= 0) {
+			ELOG("Failed to read HTTP headers :(");
+			return -1;
+		}
 	}
 
 	// Grab the first header line that contains the http code.
 
-	std::string line;
-	readbuf->TakeLineCRLF(&line);
-
 	int code;
 	size_t code_pos = line.find(' ');
 	if (code_pos != line.npos) {
@@ -251,11 +403,29 @@ int Client::ReadResponseHeaders(Buffer *readbuf, std::vector<std::string> &respo
 	} else {
 		return -1;
 	}
+	// 1.1 keeps the connection open unless told otherwise, 1.0 the other way around.
+	keepAlive_ = startsWith(line, "HTTP/1.1");
 
 	while (true) {
 		int sz = readbuf->TakeLineCRLF(&line);
+		if (sz < 0) {
+			if (ReadMore(sock(), readbuf, limiter_) <= 0) {
+				ELOG("Failed to read HTTP headers :(");
+				return -1;
+			}
+			continue;
+		}
 		if (!sz)
 			break;
+		if (startsWithNoCase(line, "Connection:")) {
+			std::string value = line.substr(11);
+			std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+			if (value.find("close") != std::string::npos) {
+				keepAlive_ = false;
+			} else if (value.find("keep-alive") != std::string::npos) {
+				keepAlive_ = true;
+			}
+		}
 		responseHeaders.push_back(line);
 	}
 
@@ -267,9 +437,14 @@ int Client::ReadResponseHeaders(Buffer *readbuf, std::vector<std::string> &respo
 }
 
 int Client::ReadResponseEntity(Buffer *readbuf, const std::vector<std::string> &responseHeaders, Buffer *output, float *progress) {
-	bool gzip = false;
+	BufferSink sink(output);
+	return ReadResponseEntity(readbuf, responseHeaders, &sink, progress);
+}
+
+int Client::ReadResponseEntity(Buffer *readbuf, const std::vector<std::string> &responseHeaders, ResponseSink *sink, float *progress) {
+	bool compressed = false;
 	bool chunked = false;
-	int contentLength = 0;
+	int64_t contentLength = -1;
 	for (std::string line : responseHeaders) {
 		if (startsWithNoCase(line, "Content-Length:")) {
 			size_t size_pos = line.find_first_of(' ');
@@ -277,13 +452,13 @@ int Client::ReadResponseEntity(Buffer *readbuf, const std::vector<std::string> &
 				size_pos = line.find_first_not_of(' ', size_pos);
 			}
 			if (size_pos != line.npos) {
-				contentLength = atoi(&line[size_pos]);
+				contentLength = atoll(&line[size_pos]);
 				chunked = false;
 			}
 		} else if (startsWithNoCase(line, "Content-Encoding:")) {
 			// TODO: Case folding...
-			if (line.find("gzip") != std::string::npos) {
-				gzip = true;
+			if (line.find("gzip") != std::string::npos || line.find("deflate") != std::string::npos) {
+				compressed = true;
 			}
 		} else if (startsWithNoCase(line, "Transfer-Encoding:")) {
 			// TODO: Case folding...
@@ -293,40 +468,55 @@ int Client::ReadResponseEntity(Buffer *readbuf, const std::vector<std::string> &
 		}
 	}
 
-	if (!contentLength && progress) {
+	if (contentLength <= 0 && progress) {
 		// Content length is unknown.
 		// Set progress to 1% so it looks like something is happening...
 		*progress = 0.1f;
 	}
 
-	if (!contentLength || !progress) {
-		// No way to know how far along we are. Let's just not update the progress counter.
-		if (!readbuf->ReadAll(sock(), contentLength))
-			return -1;
-	} else {
-		// Let's read in chunks, updating progress between each.
-		if (!readbuf->ReadAllWithProgress(sock(), contentLength, progress))
-			return -1;
-	}
+	InflatingSink inflatingSink(sink);
+	ResponseSink *target = compressed ? &inflatingSink : sink;
 
-	// output now contains the rest of the reply. Dechunk it.
-	if (chunked) {
-		DeChunk(readbuf, output, contentLength, progress);
+	// The body has to end where the server says it does, rather than when the connection
+	// closes, or the connection can't be used again.
+	bool delimited = true;
+	if (headRequest_) {
+		// Headers only, whatever they say about the length.
+	} else if (chunked) {
+		if (!ReadChunked(sock(), readbuf, limiter_, target))
+			return -1;
+	} else if (contentLength >= 0) {
+		int64_t remaining = contentLength;
+		while (remaining > 0) {
+			int64_t n = ForwardSome(sock(), readbuf, limiter_, remaining, target);
+			if (n < 0)
+				return -1;
+			remaining -= n;
+			if (progress) {
+				*progress = (float)(contentLength - remaining) / contentLength;
+			}
+		}
 	} else {
-		output->Append(*readbuf);
+		// No way to know how far along we are. Let's just not update the progress counter.
+		// Only the server closing ends the body, a failed read or write doesn't.
+		while (true) {
+			int64_t n = ForwardSome(sock(), readbuf, limiter_, INT64_MAX, target);
+			if (n == FORWARD_EOF)
+				break;
+			if (n < 0)
+				return -1;
+		}
+		delimited = false;
 	}
+	// Anything left over means we've lost track of where responses start.
+	SetReusable(keepAlive_ && delimited && readbuf->empty());
 
-	// If it's gzipped, we decompress it and put it back in the buffer.
-	if (gzip) {
-		std::string compressed, decompressed;
-		output->TakeAll(&compressed);
-		bool result = decompress_string(compressed, &decompressed);
-		if (!result) {
-			ELOG("Error decompressing using zlib");
+	if (compressed && !inflatingSink.Done()) {
+		ELOG("Compressed response ended early");
+		if (progress) {
 			*progress = 0.0f;
-			return -1;
 		}
-		output->Append(decompressed);
+		return -1;
 	}
 
 	if (progress) {
@@ -335,8 +525,495 @@ int Client::ReadResponseEntity(Buffer *readbuf, const std::vector<std::string> &
 	return 0;
 }
 
+// File downloads keep what they've got in <outfile>.part, with the byte ranges that are done
+// in <outfile>.part.state next to it. Large files get preallocated and split into segments
+// that are fetched in parallel, each writing to its own part of the file.
+
+#define MIN_SEGMENT_SIZE (1024 * 1024)
+#define STATE_SAVE_INTERVAL 1.0
+#define RETRY_DELAY_MS 250
+
+static bool FindHeader(const std::vector<std::string> &headers, const char *name, std::string *value) {
+	size_t len = strlen(name);
+	for (const std::string &line : headers) {
+		if (line.size() > len && line[len] == ':' && startsWithNoCase(line, name)) {
+			size_t pos = line.find_first_not_of(' ', len + 1);
+			*value = pos == line.npos ? "" : line.substr(pos);
+			return true;
+		}
+	}
+	return false;
+}
+
+// "bytes 0-499/1234", or "bytes */1234" as the answer to a range past the end, in which case
+// start is -1.
+static bool ParseContentRange(const std::vector<std::string> &headers, int64_t *start, int64_t *total) {
+	std::string value;
+	if (!FindHeader(headers, "Content-Range", &value))
+		return false;
+	long long first, last, size;
+	if (sscanf(value.c_str(), "bytes %lld-%lld/%lld", &first, &last, &size) == 3) {
+		*start = first;
+	} else if (sscanf(value.c_str(), "bytes */%lld", &size) == 1) {
+		*start = -1;
+	} else {
+		return false;
+	}
+	*total = size;
+	return true;
+}
+
+// Whatever tells us the file on the server is still the one we've got the start of.
+static std::string GetValidator(const std::vector<std::string> &headers) {
+	std::string value;
+	if (FindHeader(headers, "ETag", &value) || FindHeader(headers, "Last-Modified", &value))
+		return value;
+	return "-";
+}
+
+static bool SeekFile(FILE *file, int64_t offset) {
+#ifdef _WIN32
+	return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+	return fseeko(file, offset, SEEK_SET) == 0;
+#endif
+}
+
+static int64_t GetFileSize(FILE *file) {
+#ifdef _WIN32
+	if (_fseeki64(file, 0, SEEK_END) != 0)
+		return -1;
+	return _ftelli64(file);
+#else
+	if (fseeko(file, 0, SEEK_END) != 0)
+		return -1;
+	return ftello(file);
+#endif
+}
+
+// Gets the whole file allocated up front, so segments can be written in any order without
+// leaving holes for the filesystem to fill in piecemeal.
+static bool PreallocateFile(FILE *file, int64_t size) {
+#ifdef _WIN32
+	return _chsize_s(_fileno(file), size) == 0;
+#else
+	int fd = fileno(file);
+#if defined(__linux__) && !defined(__ANDROID__)
+	if (posix_fallocate(fd, 0, size) == 0)
+		return true;
+#endif
+	return ftruncate(fd, size) == 0;
+#endif
+}
+
+// A .part file and which of its bytes are there yet.
+class PartialFile {
+public:
+	PartialFile(const std::string &filename, const volatile bool *cancelled, float *progress)
+		: filename_(filename), stateFilename_(filename + ".state"), cancelled_(cancelled), progress_(progress), size_(-1), lastSave_(0.0) {
+	}
+
+	// Picks up the state of an earlier attempt. False if there's nothing usable.
+	bool Load();
+	// Starts over with an empty, preallocated file of size bytes, split in count segments.
+	bool Reset(int64_t size, const std::string &validator, int count);
+	bool Save();
+	// Gives up on it for good.
+	void Discard();
+	// Moves the finished file into place.
+	bool Finish(const std::string &outfile);
+
+	// Fetches what's missing of a segment, retrying when connections fail.
+	void Fetch(const std::string &host, int port, const std::string &resource, size_t index, int maxRetries, net::RateLimiter *limiter);
+	// Fetches segments one after another, taking the next from *next, until there are none
+	// left. Several threads can share one next, one connection each.
+	void FetchSegments(std::atomic<size_t> *next, const std::string &host, int port, const std::string &resource, int maxRetries, net::RateLimiter *limiter);
+	// From the sink of a segment's request.
+	bool Write(size_t index, FILE *file, Buffer *data);
+
+	int64_t Size() const { return size_; }
+	const std::string &Validator() const { return validator_; }
+	size_t SegmentCount() const { return segments_.size(); }
+	bool SegmentComplete(size_t index);
+	// Where the first segment with something missing continues, or size_ if none.
+	int64_t FirstMissing();
+	bool Complete();
+
+private:
+	struct Segment {
+		int64_t start;
+		int64_t end;  // Exclusive.
+		int64_t done;
+	};
+
+	// Lock must be held.
+	void UpdateProgress();
+
+	std::string filename_;
+	std::string stateFilename_;
+	const volatile bool *cancelled_;
+	float *progress_;
+	recursive_mutex lock_;
+	int64_t size_;
+	std::string validator_;
+	// In file order, covering all of it.
+	std::vector<Segment> segments_;
+	double lastSave_;
+};
+
+// Checks that the response is the range that was asked for, and writes it where it belongs.
+class SegmentSink : public ResponseSink {
+public:
+	SegmentSink(PartialFile *part, size_t index, FILE *file, int64_t start)
+		: part_(part), index_(index), file_(file), start_(start) {}
+
+	bool Begin(int code, const std::vector<std::string> &responseHeaders) override {
+		int64_t start, total;
+		if (code != 206 || !ParseContentRange(responseHeaders, &start, &total))
+			return false;
+		return start == start_ && total == part_->Size() && GetValidator(responseHeaders) == part_->Validator();
+	}
+	bool Write(Buffer *data) override {
+		return part_->Write(index_, file_, data);
+	}
+
+private:
+	PartialFile *part_;
+	size_t index_;
+	FILE *file_;
+	int64_t start_;
+};
+
+// Takes the response to the first request of a file download, which asks for a single byte.
+// Tells us if the server does ranges and how big the file is, or if it doesn't, gets the whole
+// file in one go.
+class ProbeSink : public ResponseSink {
+public:
+	ProbeSink(const std::string &filename, const volatile bool *cancelled, float *progress)
+		: filename_(filename), cancelled_(cancelled), progress_(progress), file_(nullptr), code_(-1), start_(-1), size_(-1), received_(0), contentLength_(-1) {}
+	~ProbeSink() {
+		Close();
+	}
+
+	bool Begin(int code, const std::vector<std::string> &responseHeaders) override {
+		code_ = code;
+		validator_ = GetValidator(responseHeaders);
+		if (code == 200) {
+			// No ranges, or at least not here.
+			std::string length;
+			if (FindHeader(responseHeaders, "Content-Length", &length))
+				contentLength_ = atoll(length.c_str());
+			file_ = fopen(filename_.c_str(), "wb");
+			return file_ != nullptr;
+		}
+		if (code == 206 || code == 416)
+			return ParseContentRange(responseHeaders, &start_, &size_);
+		return false;
+	}
+	bool Write(Buffer *data) override {
+		if (*cancelled_)
+			return false;
+		if (!file_) {
+			data->clear();
+			return true;
+		}
+		received_ += data->size();
+		if (contentLength_ > 0)
+			*progress_ = std::min((float)received_ / (float)contentLength_, 0.999f);
+		return data->Flush(file_);
+	}
+
+	// Returns false if writing the file failed.
+	bool Close() {
+		bool success = true;
+		if (file_)
+			success = fclose(file_) == 0;
+		file_ = nullptr;
+		return success;
+	}
+
+	int Code() const { return code_; }
+	// From Content-Range, -1 if there wasn't one.
+	int64_t Start() const { return start_; }
+	int64_t Size() const { return size_; }
+	const std::string &Validator() const { return validator_; }
+
+private:
+	std::string filename_;
+	const volatile bool *cancelled_;
+	float *progress_;
+	FILE *file_;
+	int code_;
+	int64_t start_;
+	int64_t size_;
+	std::string validator_;
+	int64_t received_;
+	int64_t contentLength_;
+};
+
+bool PartialFile::Load() {
+	FILE *state = fopen(stateFilename_.c_str(), "r");
+	if (!state)
+		return false;
+	char line[1024];
+	long long a, b, c;
+	bool valid = true;
+	size_ = -1;
+	segments_.clear();
+	while (valid && fgets(line, sizeof(line), state)) {
+		if (sscanf(line, "size %lld", &a) == 1) {
+			size_ = a;
+		} else if (!strncmp(line, "validator ", 10)) {
+			validator_ = line + 10;
+			validator_.erase(validator_.find_last_not_of("\r\n") + 1);
+		} else if (sscanf(line, "segment %lld %lld %lld", &a, &b, &c) == 3) {
+			int64_t expectedStart = segments_.empty() ? 0 : segments_.back().end;
+			valid = a == expectedStart && a < b && c >= 0 && c <= b - a;
+			Segment segment = { a, b, c };
+			segments_.push_back(segment);
+		} else {
+			valid = false;
+		}
+	}
+	fclose(state);
+	valid = valid && size_ > 0 && !segments_.empty() && segments_.back().end == size_;
+
+	// The file itself has to be there, and as big as the whole download.
+	FILE *file = valid ? fopen(filename_.c_str(), "rb") : nullptr;
+	if (file) {
+		valid = GetFileSize(file) == size_;
+		fclose(file);
+	} else {
+		valid = false;
+	}
+	if (!valid) {
+		WLOG("Not resuming %s, its state doesn't add up", filename_.c_str());
+		Discard();
+		return false;
+	}
+	lock_guard guard(lock_);
+	UpdateProgress();
+	return true;
+}
+
+bool PartialFile::Reset(int64_t size, const std::string &validator, int count) {
+	FILE *file = fopen(filename_.c_str(), "wb");
+	if (!file) {
+		ELOG("Failed opening %s for writing", filename_.c_str());
+		return false;
+	}
+	bool allocated = PreallocateFile(file, size);
+	if (fclose(file) != 0 || !allocated) {
+		ELOG("Failed making room for %lld bytes in %s", (long long)size, filename_.c_str());
+		remove(filename_.c_str());
+		return false;
+	}
+
+	size_ = size;
+	validator_ = validator;
+	segments_.clear();
+	for (int i = 0; i < count; i++) {
+		Segment segment;
+		segment.start = size * i / count;
+		segment.end = size * (i + 1) / count;
+		segment.done = 0;
+		segments_.push_back(segment);
+	}
+	return Save();
+}
+
+bool PartialFile::Save() {
+	lock_guard guard(lock_);
+	lastSave_ = real_time_now();
+	// Written beside the old one and then renamed over it, so there's always a complete one.
+	std::string temp = stateFilename_ + ".tmp";
+	FILE *state = fopen(temp.c_str(), "w");
+	if (!state)
+		return false;
+	fprintf(state, "size %lld\n", (long long)size_);
+	fprintf(state, "validator %s\n", validator_.c_str());
+	for (const Segment &segment : segments_) {
+		fprintf(state, "segment %lld %lld %lld\n", (long long)segment.start, (long long)segment.end, (long long)segment.done);
+	}
+	if (fclose(state) != 0) {
+		remove(temp.c_str());
+		return false;
+	}
+#ifdef _WIN32
+	remove(stateFilename_.c_str());
+#endif
+	return rename(temp.c_str(), stateFilename_.c_str()) == 0;
+}
+
+void PartialFile::Discard() {
+	remove(stateFilename_.c_str());
+	remove(filename_.c_str());
+	lock_guard guard(lock_);
+	size_ = -1;
+	segments_.clear();
+}
+
+bool PartialFile::Finish(const std::string &outfile) {
+	remove(stateFilename_.c_str());
+	remove(outfile.c_str());
+	if (rename(filename_.c_str(), outfile.c_str()) != 0) {
+		ELOG("Failed renaming %s to %s", filename_.c_str(), outfile.c_str());
+		return false;
+	}
+	return true;
+}
+
+void PartialFile::FetchSegments(std::atomic<size_t> *next, const std::string &host, int port, const std::string &resource, int maxRetries, net::RateLimiter *limiter) {
+	size_t index;
+	while ((index = (*next)++) < segments_.size() && !*cancelled_) {
+		if (!SegmentComplete(index))
+			Fetch(host, port, resource, index, maxRetries, limiter);
+	}
+}
+
+void PartialFile::Fetch(const std::string &host, int port, const std::string &resource, size_t index, int maxRetries, net::RateLimiter *limiter) {
+	FILE *file = fopen(filename_.c_str(), "r+b");
+	if (!file) {
+		ELOG("Failed opening %s for writing", filename_.c_str());
+		return;
+	}
+	// Unbuffered, so that what's counted as done is really in the file when the state is saved.
+	setvbuf(file, NULL, _IONBF, 0);
+
+	int failures = 0;
+	while (!*cancelled_ && !SegmentComplete(index)) {
+		int64_t start, end;
+		{
+			lock_guard guard(lock_);
+			start = segments_[index].start + segments_[index].done;
+			end = segments_[index].end;
+		}
+		http::Client client;
+		client.SetRateLimiter(limiter);
+		if (client.Resolve(host.c_str(), port) && client.Connect() && SeekFile(file, start)) {
+			SegmentSink sink(this, index, file, start);
+			client.GETRange(resource.c_str(), start, end, &sink);
+		}
+
+		int64_t next;
+		{
+			lock_guard guard(lock_);
+			next = segments_[index].start + segments_[index].done;
+		}
+		if (next > start) {
+			// Got somewhere, it's worth trying again right away if it didn't finish.
+			failures = 0;
+		} else if (++failures > maxRetries) {
+			ELOG("Giving up on bytes %lld-%lld of %s", (long long)start, (long long)end, filename_.c_str());
+			break;
+		} else {
+			sleep_ms(RETRY_DELAY_MS * failures);
+		}
+	}
+	fclose(file);
+}
+
+bool PartialFile::Write(size_t index, FILE *file, Buffer *data) {
+	if (*cancelled_)
+		return false;
+	int64_t size = data->size();
+	int64_t remaining;
+	{
+		lock_guard guard(lock_);
+		remaining = segments_[index].end - segments_[index].start - segments_[index].done;
+	}
+	// Longer than asked for means something's off with the server.
+	if (size > remaining || !data->Flush(file))
+		return false;
+
+	lock_guard guard(lock_);
+	segments_[index].done += size;
+	UpdateProgress();
+	if (real_time_now() - lastSave_ >= STATE_SAVE_INTERVAL) {
+		Save();
+	}
+	return true;
+}
+
+bool PartialFile::SegmentComplete(size_t index) {
+	lock_guard guard(lock_);
+	return segments_[index].start + segments_[index].done >= segments_[index].end;
+}
+
+int64_t PartialFile::FirstMissing() {
+	lock_guard guard(lock_);
+	for (const Segment &segment : segments_) {
+		if (segment.start + segment.done < segment.end)
+			return segment.start + segment.done;
+	}
+	return size_;
+}
+
+bool PartialFile::Complete() {
+	return FirstMissing() >= size_;
+}
+
+void PartialFile::UpdateProgress() {
+	int64_t done = 0;
+	for (const Segment &segment : segments_) {
+		done += segment.done;
+	}
+	// Not quite 1.0, that means finished.
+	*progress_ = std::min((float)done / (float)size_, 0.999f);
+}
+
+#define DEFAULT_MAX_CONCURRENT 4
+#define DEFAULT_MAX_PER_HOST 2
+
+class DownloadQueue {
+public:
+	DownloadQueue()
+		: maxConcurrent_(DEFAULT_MAX_CONCURRENT), maxPerHost_(DEFAULT_MAX_PER_HOST), workers_(0), idleWorkers_(0), running_(0), nextSequence_(0), stop_(false) {}
+
+	void Add(std::shared_ptr<DownloadQueue> self, std::shared_ptr<Download> dl, const std::string &host, int priority);
+	// Fails whatever is still queued and lets the workers exit once they're done.
+	void Stop();
+
+	void SetMaxConcurrent(std::shared_ptr<DownloadQueue> self, int count);
+	void SetMaxPerHost(int count);
+
+	// For the extra connections of a running download's segments, which count against both
+	// limits like downloads do. Returns how many of count it can have, out of what isn't
+	// needed for the queued downloads. Give them back with ReleaseSlots.
+	int AcquireSlots(const std::string &host, int count);
+	void ReleaseSlots(const std::string &host, int count);
+
+	net::RateLimiter limiter;
+
+private:
+	struct Entry {
+		std::shared_ptr<Download> download;
+		std::string host;
+		int priority;
+		uint64_t sequence;
+	};
+
+	void WorkerFunc(std::shared_ptr<DownloadQueue> self);
+	// Lock must be held for these.
+	bool PopRunnable(Entry *entry);
+	void StartWorkers(std::shared_ptr<DownloadQueue> self);
+
+	recursive_mutex mutex_;
+	condition_variable changed_;
+	// Linear scans, but even a big catalog is only some hundreds.
+	std::vector<Entry> queued_;
+	std::map<std::string, int> runningPerHost_;
+	int maxConcurrent_;
+	int maxPerHost_;
+	int workers_;
+	int idleWorkers_;
+	int running_;
+	uint64_t nextSequence_;
+	bool stop_;
+};
+
 Download::Download(const std::string &url, const std::string &outfile)
-	: progress_(0.0f), url_(url), outfile_(outfile), resultCode_(0), completed_(false), failed_(false), cancelled_(false), hidden_(false) {
+	: maxSegments_(4), maxRetries_(3), limiter_(nullptr), queue_(nullptr), progress_(0.0f), url_(url), outfile_(outfile), resultCode_(0), completed_(false), failed_(false), cancelled_(false), hidden_(false) {
 }
 
 Download::~Download() {
@@ -359,6 +1036,11 @@ void Download::Do(std::shared_ptr<Download> self) {
 	// yeah this is ugly, I need to think about how life time should be managed for these...
 	std::shared_ptr<Download> self_ = self;
 	resultCode_ = 0;
+	if (cancelled_) {
+		// Before it even got its turn.
+		SetFailed(-1);
+		return;
+	}
 
 	Url fileUrl(url_);
 	if (!fileUrl.Valid()) {
@@ -367,36 +1049,42 @@ void Download::Do(std::shared_ptr<Download> self) {
 	}
 	net::AutoInit netInit;
 
-	http::Client client;
-	if (!client.Resolve(fileUrl.Host().c_str(), fileUrl.Port())) {
-		ELOG("Failed resolving %s", url_.c_str());
-		SetFailed(-1);
-		return;
-	}
+	int resultCode;
+	if (outfile_.empty()) {
+		http::Client client;
+		client.SetRateLimiter(limiter_);
+		if (!client.Resolve(fileUrl.Host().c_str(), fileUrl.Port())) {
+			ELOG("Failed resolving %s", url_.c_str());
+			SetFailed(-1);
+			return;
+		}
 
-	if (cancelled_) {
-		SetFailed(-1);
-		return;
-	}
+		if (cancelled_) {
+			SetFailed(-1);
+			return;
+		}
 
-	if (!client.Connect()) {
-		ELOG("Failed connecting to server.");
-		SetFailed(-1);
-		return;
-	}
+		if (!client.Connect()) {
+			ELOG("Failed connecting to server.");
+			SetFailed(-1);
+			return;
+		}
 
-	if (cancelled_) {
-		SetFailed(-1);
-		return;
-	}
+		if (cancelled_) {
+			SetFailed(-1);
+			return;
+		}
 
-	// TODO: Allow cancelling during a GET somehow...
-	int resultCode = client.GET(fileUrl.Resource().c_str(), &buffer_, &progress_);
+		resultCode = client.GET(fileUrl.Resource().c_str(), &buffer_, &progress_);
+	} else {
+		// Does its own connecting, possibly several times over.
+		resultCode = DownloadToFile(fileUrl.Host(), fileUrl.Port(), fileUrl.Resource());
+		if (resultCode < 0) {
+			failed_ = true;
+		}
+	}
 	if (resultCode == 200) {
 		ILOG("Completed downloading %s to %s", url_.c_str(), outfile_.empty() ? "memory" : outfile_.c_str());
-		if (!outfile_.empty() && !buffer_.FlushToFile(outfile_.c_str())) {
-			ELOG("Failed writing download to %s", outfile_.c_str());
-		}
 	} else {
 		ELOG("Error downloading %s to %s: %i", url_.c_str(), outfile_.c_str(), resultCode);
 	}
@@ -409,22 +1097,285 @@ void Download::Do(std::shared_ptr<Download> self) {
 	completed_ = true;
 }
 
-std::shared_ptr<Download> Downloader::StartDownload(const std::string &url, const std::string &outfile) {
-	std::shared_ptr<Download> dl(new Download(url, outfile));
+int Download::DownloadToFile(const std::string &host, int port, const std::string &resource) {
+	PartialFile part(outfile_ + ".part", &cancelled_, &progress_);
+	bool resuming = part.Load();
+	if (resuming) {
+		ILOG("Resuming %s from %lld of %lld bytes", url_.c_str(), (long long)part.FirstMissing(), (long long)part.Size());
+	}
+
+	// First, a single byte from where we'd continue. If that comes back as a range, we know the
+	// size and can go on in segments. If not, the whole file comes back and that's that.
+	int failures = 0;
+	while (true) {
+		if (cancelled_) {
+			part.Discard();
+			return -1;
+		}
+		int64_t from = resuming ? std::min(part.FirstMissing(), part.Size() - 1) : 0;
+		ProbeSink probe(outfile_ + ".part", &cancelled_, &progress_);
+		http::Client client;
+		client.SetRateLimiter(limiter_);
+		int code = -1;
+		if (client.Resolve(host.c_str(), port) && client.Connect()) {
+			code = client.GETRange(resource.c_str(), from, from + 1, &probe);
+		}
+		bool written = probe.Close();
+
+		if (probe.Code() == 200) {
+			// The whole file, written over whatever we had.
+			if (code == 200 && written && !cancelled_) {
+				return part.Finish(outfile_) ? 200 : -1;
+			}
+			part.Discard();
+			resuming = false;
+		} else if (code == 206 && probe.Start() == from && probe.Size() > 0) {
+			if (!resuming || probe.Size() != part.Size() || probe.Validator() != part.Validator()) {
+				if (resuming) {
+					WLOG("%s changed on the server, starting over", url_.c_str());
+				}
+				int count = (int)std::max((int64_t)1, std::min((int64_t)maxSegments_, probe.Size() / MIN_SEGMENT_SIZE));
+				if (!part.Reset(probe.Size(), probe.Validator(), count))
+					return -1;
+			}
+			break;
+		} else if (code == 416 && !resuming && probe.Size() == 0) {
+			// Nothing to download, just make the empty file.
+			FILE *file = fopen(outfile_.c_str(), "wb");
+			if (!file)
+				return -1;
+			fclose(file);
+			return 200;
+		} else if (code == 416 && resuming) {
+			// Got shorter since we started. Starting over will sort it out.
+			WLOG("%s changed on the server, starting over", url_.c_str());
+			part.Discard();
+			resuming = false;
+		} else if (code >= 0 && code < 500) {
+			// The server means it.
+			if (!resuming)
+				part.Discard();
+			return code;
+		}
+
+		if (++failures > maxRetries_) {
+			return code;
+		}
+		sleep_ms(RETRY_DELAY_MS * failures);
+	}
+
+	int missing = 0;
+	for (size_t i = 0; i < part.SegmentCount(); i++) {
+		if (!part.SegmentComplete(i))
+			missing++;
+	}
+	// This thread is one connection already. On a queue, the others have to fit in its limits,
+	// and if they don't, the segments just take turns.
+	int extra = std::max(0, missing - 1);
+	if (queue_)
+		extra = queue_->AcquireSlots(queueHost_, extra);
+	ILOG("Downloading %lld bytes from %s in %d segments over %d connections", (long long)part.Size(), url_.c_str(), (int)part.SegmentCount(), extra + 1);
+	std::atomic<size_t> next(0);
+	std::vector<std::thread *> threads;
+	for (int i = 0; i < extra; i++) {
+		threads.push_back(new std::thread(std::bind(&PartialFile::FetchSegments, &part, &next, host, port, resource, maxRetries_, limiter_)));
+	}
+	part.FetchSegments(&next, host, port, resource, maxRetries_, limiter_);
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+	if (queue_)
+		queue_->ReleaseSlots(queueHost_, extra);
+
+	if (cancelled_) {
+		part.Discard();
+		return -1;
+	}
+	if (!part.Complete()) {
+		// Keep what we've got for next time.
+		part.Save();
+		return -1;
+	}
+	return part.Finish(outfile_) ? 200 : -1;
+}
+
+void DownloadQueue::Add(std::shared_ptr<DownloadQueue> self, std::shared_ptr<Download> dl, const std::string &host, int priority) {
+	lock_guard guard(mutex_);
+	if (stop_) {
+		dl->SetFailed(-1);
+		return;
+	}
+	Entry entry;
+	entry.download = dl;
+	entry.host = host;
+	entry.priority = priority;
+	entry.sequence = nextSequence_++;
+	queued_.push_back(entry);
+	StartWorkers(self);
+	changed_.notify_all();
+}
+
+void DownloadQueue::Stop() {
+	std::vector<Entry> dropped;
+	{
+		lock_guard guard(mutex_);
+		stop_ = true;
+		dropped.swap(queued_);
+		changed_.notify_all();
+	}
+	for (size_t i = 0; i < dropped.size(); i++) {
+		dropped[i].download->SetFailed(-1);
+	}
+}
+
+void DownloadQueue::SetMaxConcurrent(std::shared_ptr<DownloadQueue> self, int count) {
+	lock_guard guard(mutex_);
+	// Extra workers just stay idle if it goes down.
+	maxConcurrent_ = std::max(1, count);
+	StartWorkers(self);
+	changed_.notify_all();
+}
+
+void DownloadQueue::SetMaxPerHost(int count) {
+	lock_guard guard(mutex_);
+	maxPerHost_ = std::max(1, count);
+	changed_.notify_all();
+}
+
+int DownloadQueue::AcquireSlots(const std::string &host, int count) {
+	lock_guard guard(mutex_);
+	int slots = std::min(count, maxConcurrent_ - running_ - (int)queued_.size());
+	slots = std::min(slots, maxPerHost_ - runningPerHost_[host]);
+	if (slots <= 0)
+		return 0;
+	running_ += slots;
+	runningPerHost_[host] += slots;
+	return slots;
+}
+
+void DownloadQueue::ReleaseSlots(const std::string &host, int count) {
+	if (count <= 0)
+		return;
+	lock_guard guard(mutex_);
+	running_ -= count;
+	runningPerHost_[host] -= count;
+	changed_.notify_all();
+}
+
+void DownloadQueue::StartWorkers(std::shared_ptr<DownloadQueue> self) {
+	// Only as many as there's work for, up to the limit.
+	while (workers_ < maxConcurrent_ && idleWorkers_ < (int)queued_.size()) {
+		workers_++;
+		idleWorkers_++;
+		std::thread th(std::bind(&DownloadQueue::WorkerFunc, this, self));
+		th.detach();
+	}
+}
+
+bool DownloadQueue::PopRunnable(Entry *entry) {
+	int best = -1;
+	for (int i = 0; i < (int)queued_.size(); i++) {
+		const Entry &e = queued_[i];
+		// Cancelled ones finish right away, no reason to hold them up.
+		if (e.download->cancelled_) {
+			best = i;
+			break;
+		}
+		auto running = runningPerHost_.find(e.host);
+		if (running != runningPerHost_.end() && running->second >= maxPerHost_)
+			continue;
+		if (best < 0 || e.priority < queued_[best].priority || (e.priority == queued_[best].priority && e.sequence < queued_[best].sequence))
+			best = i;
+	}
+	if (best < 0)
+		return false;
+	*entry = queued_[best];
+	queued_.erase(queued_.begin() + best);
+	return true;
+}
+
+void DownloadQueue::WorkerFunc(std::shared_ptr<DownloadQueue> self) {
+	setCurrentThreadName("DownloadWorker");
+	while (true) {
+		Entry entry;
+		{
+			lock_guard guard(mutex_);
+			while (!stop_ && !(running_ < maxConcurrent_ && PopRunnable(&entry))) {
+				changed_.wait(mutex_);
+			}
+			if (stop_) {
+				workers_--;
+				idleWorkers_--;
+				return;
+			}
+			idleWorkers_--;
+			running_++;
+			runningPerHost_[entry.host]++;
+		}
+
+		entry.download->SetRateLimiter(&limiter);
+		entry.download->queue_ = this;
+		entry.download->queueHost_ = entry.host;
+		entry.download->Do(entry.download);
+		// The worker itself keeps a reference to the queue, so no need to hold on to the download.
+		entry.download.reset();
+
+		lock_guard guard(mutex_);
+		running_--;
+		if (--runningPerHost_[entry.host] == 0)
+			runningPerHost_.erase(entry.host);
+		idleWorkers_++;
+		changed_.notify_all();
+	}
+}
+
+Downloader::Downloader() : queue_(new DownloadQueue()) {
+}
+
+Downloader::~Downloader() {
+	CancelAll();
+	queue_->Stop();
+}
+
+std::shared_ptr<Download> Downloader::Enqueue(std::shared_ptr<Download> dl, int priority) {
+	Url url(dl->url());
+	char port[16];
+	snprintf(port, sizeof(port), ":%d", url.Port());
 	downloads_.push_back(dl);
-	dl->Start(dl);
+	if (url.Valid()) {
+		// Have the address ready by the time a worker gets to it.
+		net::Resolver::Default()->Prefetch(url.Host(), port + 1);
+	}
+	queue_->Add(queue_, dl, url.Host() + port, priority);
 	return dl;
 }
 
+std::shared_ptr<Download> Downloader::StartDownload(const std::string &url, const std::string &outfile, int priority) {
+	std::shared_ptr<Download> dl(new Download(url, outfile));
+	return Enqueue(dl, priority);
+}
+
 std::shared_ptr<Download> Downloader::StartDownloadWithCallback(
 	const std::string &url,
 	const std::string &outfile,
-	std::function<void(Download &)> callback) {
+	std::function<void(Download &)> callback,
+	int priority) {
 	std::shared_ptr<Download> dl(new Download(url, outfile));
 	dl->SetCallback(callback);
-	downloads_.push_back(dl);
-	dl->Start(dl);
-	return dl;
+	return Enqueue(dl, priority);
+}
+
+void Downloader::SetMaxConcurrent(int count) {
+	queue_->SetMaxConcurrent(queue_, count);
+}
+
+void Downloader::SetMaxPerHost(int count) {
+	queue_->SetMaxPerHost(count);
+}
+
+void Downloader::SetBandwidthLimit(int64_t bytesPerSecond) {
+	queue_->limiter.SetRate(bytesPerSecond);
 }
 
 void Downloader::Update() {
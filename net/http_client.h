@@ -19,37 +19,100 @@
 
 namespace net {
 
+class ConnectionPool;
+class RateLimiter;
+
 class Connection {
 public:
 	Connection();
 	virtual ~Connection();
 
-	// Inits the sockaddr_in.
+	// Inits the sockaddr_in. Skipped if the pool has a connection to the host already, in which
+	// case Connect resolves later only if it turns out to need a new one after all.
 	bool Resolve(const char *host, int port);
 
+	// Takes an idle connection from the pool if there is one, otherwise connects.
 	bool Connect(int maxTries = 2);
+	// Hands the connection back to the pool if it's reusable, otherwise closes it.
 	void Disconnect();
 
+	// Where to keep connections between uses. Null (the default here, but not for http::Client)
+	// means always closing them. Set before Connect.
+	void SetConnectionPool(ConnectionPool *pool) { pool_ = pool; }
+
 	// Only to be used for bring-up and debugging.
 	uintptr_t sock() const { return sock_; }
 
 protected:
+	// Whether sock_ came out of the pool, rather than being freshly connected.
+	bool IsReused() const { return reused_; }
+	// Set once a response has been read completely and the server agreed to keep the
+	// connection open, so Disconnect can pool it. Must be cleared when sending a request.
+	void SetReusable(bool reusable) { reusable_ = reusable; }
+
 	// Store the remote host here, so we can send it along through HTTP/1.1 requests.
 	// TODO: Move to http::client?
 	std::string host_;
 	int port_;
 
 	addrinfo *resolved_;
+	ConnectionPool *pool_;
 
 private:
-	uintptr_t sock_;
+	bool DoResolve();
 
+	uintptr_t sock_;
+	bool reused_;
+	bool reusable_;
 };
 
 }	// namespace net
 
 namespace http {
 
+// Where a response body goes as it comes in, a piece at a time, so it never has to be in memory
+// all at once. Transfer encodings are already undone by the time it gets here.
+class ResponseSink {
+public:
+	virtual ~ResponseSink() {}
+	// Called with the status code and response headers, before any of the body. Return false
+	// if the body isn't wanted, like for an error page, and the connection gets dropped.
+	virtual bool Begin(int code, const std::vector<std::string> &responseHeaders) { return true; }
+	// data holds the next piece of the body. Take out what you want, the rest gets dropped.
+	// Return false to abort the transfer.
+	virtual bool Write(Buffer *data) = 0;
+};
+
+// Collects the body in memory.
+class BufferSink : public ResponseSink {
+public:
+	explicit BufferSink(Buffer *output) : output_(output) {}
+	bool Write(Buffer *data) override;
+
+private:
+	Buffer *output_;
+};
+
+// Appends the body to a file that's already open.
+class FileSink : public ResponseSink {
+public:
+	explicit FileSink(FILE *file) : file_(file) {}
+	bool Write(Buffer *data) override;
+
+private:
+	FILE *file_;
+};
+
+class CallbackSink : public ResponseSink {
+public:
+	typedef std::function<bool(Buffer *data)> WriteFunc;
+	explicit CallbackSink(WriteFunc func) : func_(func) {}
+	bool Write(Buffer *data) override { return func_(data); }
+
+private:
+	WriteFunc func_;
+};
+
 class Client : public net::Connection {
 public:
 	Client();
@@ -57,6 +120,14 @@ public:
 
 	// Return value is the HTTP return code. 200 means OK. < 0 means some local error.
 	int GET(const char *resource, Buffer *output, float *progress = nullptr);
+	// Streams the body into sink instead, so memory use stays bounded whatever the size. Both
+	// ask for gzip or deflate, and decompress it as it comes in.
+	int GET(const char *resource, ResponseSink *sink, float *progress = nullptr);
+	// Asks for bytes [start, end) only, or everything from start on if end is negative. The
+	// server can say no by answering 200 with the whole thing, so check the code (206 for a
+	// range) and the Content-Range header in sink->Begin. Doesn't ask for compression, since
+	// ranges of a compressed body are no use on their own.
+	int GETRange(const char *resource, int64_t start, int64_t end, ResponseSink *sink, float *progress = nullptr);
 
 	// Return value is the HTTP return code.
 	int POST(const char *resource, const std::string &data, const std::string &mime, Buffer *output, float *progress = nullptr);
@@ -69,11 +140,30 @@ public:
 	int ReadResponseHeaders(Buffer *readbuf, std::vector<std::string> &responseHeaders, float *progress = nullptr);
 	// If your response contains a response, you must read it.
 	int ReadResponseEntity(Buffer *readbuf, const std::vector<std::string> &responseHeaders, Buffer *output, float *progress = nullptr);
+	int ReadResponseEntity(Buffer *readbuf, const std::vector<std::string> &responseHeaders, ResponseSink *sink, float *progress = nullptr);
+
+	// Everything read goes through limiter, which can be shared with other clients. Null, the
+	// default, means no limit.
+	void SetRateLimiter(net::RateLimiter *limiter) { limiter_ = limiter; }
 
 	const char *userAgent_;
 	const char *httpVersion_;
+
+private:
+	// Sends the request and reads the whole response. If a pooled connection turns out to have
+	// been closed by the server before anything came back, tries GET and HEAD once more on a
+	// new one. Anything else might have been processed already, so it fails instead.
+	int Exchange(const char *method, const char *resource, const std::string &data, const char *otherHeaders, ResponseSink *sink, float *progress);
+
+	net::RateLimiter *limiter_;
+	// From the last response's status line and headers.
+	bool keepAlive_;
+	// HEAD responses have headers but no body.
+	bool headRequest_;
 };
 
+class DownloadQueue;
+
 // Not particularly efficient, but hey - it's a background download, that's pretty cool :P
 class Download {
 public:
@@ -115,14 +205,36 @@ public:
 		}
 	}
 
+	// Only for downloads to a file. If the server takes Range requests, files of at least two
+	// segments' worth get split into up to this many parts, fetched in parallel over separate
+	// connections, as many as the Downloader's limits allow. Default 4, 1 to always use a
+	// single connection. Set before Start.
+	void SetMaxSegments(int count) { maxSegments_ = count; }
+	// How many times in a row a connection can fail without bringing anything new before the
+	// download is given up on. A file download that fails keeps what it got in outfile.part,
+	// and a later one to the same file picks up from there. Default 3.
+	void SetMaxRetries(int count) { maxRetries_ = count; }
+	// Passed on to every connection the download makes, see Client::SetRateLimiter.
+	void SetRateLimiter(net::RateLimiter *limiter) { limiter_ = limiter; }
+
 	// Just metadata. Convenient for download managers, for example, if set,
 	// Downloader::GetCurrentProgress won't return it in the results.
 	bool IsHidden() const { return hidden_; }
 	void SetHidden(bool hidden) { hidden_ = hidden; }
 
 private:
+	// Runs queued downloads on its own threads, instead of Start.
+	friend class DownloadQueue;
+
 	void Do(std::shared_ptr<Download> self);  // Actually does the download. Runs on thread.
+	int DownloadToFile(const std::string &host, int port, const std::string &resource);
 	void SetFailed(int code);
+	int maxSegments_;
+	int maxRetries_;
+	net::RateLimiter *limiter_;
+	// Set when running on a queue, which segments then need connection slots from.
+	DownloadQueue *queue_;
+	std::string queueHost_;
 	float progress_;
 	Buffer buffer_;
 	std::string url_;
@@ -137,18 +249,31 @@ private:
 
 using std::shared_ptr;
 
+// Downloads are queued and run on a pool of threads, with limits on how many run at once, in
+// total and per host. Lower priority values go first, and downloads of the same priority
+// start in the order they were added. Until then, they report a progress of 0.
 class Downloader {
 public:
-	~Downloader() {
-		CancelAll();
-	}
+	Downloader();
+	// Cancels everything. Downloads still running finish on their own, the queued ones fail.
+	~Downloader();
 
-	std::shared_ptr<Download> StartDownload(const std::string &url, const std::string &outfile);
+	std::shared_ptr<Download> StartDownload(const std::string &url, const std::string &outfile, int priority = 0);
 
 	std::shared_ptr<Download> StartDownloadWithCallback(
 		const std::string &url,
 		const std::string &outfile,
-		std::function<void(Download &)> callback);
+		std::function<void(Download &)> callback,
+		int priority = 0);
+
+	// How many connections can be open at once, which is also how many threads are used.
+	// Every running download takes one, and its segments (see Download::SetMaxSegments) only
+	// get more out of what the queued downloads don't need. Default 4.
+	void SetMaxConcurrent(int count);
+	// How many of those can be to the same host and port. Default 2.
+	void SetMaxPerHost(int count);
+	// Bytes per second for all downloads together, 0 (the default) for no limit.
+	void SetBandwidthLimit(int64_t bytesPerSecond);
 
 	// Drops finished downloads from the list.
 	void Update();
@@ -157,7 +282,13 @@ public:
 	std::vector<float> GetCurrentProgress();
 
 private:
+	std::shared_ptr<Download> Enqueue(std::shared_ptr<Download> dl, int priority);
+
 	std::vector<std::shared_ptr<Download>> downloads_;
+	// Shared with the worker threads, which may outlive us.
+	std::shared_ptr<DownloadQueue> queue_;
+
+	DISALLOW_COPY_AND_ASSIGN(Downloader);
 };
 
 
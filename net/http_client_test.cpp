@@ -0,0 +1,244 @@
+// Range requests and resumable, segmented downloads, against an http::Server in the same
+// process.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "base/buffer.h"
+#include "base/testutil.h"
+#include "base/timeutil.h"
+#include "net/http_client.h"
+#include "net/http_server.h"
+#include "thread/executor.h"
+#include "thread/thread.h"
+
+#define TEST_PORT 18557
+#define TEST_FILE_SIZE 5000000
+
+static const char *srcFile = "http_client_test_src.bin";
+static const char *outFile = "http_client_test_out.bin";
+
+static std::string data;
+static std::string etag = "\"v1\"";
+static std::atomic<long long> served(0);
+// Bytes /flaky may still send before it starts cutting responses short, -1 for no limit.
+static std::atomic<long long> budget(-1);
+// Percentage of /flaky responses that fail, a third with a 503 and the rest cut short.
+static std::atomic<int> faultPercent(0);
+static std::atomic<unsigned int> seed(12345);
+
+static int Random100() {
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) % 100;
+}
+
+static void WriteSource() {
+	FILE *file = fopen(srcFile, "wb");
+	fwrite(data.data(), 1, data.size(), file);
+	fclose(file);
+}
+
+static bool Exists(const std::string &filename) {
+	FILE *file = fopen(filename.c_str(), "rb");
+	if (file)
+		fclose(file);
+	return file != 0;
+}
+
+// Served by the server itself, Range support included.
+static void HandleFile(const http::Request &request) {
+	request.WriteFile(srcFile, "application/octet-stream");
+}
+
+// Hand-made ranges with an ETag, which can fail, get cut short or run out of budget.
+static void HandleFlaky(const http::Request &request) {
+	int64_t start, end;
+	if (!request.GetRange(&start, &end)) {
+		start = 0;
+		end = -1;
+	}
+	if (end < 0 || end >= (int64_t)data.size())
+		end = data.size() - 1;
+	int64_t length = end - start + 1;
+	int roll = Random100();
+	if (roll < faultPercent / 3) {
+		request.WriteHttpResponseHeader(503, 0);
+		return;
+	}
+	int64_t send = length;
+	bool cut = roll < faultPercent;
+	if (cut)
+		send = length / 3;
+	if (budget >= 0) {
+		long long left = budget.load();
+		if (send > left) {
+			send = left;
+			cut = true;
+		}
+		budget -= send;
+	}
+	served += send;
+	char headers[256];
+	snprintf(headers, sizeof(headers), "ETag: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n",
+		etag.c_str(), (long long)start, (long long)end, (long long)data.size());
+	// Close delimited when cut, so the client just sees the connection end early.
+	request.WriteHttpResponseHeader(206, cut ? -1 : length, "application/octet-stream", headers);
+	request.out_buffer()->Append(data.substr(start, send));
+}
+
+static void HandleNoRange(const http::Request &request) {
+	request.WriteHttpResponseHeader(200, data.size(), "application/octet-stream");
+	request.out_buffer()->Append(data);
+}
+
+static void RunServer(http::Server *server) {
+	server->Run(TEST_PORT);
+}
+
+class RangeSink : public http::ResponseSink {
+public:
+	bool Begin(int code, const std::vector<std::string> &responseHeaders) override {
+		for (size_t i = 0; i < responseHeaders.size(); i++) {
+			if (!strncmp(responseHeaders[i].c_str(), "Content-Range:", 14))
+				contentRange = responseHeaders[i].substr(15);
+		}
+		return true;
+	}
+	bool Write(Buffer *data) override {
+		std::string piece;
+		data->TakeAll(&piece);
+		body += piece;
+		return true;
+	}
+	std::string contentRange;
+	std::string body;
+};
+
+static int GetRange(int64_t start, int64_t end, RangeSink *sink) {
+	http::Client client;
+	if (!client.Resolve("127.0.0.1", TEST_PORT) || !client.Connect())
+		return -1;
+	return client.GETRange("/file", start, end, sink);
+}
+
+static int Fetch(const char *resource, int segments, int retries, bool cancel = false) {
+	char url[256];
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", TEST_PORT, resource);
+	std::shared_ptr<http::Download> download(new http::Download(url, outFile));
+	download->SetMaxSegments(segments);
+	download->SetMaxRetries(retries);
+	download->Start(download);
+	bool early = false;
+	while (!download->Done()) {
+		float progress = download->Progress();
+		if (progress == 1.0f)
+			early = true;
+		if (cancel && progress > 0.3f)
+			download->Cancel();
+		sleep_ms(2);
+	}
+	if (early)
+		Check("  progress 1.0 only when done", false);
+	return download->ResultCode();
+}
+
+int main() {
+	for (int i = 0; i < TEST_FILE_SIZE; i++)
+		data.push_back((char)(i * 7 + (i >> 9) + (i >> 17)));
+	WriteSource();
+
+	threading::ThreadPoolExecutor executor(8, 64);
+	http::Server server(&executor);
+	server.RegisterHandler("/file", &HandleFile);
+	server.RegisterHandler("/flaky", &HandleFlaky);
+	server.RegisterHandler("/norange", &HandleNoRange);
+	std::thread serverThread(std::bind(&RunServer, &server));
+	serverThread.detach();
+	sleep_ms(200);
+
+	std::string part = std::string(outFile) + ".part";
+	std::string state = part + ".state";
+
+	// The server side of ranges.
+	RangeSink middle, tail, past;
+	Check("206 for a range", GetRange(100, 200, &middle) == 206 && middle.body == data.substr(100, 100) &&
+		middle.contentRange == "bytes 100-199/5000000");
+	Check("206 for an open-ended range", GetRange(4999990, -1, &tail) == 206 && tail.body == data.substr(4999990));
+	Check("416 past the end", GetRange(TEST_FILE_SIZE, -1, &past) == 416 && past.contentRange == "bytes */5000000");
+
+	remove(outFile);
+	int code = Fetch("/file", 4, 3);
+	Check("segmented", code == 200 && ReadTestFile(outFile) == data && !Exists(part) && !Exists(state));
+
+	remove(outFile);
+	code = Fetch("/file", 1, 3);
+	Check("single segment", code == 200 && ReadTestFile(outFile) == data && !Exists(part));
+
+	remove(outFile);
+	code = Fetch("/norange", 4, 3);
+	Check("no range support", code == 200 && ReadTestFile(outFile) == data && !Exists(part) && !Exists(state));
+
+	// Truncated bodies and 503s, retried until it's all there.
+	remove(outFile);
+	faultPercent = 70;
+	code = Fetch("/flaky", 4, 6);
+	Check("truncated bodies", code == 200 && ReadTestFile(outFile) == data);
+	faultPercent = 0;
+
+	// The server goes away after 2MB: the download fails but keeps what it got...
+	remove(outFile);
+	budget = 2000000;
+	code = Fetch("/flaky", 4, 2);
+	Check("keeps the .part", code < 0 && !Exists(outFile) && Exists(part) && Exists(state));
+	// ... and picks up from there once it's back, without fetching it all again.
+	budget = -1;
+	served = 0;
+	code = Fetch("/flaky", 4, 3);
+	Check("resume from the .part", code == 200 && ReadTestFile(outFile) == data && !Exists(part) && !Exists(state) &&
+		served <= TEST_FILE_SIZE - 2000000 + 4);
+
+	// Same size but a new ETag: what's in the .part is from another file, so start over.
+	remove(outFile);
+	budget = 1000000;
+	Fetch("/flaky", 4, 1);
+	budget = -1;
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = ~data[i];
+	etag = "\"v2\"";
+	code = Fetch("/flaky", 4, 3);
+	Check("changed ETag", code == 200 && ReadTestFile(outFile) == data);
+
+	// Shorter than the .part thinks: the probe gets a 416 and it starts over too.
+	remove(outFile);
+	budget = 1000000;
+	Fetch("/flaky", 4, 1);
+	budget = -1;
+	data.resize(500000);
+	WriteSource();
+	code = Fetch("/file", 4, 3);
+	Check("shrunk", code == 200 && ReadTestFile(outFile) == data);
+
+	remove(outFile);
+	code = Fetch("/nothere", 4, 3);
+	Check("404", code == 404 && !Exists(outFile) && !Exists(part) && !Exists(state));
+
+	data.resize(TEST_FILE_SIZE, 'x');
+	WriteSource();
+	remove(outFile);
+	Fetch("/file", 4, 3, true);
+	Check("cancel", !Exists(outFile) && !Exists(part) && !Exists(state));
+
+	data.clear();
+	WriteSource();
+	code = Fetch("/file", 4, 3);
+	Check("empty file", code == 200 && Exists(outFile) && ReadTestFile(outFile).empty());
+
+	remove(srcFile);
+	remove(outFile);
+	// The server never returns from Run, so don't wait for it.
+	_Exit(TestResult());
+}
@@ -0,0 +1,204 @@
+// Compressed responses. The client inflating gzip, zlib and raw deflate bodies as they come in,
+// including raw deflate whose first piece is too short to tell it from zlib, and failing on ones
+// that are cut short. And http::Server compressing text for clients that take it, and sending
+// a file's .gz instead of the file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+
+#include "base/buffer.h"
+#include "base/testutil.h"
+#include "base/timeutil.h"
+#include "data/compression.h"
+#include "net/http_client.h"
+#include "net/http_server.h"
+#include "net/resolve.h"
+#include "net/test_server.h"
+#include "thread/executor.h"
+
+#define RAW_PORT 18567
+#define SERVER_PORT 18568
+
+static const char *textFile = "http_gzip_test.txt";
+static std::string text;
+
+// No header or trailer, which is what some servers send for "deflate".
+static std::string RawDeflate(const std::string &data) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	deflateInit2(&zs, 6, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+	std::string out(deflateBound(&zs, data.size()), '\0');
+	zs.next_in = (Bytef *)data.data();
+	zs.avail_in = (uInt)data.size();
+	zs.next_out = (Bytef *)&out[0];
+	zs.avail_out = (uInt)out.size();
+	deflate(&zs, Z_FINISH);
+	out.resize(zs.total_out);
+	deflateEnd(&zs);
+	return out;
+}
+
+static std::string Header(const char *encoding, int64_t length) {
+	char header[256];
+	if (length >= 0) {
+		snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Encoding: %s\r\nContent-Length: %lld\r\n\r\n", encoding, (long long)length);
+	} else {
+		snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-Encoding: %s\r\nConnection: close\r\n\r\n", encoding);
+	}
+	return header;
+}
+
+static bool HandleRaw(int fd, const std::string &request, int previous) {
+	size_t start = request.find(' ') + 1;
+	std::string path = request.substr(start, request.find(' ', start) - start);
+	std::string body;
+	if (path == "/gzip") {
+		gzip_string(text, &body);
+		TestServer::Send(fd, Header("gzip", body.size()) + body);
+	} else if (path == "/gzipchunked") {
+		gzip_string(text, &body);
+		std::string response = "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n";
+		for (size_t i = 0; i < body.size(); i += 50) {
+			std::string chunk = body.substr(i, 50);
+			char size[16];
+			snprintf(size, sizeof(size), "%x\r\n", (int)chunk.size());
+			response += size + chunk + "\r\n";
+		}
+		TestServer::Send(fd, response + "0\r\n\r\n");
+	} else if (path == "/zlib") {
+		compress_string(text, &body);
+		TestServer::Send(fd, Header("deflate", body.size()) + body);
+	} else if (path == "/raw") {
+		body = RawDeflate(text);
+		TestServer::Send(fd, Header("deflate", body.size()) + body);
+	} else if (path == "/raw1") {
+		// Nothing comes out of the first byte either way, it's the second that gives it away.
+		body = RawDeflate(text);
+		std::vector<std::string> pieces;
+		pieces.push_back(Header("deflate", body.size()) + body.substr(0, 1));
+		pieces.push_back(body.substr(1));
+		TestServer::SendPieces(fd, pieces);
+	} else if (path == "/truncated") {
+		gzip_string(text, &body);
+		TestServer::Send(fd, Header("gzip", -1) + body.substr(0, body.size() - 20));
+		return false;
+	} else {
+		body = "this isn't compressed at all";
+		TestServer::Send(fd, Header("gzip", body.size()) + body);
+	}
+	return true;
+}
+
+static void HandleText(const http::Request &request) {
+	request.WriteHttpResponse(200, text, "application/json");
+}
+
+static void HandleFile(const http::Request &request) {
+	request.WriteFile(textFile, "text/plain");
+}
+
+static void RunServer(http::Server *server) {
+	server->Run(SERVER_PORT);
+}
+
+class HeaderSink : public http::ResponseSink {
+public:
+	bool Begin(int code, const std::vector<std::string> &responseHeaders) override {
+		for (size_t i = 0; i < responseHeaders.size(); i++) {
+			if (!strncmp(responseHeaders[i].c_str(), "Content-Encoding: ", 18))
+				encoding = responseHeaders[i].substr(18);
+		}
+		return true;
+	}
+	bool Write(Buffer *data) override {
+		std::string piece;
+		data->TakeAll(&piece);
+		body += piece;
+		return true;
+	}
+	std::string encoding;
+	std::string body;
+};
+
+static int Get(int port, const char *resource, HeaderSink *sink) {
+	http::Client client;
+	if (!client.Resolve("127.0.0.1", port) || !client.Connect())
+		return -1;
+	return client.GET(resource, sink);
+}
+
+// With only the Accept-Encoding given, rather than the client's own.
+static int GetAccepting(const char *resource, const char *acceptEncoding, HeaderSink *sink) {
+	http::Client client;
+	if (!client.Resolve("127.0.0.1", SERVER_PORT) || !client.Connect())
+		return -1;
+	char headers[128];
+	snprintf(headers, sizeof(headers), "Accept-Encoding: %s\r\n", acceptEncoding);
+	if (client.SendRequest("GET", resource, headers) < 0)
+		return -1;
+	Buffer readbuf;
+	std::vector<std::string> responseHeaders;
+	int code = client.ReadResponseHeaders(&readbuf, responseHeaders);
+	if (code < 0 || !sink->Begin(code, responseHeaders))
+		return code;
+	if (client.ReadResponseEntity(&readbuf, responseHeaders, sink) < 0)
+		return -1;
+	return code;
+}
+
+int main() {
+	net::AutoInit netInit;
+	for (int i = 0; i < 20000; i++) {
+		char line[64];
+		snprintf(line, sizeof(line), "{\"id\": %d, \"name\": \"item%d\"},\n", i, i * 7 % 1000);
+		text += line;
+	}
+
+	TestServer rawServer(RAW_PORT, &HandleRaw);
+	threading::ThreadPoolExecutor executor(4, 64);
+	http::Server server(&executor);
+	server.RegisterHandler("/text", &HandleText);
+	server.RegisterHandler("/file", &HandleFile);
+	std::thread serverThread(std::bind(&RunServer, &server));
+	serverThread.detach();
+	sleep_ms(200);
+
+	const char *inflated[] = { "/gzip", "/gzipchunked", "/zlib", "/raw", "/raw1" };
+	for (size_t i = 0; i < sizeof(inflated) / sizeof(inflated[0]); i++) {
+		HeaderSink sink;
+		Check(inflated[i], Get(RAW_PORT, inflated[i], &sink) == 200 && sink.body == text);
+	}
+	HeaderSink truncated, corrupt;
+	Check("truncated", Get(RAW_PORT, "/truncated", &truncated) < 0);
+	Check("corrupt", Get(RAW_PORT, "/corrupt", &corrupt) < 0);
+
+	HeaderSink gzipped, deflated, plain;
+	Check("server gzip", Get(SERVER_PORT, "/text", &gzipped) == 200 && gzipped.encoding == "gzip" && gzipped.body == text);
+	Check("server deflate", GetAccepting("/text", "deflate", &deflated) == 200 && deflated.encoding == "deflate" &&
+		deflated.body == text);
+	Check("server identity", GetAccepting("/text", "identity", &plain) == 200 && plain.encoding.empty() && plain.body == text);
+
+	// The .gz is sent instead of the file when it's there, and the whole file when it isn't.
+	FILE *file = fopen(textFile, "wb");
+	fwrite(text.data(), 1, text.size(), file);
+	fclose(file);
+	HeaderSink original;
+	Check("no .gz", Get(SERVER_PORT, "/file", &original) == 200 && original.encoding.empty() && original.body == text);
+	std::string compressed;
+	gzip_string(text, &compressed);
+	std::string gzFile = std::string(textFile) + ".gz";
+	file = fopen(gzFile.c_str(), "wb");
+	fwrite(compressed.data(), 1, compressed.size(), file);
+	fclose(file);
+	HeaderSink precompressed;
+	Check(".gz", Get(SERVER_PORT, "/file", &precompressed) == 200 && precompressed.encoding == "gzip" && precompressed.body == text);
+	remove(textFile);
+	remove(gzFile.c_str());
+
+	// The servers never return, so don't wait for them.
+	_Exit(TestResult());
+}
@@ -1,7 +1,11 @@
 #include "net/http_headers.h"
 
+#include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
 
 #include "base/logging.h"
 #include "base/stringutil.h"
@@ -11,7 +15,8 @@ namespace http {
 
 RequestHeader::RequestHeader()
     : status(200), referer(0), user_agent(0),
-      resource(0), params(0), content_length(-1), first_header_(true) {
+      resource(0), params(0), content_length(-1),
+      range_start(-1), range_end(-1), accept_gzip(false), accept_deflate(false), keep_alive(false), ok(false), first_header_(true), line_count_(0) {
 }
 
 RequestHeader::~RequestHeader() {
@@ -87,6 +92,7 @@ int RequestHeader::ParseHttpHeader(const char *buffer) {
       type = FULL;
     else
       type = SIMPLE;
+    keep_alive = strstr(buffer, "HTTP/1.1") != 0;
     return 0;
   }
 
@@ -117,16 +123,78 @@ int RequestHeader::ParseHttpHeader(const char *buffer) {
     referer = new char[value_len + 1];
     memcpy(referer, buffer, value_len + 1);
   } else if (!strcmp(key, "CONTENT-LENGTH")) {
-    content_length = atoi(buffer);
+    // Clamped rather than wrapped, so that a huge one can't pass for a small or negative one.
+    long long length = strtoll(buffer, 0, 10);
+    content_length = (int)std::min(length, (long long)INT_MAX);
     ILOG("Content-Length: %i", (int)content_length);
+  } else if (!strcmp(key, "RANGE")) {
+    // Anything but a single "start-end" or "start-" range, we ignore and send the whole thing.
+    long long start, end;
+    char dash;
+    if (!strchr(buffer, ',') && !strncmp(buffer, "bytes=", 6) && buffer[6] != '-') {
+      int fields = sscanf(buffer + 6, "%lld-%lld", &start, &end);
+      if (fields == 2 && start <= end) {
+        range_start = start;
+        range_end = end;
+      } else if (fields == 1 && sscanf(buffer + 6, "%lld%c", &start, &dash) == 2 && dash == '-') {
+        range_start = start;
+      }
+    }
+  } else if (!strcmp(key, "ACCEPT-ENCODING")) {
+    // Like "gzip, deflate" or "gzip;q=1.0, identity; q=0.5, *;q=0".
+    std::vector<std::string> codings;
+    SplitString(std::string(buffer, value_len), ',', codings);
+    for (size_t i = 0; i < codings.size(); i++) {
+      std::string coding = StripSpaces(codings[i]);
+      StringUpper(&coding[0], (int)coding.size());
+      size_t semicolon = coding.find(';');
+      std::string name = StripSpaces(coding.substr(0, semicolon));
+      if (semicolon != std::string::npos) {
+        size_t q = coding.find("Q=", semicolon);
+        if (q != std::string::npos && atof(coding.c_str() + q + 2) <= 0.0)
+          continue;
+      }
+      if (name == "GZIP" || name == "X-GZIP") {
+        accept_gzip = true;
+      } else if (name == "DEFLATE") {
+        accept_deflate = true;
+      }
+    }
+  } else if (!strcmp(key, "CONNECTION")) {
+    // Can be a list, like "keep-alive, Upgrade".
+    std::string value(buffer, value_len);
+    StringUpper(&value[0], value_len);
+    if (value.find("CLOSE") != std::string::npos) {
+      keep_alive = false;
+    } else if (value.find("KEEP-ALIVE") != std::string::npos) {
+      keep_alive = true;
+    }
   }
 
   delete [] key;
   return 0;
 }
 
+bool RequestHeader::ParseHeaderLine(char *line) {
+  // Only whitespace comes off the end: values like "bytes=100-" or "*/*" end in punctuation.
+  size_t len = strlen(line);
+  while (len > 0 && isspace((unsigned char)line[len - 1]))
+    line[--len] = '\0';
+  if (line[0] == '\0') {
+    ok = line_count_ > 1;
+    return true;
+  }
+  ParseHttpHeader(line);
+  line_count_++;
+  if (type == SIMPLE) {
+    // Done!
+    ok = line_count_ > 1;
+    return true;
+  }
+  return false;
+}
+
 void RequestHeader::ParseHeaders(int fd) {
-  int line_count = 0;
   // Loop through request headers.
   while (true) {
     if (!fd_util::WaitUntilReady(fd, 5.0)) {  // Wait max 5 secs.
@@ -136,19 +204,28 @@ void RequestHeader::ParseHeaders(int fd) {
     }
     char buffer[1024];
     fd_util::ReadLine(fd, buffer, 1023);
-    StringTrimEndNonAlphaNum(buffer);
-    if (buffer[0] == '\0')
-      break;
-    ParseHttpHeader(buffer);
-    line_count++;
-    if (type == SIMPLE) {
-      // Done!
-      ILOG("Simple: Done parsing http request.");
+    if (ParseHeaderLine(buffer)) {
+      if (type == SIMPLE)
+        ILOG("Simple: Done parsing http request.");
       break;
     }
   }
+  // Only here: the event loop parses with ParseHeaders(Buffer *), and shouldn't log every request.
   ILOG("finished parsing request.");
-  ok = line_count > 1;
+}
+
+bool RequestHeader::ParseHeaders(Buffer *buffer) {
+  std::string line;
+  while (buffer->TakeLineCRLF(&line) >= 0) {
+    // Same limit as the blocking version.
+    char temp[1024];
+    size_t len = std::min(line.size(), sizeof(temp) - 1);
+    memcpy(temp, line.data(), len);
+    temp[len] = '\0';
+    if (ParseHeaderLine(temp))
+      return true;
+  }
+  return false;
 }
 
 }  // namespace http
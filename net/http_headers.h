@@ -17,6 +17,13 @@ class RequestHeader {
   char *resource;
   char *params;
   int content_length;
+  // From a "Range: bytes=start-end" header, end inclusive. range_start is -1 if there was none,
+  // range_end is -1 if open ended. Other forms, like several ranges, are left out.
+  int64_t range_start;
+  int64_t range_end;
+  // From Accept-Encoding, leaving out the ones with q=0.
+  bool accept_gzip;
+  bool accept_deflate;
   enum RequestType {
     SIMPLE, FULL,
   };
@@ -28,12 +35,23 @@ class RequestHeader {
     UNSUPPORTED,
   };
   Method method;
+  // Whether the client wants the connection kept open after the response: HTTP/1.1 unless it
+  // says "Connection: close", HTTP/1.0 only if it says "Connection: keep-alive".
+  bool keep_alive;
   bool ok;
+  // Blocking, reads the socket a line at a time.
   void ParseHeaders(int fd);
+  // For non-blocking sockets: parses and takes out the complete lines in buffer, leaving the
+  // rest (like the start of the body) in there. Returns true once the headers are complete,
+  // with ok set, and false if it needs more data.
+  bool ParseHeaders(Buffer *buffer);
   bool GetParamValue(const char *param_name, std::string *value) const;
  private:
   int ParseHttpHeader(const char *buffer);
+  // Shared between the two ParseHeaders. Returns true when done.
+  bool ParseHeaderLine(char *line);
   bool first_header_;
+  int line_count_;
   
   DISALLOW_COPY_AND_ASSIGN(RequestHeader);
 };
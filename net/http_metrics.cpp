@@ -0,0 +1,326 @@
+#include <inttypes.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+
+#include "base/logging.h"
+#include "base/stats.h"
+#include "base/stringutil.h"
+#include "json/json_writer.h"
+#include "net/http_metrics.h"
+#include "profiler/profiler.h"
+
+namespace http {
+
+namespace {
+
+// Prometheus label values are double quoted, with backslash escapes.
+std::string EscapeLabel(const std::string &value) {
+  std::string escaped;
+  for (size_t i = 0; i < value.size(); i++) {
+    switch (value[i]) {
+    case '\\': escaped += "\\\\"; break;
+    case '"': escaped += "\\\""; break;
+    case '\n': escaped += "\\n"; break;
+    default: escaped += value[i]; break;
+    }
+  }
+  return escaped;
+}
+
+void AppendMetric(std::string *out, const char *metric, const char *label, const std::string &name, double value) {
+  *out += StringFromFormat("%s{%s=\"%s\"} %.9g\n", metric, label, EscapeLabel(name).c_str(), value);
+}
+
+#ifdef USE_PROFILER
+struct CategoryTimes {
+  std::string name;
+  double mean;
+  double max;
+};
+
+// Average and worst of the recorded frames. Frames before the history filled up are zero and
+// skipped, so that a fresh instance doesn't report a bogus low average.
+void GetCategoryTimes(std::vector<CategoryTimes> *result) {
+  int length = Profiler_GetHistoryLength();
+  std::vector<float> history(length);
+  int count = Profiler_GetNumCategories();
+  for (int i = 0; i < count; i++) {
+    Profiler_GetHistory(i, &history[0], length);
+    CategoryTimes times;
+    times.name = Profiler_GetCategoryName(i);
+    times.mean = 0.0;
+    times.max = 0.0;
+    int frames = 0;
+    for (int j = 0; j < length; j++) {
+      if (history[j] > 0.0f) {
+        times.mean += history[j];
+        times.max = std::max(times.max, (double)history[j]);
+        frames++;
+      }
+    }
+    if (frames > 0)
+      times.mean /= frames;
+    result->push_back(times);
+  }
+}
+#endif
+
+}  // namespace
+
+void MetricsHandlers::Register(Server *server) {
+  server->RegisterHandler("/metrics", std::bind(&MetricsHandlers::HandleMetrics, this, placeholder::_1));
+  server->RegisterHandler("/profile", std::bind(&MetricsHandlers::HandleProfile, this, placeholder::_1));
+}
+
+void MetricsHandlers::AddExecutor(const char *name, threading::ThreadPoolExecutor *executor) {
+  lock_guard guard(mutex_);
+  executors_.push_back(std::make_pair(std::string(name), executor));
+}
+
+void MetricsHandlers::AddGauge(const char *name, GaugeFunc gauge) {
+  lock_guard guard(mutex_);
+  gauges_.push_back(std::make_pair(std::string(name), gauge));
+}
+
+void MetricsHandlers::HandleMetrics(const Request &request) {
+  std::string format;
+  std::string body;
+  const char *mimeType;
+  if (request.GetParamValue("format", &format) && format == "json") {
+    WriteJson(&body);
+    mimeType = "application/json";
+  } else {
+    WritePrometheus(&body);
+    mimeType = "text/plain; version=0.0.4";
+  }
+  // Gets big with many stats, and compresses very well.
+  request.WriteHttpResponse(200, body, mimeType);
+}
+
+void MetricsHandlers::WritePrometheus(std::string *out) {
+  StatsSnapshot stats;
+  GetStatsSnapshot(&stats);
+  *out += "# TYPE native_stat_total counter\n";
+  for (auto iter = stats.counters.begin(); iter != stats.counters.end(); ++iter) {
+    AppendMetric(out, "native_stat_total", "name", iter->first, (double)iter->second);
+  }
+  if (!stats.gauges.empty()) {
+    *out += "# TYPE native_stat_gauge gauge\n";
+    for (auto iter = stats.gauges.begin(); iter != stats.gauges.end(); ++iter) {
+      AppendMetric(out, "native_stat_gauge", "name", iter->first, (double)iter->second);
+    }
+  }
+  if (!stats.histograms.empty()) {
+    *out += "# TYPE native_stat_histogram summary\n";
+    for (auto iter = stats.histograms.begin(); iter != stats.histograms.end(); ++iter) {
+      const StatHistogramSnapshot &h = iter->second;
+      std::string name = EscapeLabel(iter->first);
+      const char *quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+      const int64_t values[] = { h.p50, h.p90, h.p99, h.p999 };
+      for (int i = 0; i < 4; i++) {
+        *out += StringFromFormat("native_stat_histogram{name=\"%s\",quantile=\"%s\"} %lld\n", name.c_str(), quantiles[i], (long long)values[i]);
+      }
+      *out += StringFromFormat("native_stat_histogram_sum{name=\"%s\"} %lld\n", name.c_str(), (long long)h.sum);
+      *out += StringFromFormat("native_stat_histogram_count{name=\"%s\"} %lld\n", name.c_str(), (long long)h.count);
+    }
+  }
+
+  lock_guard guard(mutex_);
+  if (!executors_.empty()) {
+    std::vector<threading::ThreadPoolExecutor::Stats> executorStats(executors_.size());
+    for (size_t i = 0; i < executors_.size(); i++) {
+      executors_[i].second->GetStats(&executorStats[i]);
+    }
+    // Prometheus wants all the samples of one metric together.
+    static const char *const metrics[] = {
+      "gauge", "native_executor_queue_depth",
+      "gauge", "native_executor_max_queue_depth",
+      "counter", "native_executor_submitted_total",
+      "counter", "native_executor_completed_total",
+      "counter", "native_executor_rejected_total",
+      "counter", "native_executor_caller_runs_total",
+      "counter", "native_executor_queue_seconds_total",
+      "counter", "native_executor_run_seconds_total",
+    };
+    for (size_t m = 0; m < ARRAY_SIZE(metrics) / 2; m++) {
+      const char *metric = metrics[m * 2 + 1];
+      *out += StringFromFormat("# TYPE %s %s\n", metric, metrics[m * 2]);
+      for (size_t i = 0; i < executors_.size(); i++) {
+        const threading::ThreadPoolExecutor::Stats &s = executorStats[i];
+        const double values[] = {
+          (double)s.queueDepth, (double)s.maxQueueDepth, (double)s.submitted, (double)s.completed,
+          (double)s.rejected, (double)s.callerRuns, s.totalQueueTime, s.totalRunTime,
+        };
+        AppendMetric(out, metric, "executor", executors_[i].first, values[m]);
+      }
+    }
+  }
+
+  std::vector<LockStatsEntry> locks;
+  GetLockStats(&locks);
+  if (!locks.empty()) {
+    static const char *const lockMetrics[] = {
+      "native_lock_acquisitions_total",
+      "native_lock_contended_total",
+      "native_lock_wait_seconds_total",
+      "native_lock_hold_seconds_total",
+    };
+    for (size_t m = 0; m < ARRAY_SIZE(lockMetrics); m++) {
+      *out += StringFromFormat("# TYPE %s counter\n", lockMetrics[m]);
+      for (size_t i = 0; i < locks.size(); i++) {
+        const double values[] = { (double)locks[i].acquisitions, (double)locks[i].contended, locks[i].waitTime, locks[i].holdTime };
+        AppendMetric(out, lockMetrics[m], "lock", locks[i].name, values[m]);
+      }
+    }
+  }
+
+  if (!gauges_.empty()) {
+    *out += "# TYPE native_gauge gauge\n";
+    for (size_t i = 0; i < gauges_.size(); i++) {
+      AppendMetric(out, "native_gauge", "name", gauges_[i].first, gauges_[i].second());
+    }
+  }
+
+#ifdef USE_PROFILER
+  std::vector<CategoryTimes> times;
+  GetCategoryTimes(&times);
+  if (!times.empty()) {
+    *out += "# TYPE native_profiler_frame_seconds gauge\n";
+    for (size_t i = 0; i < times.size(); i++) {
+      AppendMetric(out, "native_profiler_frame_seconds", "category", times[i].name, times[i].mean);
+    }
+    *out += "# TYPE native_profiler_frame_max_seconds gauge\n";
+    for (size_t i = 0; i < times.size(); i++) {
+      AppendMetric(out, "native_profiler_frame_max_seconds", "category", times[i].name, times[i].max);
+    }
+  }
+#endif
+}
+
+void MetricsHandlers::WriteJson(std::string *out) {
+  JsonWriter json;
+  json.begin();
+
+  StatsSnapshot stats;
+  GetStatsSnapshot(&stats);
+  json.pushDict("stats");
+  for (auto iter = stats.counters.begin(); iter != stats.counters.end(); ++iter) {
+    json.writeInt64(iter->first.c_str(), iter->second);
+  }
+  json.pop();
+  json.pushDict("statGauges");
+  for (auto iter = stats.gauges.begin(); iter != stats.gauges.end(); ++iter) {
+    json.writeInt64(iter->first.c_str(), iter->second);
+  }
+  json.pop();
+  json.pushDict("histograms");
+  for (auto iter = stats.histograms.begin(); iter != stats.histograms.end(); ++iter) {
+    const StatHistogramSnapshot &h = iter->second;
+    json.pushDict(iter->first.c_str());
+    json.writeInt64("count", h.count);
+    json.writeInt64("sum", h.sum);
+    json.writeInt64("min", h.min);
+    json.writeInt64("max", h.max);
+    json.writeFloat("mean", h.Mean());
+    json.writeInt64("p50", h.p50);
+    json.writeInt64("p90", h.p90);
+    json.writeInt64("p99", h.p99);
+    json.writeInt64("p999", h.p999);
+    json.pop();
+  }
+  json.pop();
+
+  {
+    lock_guard guard(mutex_);
+    json.pushDict("executors");
+    for (size_t i = 0; i < executors_.size(); i++) {
+      threading::ThreadPoolExecutor::Stats s;
+      executors_[i].second->GetStats(&s);
+      json.pushDict(executors_[i].first.c_str());
+      json.writeInt("queueDepth", s.queueDepth);
+      json.writeInt("maxQueueDepth", s.maxQueueDepth);
+      json.writeInt64("submitted", (int64_t)s.submitted);
+      json.writeInt64("completed", (int64_t)s.completed);
+      json.writeInt64("rejected", (int64_t)s.rejected);
+      json.writeInt64("callerRuns", (int64_t)s.callerRuns);
+      json.writeFloat("totalQueueTime", s.totalQueueTime);
+      json.writeFloat("maxQueueTime", s.maxQueueTime);
+      json.writeFloat("totalRunTime", s.totalRunTime);
+      json.writeFloat("maxRunTime", s.maxRunTime);
+      json.pop();
+    }
+    json.pop();
+
+    json.pushDict("gauges");
+    for (size_t i = 0; i < gauges_.size(); i++) {
+      json.writeFloat(gauges_[i].first.c_str(), gauges_[i].second());
+    }
+    json.pop();
+  }
+
+  std::vector<LockStatsEntry> locks;
+  GetLockStats(&locks);
+  json.pushDict("locks");
+  for (size_t i = 0; i < locks.size(); i++) {
+    json.pushDict(locks[i].name);
+    json.writeInt64("acquisitions", locks[i].acquisitions);
+    json.writeInt64("contended", locks[i].contended);
+    json.writeFloat("waitTime", locks[i].waitTime);
+    json.writeFloat("maxWaitTime", locks[i].maxWaitTime);
+    json.writeFloat("holdTime", locks[i].holdTime);
+    json.writeFloat("maxHoldTime", locks[i].maxHoldTime);
+    json.pop();
+  }
+  json.pop();
+
+#ifdef USE_PROFILER
+  std::vector<CategoryTimes> times;
+  GetCategoryTimes(&times);
+  json.pushDict("profiler");
+  for (size_t i = 0; i < times.size(); i++) {
+    json.pushDict(times[i].name.c_str());
+    json.writeFloat("mean", times[i].mean);
+    json.writeFloat("max", times[i].max);
+    json.pop();
+  }
+  json.pop();
+#endif
+
+  json.end();
+  *out = json.str();
+}
+
+void MetricsHandlers::HandleProfile(const Request &request) {
+#ifdef USE_PROFILER
+  JsonWriter json;
+  json.begin();
+  int length = Profiler_GetHistoryLength();
+  std::vector<float> history(length);
+  json.writeInt("historyLength", length);
+  json.pushArray("categories");
+  int count = Profiler_GetNumCategories();
+  for (int i = 0; i < count; i++) {
+    Profiler_GetHistory(i, &history[0], length);
+    json.pushDict();
+    json.writeString("name", Profiler_GetCategoryName(i));
+    // Oldest first.
+    json.pushArray("frames");
+    for (int j = 0; j < length; j++) {
+      json.writeFloat(history[j]);
+    }
+    json.pop();
+    json.pop();
+  }
+  json.pop();
+  json.end();
+
+  request.WriteHttpResponse(200, json.str(), "application/json");
+#else
+  const char *payload = "Profiler not compiled in (USE_PROFILER)\r\n";
+  request.WriteHttpResponseHeader(404, (int)strlen(payload), "text/plain");
+  request.out_buffer()->Append(payload);
+#endif
+}
+
+}  // namespace http
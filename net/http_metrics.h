@@ -0,0 +1,56 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/functional.h"
+#include "base/mutex.h"
+#include "net/http_server.h"
+#include "thread/executor.h"
+
+namespace http {
+
+// Built-in handlers for looking at a running instance without attaching a debugger.
+//
+//   /metrics  Everything in base/stats, lock stats (see base/mutex.h), executor queue stats,
+//             custom gauges and, if the profiler is compiled in, the average and worst frame
+//             time per profiler category.
+//             Prometheus text format by default, JSON with ?format=json.
+//   /profile  The profiler's full per-category frame time history, as JSON.
+//
+// Executor and profiler times are in seconds, histograms in whatever unit they were recorded in.
+// The profiler history is read while the main thread may be writing
+// it, so the newest frame can be slightly off - good enough for a dashboard.
+//
+//   http::MetricsHandlers metrics;
+//   metrics.AddExecutor("io", &ioPool);
+//   metrics.Register(&server);
+class MetricsHandlers {
+ public:
+  MetricsHandlers() {}
+
+  // Adds /metrics and /profile to server. Must be kept alive as long as the server.
+  void Register(Server *server);
+
+  // Can be called at any time, also while serving.
+  void AddExecutor(const char *name, threading::ThreadPoolExecutor *executor);
+  typedef std::function<double()> GaugeFunc;
+  void AddGauge(const char *name, GaugeFunc gauge);
+
+ private:
+  void HandleMetrics(const Request &request);
+  void HandleProfile(const Request &request);
+
+  void WritePrometheus(std::string *out);
+  void WriteJson(std::string *out);
+
+  // Handlers may run on several executor threads at once.
+  recursive_mutex mutex_;
+  std::vector<std::pair<std::string, threading::ThreadPoolExecutor *>> executors_;
+  std::vector<std::pair<std::string, GaugeFunc>> gauges_;
+
+  DISALLOW_COPY_AND_ASSIGN(MetricsHandlers);
+};
+
+}  // namespace http
@@ -12,24 +12,60 @@
 #include <sys/types.h>        /*  socket types              */
 #include <sys/wait.h>         /*  for waitpid()             */
 #include <netinet/in.h>       /*  struct sockaddr_in        */
+#include <netinet/tcp.h>      /*  TCP_NODELAY               */
 #include <arpa/inet.h>        /*  inet (3) funtions         */
 #include <unistd.h>           /*  misc. UNIX functions      */
+#include <errno.h>
+#include <signal.h>
 
+#if defined(__linux__)
+#define HAVE_EPOLL
+#include <sys/epoll.h>
 #endif
 
+#endif
+
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <set>
 
 #include "base/functional.h"
 #include "base/logging.h"
 #include "base/buffer.h"
+#include "base/stats.h"
+#include "data/compression.h"
 #include "file/fd_util.h"
 #include "net/http_server.h"
+#include "thread/thread.h"
 
 namespace http {
 
+// Requests whose headers don't fit in this get dropped.
+#define MAX_HEADER_SIZE (64 * 1024)
+// Per read call on a ready socket.
+#define READ_CHUNK_SIZE 65536
+#define MAX_EVENTS 256
+#define DEFAULT_MAX_BODY_SIZE (16 * 1024 * 1024)
+// Longest a file response may take to send before the client is given up on.
+#define SEND_FILE_TIMEOUT 600.0
+
+static StatGauge openConnections("http.server.connections");
+static StatCounter requestsHandled("http.server.requests");
+
+Request::Request()
+    : fd_(0), event_loop_(false), send_file_(-1), send_offset_(0), send_remaining_(0),
+      keep_alive_allowed_(false), keep_alive_(false) {
+  in_buffer_ = new Buffer;
+  out_buffer_ = new Buffer;
+}
+
 Request::Request(int fd)
-    : fd_(fd) {
+    : fd_(fd), event_loop_(false), send_file_(-1), send_offset_(0), send_remaining_(0),
+      keep_alive_allowed_(false), keep_alive_(false) {
   in_buffer_ = new Buffer;
   out_buffer_ = new Buffer;
   header_.ParseHeaders(fd_);
@@ -47,6 +83,9 @@ Request::Request(int fd)
 
 Request::~Request() {
   Close();
+  if (send_file_ >= 0) {
+    close(send_file_);
+  }
 
   CHECK(in_buffer_->empty());
   delete in_buffer_;
@@ -54,24 +93,143 @@ Request::~Request() {
   delete out_buffer_;
 }
 
-void Request::WriteHttpResponseHeader(int status, int size) const {
+bool Request::GetRange(int64_t *start, int64_t *end) const {
+  if (header_.range_start < 0)
+    return false;
+  *start = header_.range_start;
+  *end = header_.range_end;
+  return true;
+}
+
+void Request::WriteHttpResponseHeader(int status, int64_t size, const char *mimeType, const char *otherHeaders) const {
   Buffer *buffer = out_buffer_;
-  buffer->Printf("HTTP/1.0 %d OK\r\n", status);
+  keep_alive_ = keep_alive_allowed_ && size >= 0;
+  buffer->Printf("HTTP/1.1 %d OK\r\n", status);
   buffer->Append("Server: SuperDuperServer v0.1\r\n");
-  buffer->Append("Content-Type: text/html\r\n");
+  buffer->Printf("Content-Type: %s\r\n", mimeType);
   if (size >= 0) {
-    buffer->Printf("Content-Length: %i\r\n", size);
+    buffer->Printf("Content-Length: %lld\r\n", (long long)size);
   }
+  if (otherHeaders) {
+    buffer->Append(otherHeaders);
+  }
+  buffer->Append(keep_alive_ ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
   buffer->Append("\r\n");
 }
 
+static int OpenForReading(const char *filename) {
+#ifdef _WIN32
+  return _open(filename, _O_RDONLY | _O_BINARY);
+#else
+  return open(filename, O_RDONLY);
+#endif
+}
+
+// Not worth the trouble below this, the headers are bigger.
+#define MIN_COMPRESS_SIZE 256
+// Well past this it gets a lot slower for very little gain.
+#define COMPRESSION_LEVEL 6
+
+static bool IsCompressible(const char *mimeType) {
+  return !strncmp(mimeType, "text/", 5) || strstr(mimeType, "json") || strstr(mimeType, "xml") || strstr(mimeType, "javascript");
+}
+
+void Request::WriteHttpResponse(int status, const std::string &body, const char *mimeType) const {
+  if (!IsCompressible(mimeType)) {
+    WriteHttpResponseHeader(status, body.size(), mimeType);
+    out_buffer_->Append(body);
+    return;
+  }
+  if (body.size() >= MIN_COMPRESS_SIZE && (header_.accept_gzip || header_.accept_deflate)) {
+    std::string compressed;
+    bool gzip = header_.accept_gzip;
+    bool success = gzip ? gzip_string(body, &compressed, COMPRESSION_LEVEL) : compress_string(body, &compressed, COMPRESSION_LEVEL);
+    if (success && compressed.size() < body.size()) {
+      const char *headers = gzip ? "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" : "Content-Encoding: deflate\r\nVary: Accept-Encoding\r\n";
+      WriteHttpResponseHeader(status, compressed.size(), mimeType, headers);
+      out_buffer_->Append(compressed);
+      return;
+    }
+  }
+  WriteHttpResponseHeader(status, body.size(), mimeType, "Vary: Accept-Encoding\r\n");
+  out_buffer_->Append(body);
+}
+
+bool Request::WriteFile(const char *filename, const char *mimeType) const {
+  int file = OpenForReading(filename);
+  if (file < 0) {
+    return false;
+  }
+  int64_t rangeStart, rangeEnd;
+  bool ranged = GetRange(&rangeStart, &rangeEnd);
+  // Ranges are always of the file as it is, so it's only for whole ones.
+  int compressedFile = -1;
+  if (!ranged && header_.accept_gzip) {
+    compressedFile = OpenForReading((std::string(filename) + ".gz").c_str());
+    if (compressedFile >= 0) {
+      close(file);
+      file = compressedFile;
+    }
+  }
+  struct stat st;
+  if (fstat(file, &st) < 0) {
+    close(file);
+    return false;
+  }
+  int64_t size = st.st_size;
+  int64_t start = 0;
+  int64_t length = size;
+  char headers[128];
+  if (compressedFile >= 0) {
+    WriteHttpResponseHeader(200, size, mimeType, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n");
+  } else if (ranged) {
+    if (rangeStart >= size) {
+      snprintf(headers, sizeof(headers), "Content-Range: bytes */%lld\r\n", (long long)size);
+      WriteHttpResponseHeader(416, 0, mimeType, headers);
+      close(file);
+      return true;
+    }
+    if (rangeEnd < 0 || rangeEnd >= size)
+      rangeEnd = size - 1;
+    start = rangeStart;
+    length = rangeEnd - rangeStart + 1;
+    snprintf(headers, sizeof(headers), "Content-Range: bytes %lld-%lld/%lld\r\n", (long long)rangeStart, (long long)rangeEnd, (long long)size);
+    WriteHttpResponseHeader(206, length, mimeType, headers);
+  } else {
+    WriteHttpResponseHeader(200, size, mimeType, "Accept-Ranges: bytes\r\n");
+  }
+  if (event_loop_) {
+    // Server::OnWritable sends it as the socket takes it, without tying up this thread.
+    send_file_ = file;
+    send_offset_ = start;
+    send_remaining_ = length;
+    return true;
+  }
+  WritePartial();
+  int64_t sent = fd_util::SendFile(fd_, file, start, length, SEND_FILE_TIMEOUT);
+  if (sent != length) {
+    ELOG("Only sent %lld of %lld bytes of %s", (long long)sent, (long long)length, filename);
+    // The client would take whatever comes next as more of the body.
+    keep_alive_ = false;
+  }
+  close(file);
+  return true;
+}
+
 void Request::WritePartial() const {
   CHECK(fd_);
+  if (event_loop_)
+    return;
   out_buffer_->Flush(fd_);
 }
 
 void Request::Write() {
   CHECK(fd_);
+  if (event_loop_) {
+    // The loop closes it once everything is out.
+    keep_alive_ = false;
+    return;
+  }
   WritePartial();
   Close();
 }
@@ -84,44 +242,100 @@ void Request::Close() {
 }
 
 Server::Server(threading::Executor *executor) 
-  : port_(0), executor_(executor) {
+  : port_(0), executor_(executor), numEventLoops_(1), idleTimeout_(60.0), keepAliveTimeout_(5.0),
+    maxRequestsPerConnection_(1000), maxBodySize_(DEFAULT_MAX_BODY_SIZE) {
   RegisterHandler("/", std::bind(&Server::HandleListing, this, placeholder::_1));
 }
 
+void Server::SetEventLoops(int count) {
+  numEventLoops_ = std::max(1, count);
+}
+
+void Server::SetIdleTimeout(double seconds) {
+  idleTimeout_ = seconds;
+}
+
+void Server::SetKeepAliveTimeout(double seconds) {
+  keepAliveTimeout_ = seconds;
+}
+
+void Server::SetMaxRequestsPerConnection(int count) {
+  maxRequestsPerConnection_ = std::max(1, count);
+}
+
+void Server::SetMaxBodySize(int bytes) {
+  maxBodySize_ = std::max(0, bytes);
+}
+
 void Server::RegisterHandler(const char *url_path, UrlHandlerFunc handler) {
   handlers_[std::string(url_path)] = handler;
 }
 
-bool Server::Run(int port) {
-  ILOG("HTTP server started on port %i", port);
-  port_ = port;
-
+int Server::OpenListener(bool reusePort) {
   int listener = socket(AF_INET, SOCK_STREAM, 0);
   CHECK_GE(listener, 0);
+#ifndef _WIN32
+  // Otherwise anything we fork keeps the port open, and with SO_REUSEPORT, gets its share of
+  // the connections too.
+  fcntl(listener, F_SETFD, FD_CLOEXEC);
+#endif
 
   struct sockaddr_in server_addr;
   memset(&server_addr, 0, sizeof(server_addr));
   server_addr.sin_family = AF_INET;
   server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-  server_addr.sin_port = htons(port);
+  server_addr.sin_port = htons(port_);
 
   int opt = 1;
   // Enable re-binding to avoid the pain when restarting the server quickly.
   setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char *)&opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+  if (reusePort && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, (const char *)&opt, sizeof(opt)) < 0) {
+    close(listener);
+    return -1;
+  }
+#else
+  if (reusePort) {
+    close(listener);
+    return -1;
+  }
+#endif
 
   if (bind(listener, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-    ELOG("Failed to bind to port %i. Bailing.", port);
-    return false;
+    ELOG("Failed to bind to port %i. Bailing.", port_);
+    close(listener);
+    return -1;
   }
 
   // 1024 is the max number of queued requests.
   CHECK_GE(listen(listener, 1024), 0);
+  return listener;
+}
+
+bool Server::Run(int port) {
+  ILOG("HTTP server started on port %i", port);
+  port_ = port;
+#ifndef _WIN32
+  // A client resetting the connection mid-response would otherwise kill the whole process, on
+  // the next writev or sendfile. We get EPIPE instead.
+  signal(SIGPIPE, SIG_IGN);
+#endif
+
+#ifdef HAVE_EPOLL
+  return RunEventLoops();
+#else
+  int listener = OpenListener(false);
+  if (listener < 0)
+    return false;
   while (true) {
     sockaddr client_addr;
     socklen_t client_addr_size = sizeof(client_addr);
     int conn_fd = accept(listener, &client_addr, &client_addr_size);
     if (conn_fd >= 0) {
-      executor_->Run(std::bind(&Server::HandleConnection, this, conn_fd));
+      if (!executor_->Run(std::bind(&Server::HandleConnection, this, conn_fd))) {
+        WLOG("Too busy, dropping a connection.");
+        close(conn_fd);
+      }
     } else {
 			FLOG("socket accept failed: %i", conn_fd);
     }
@@ -129,6 +343,7 @@ bool Server::Run(int port) {
 
   // We'll never get here. Ever.
   return true;
+#endif
 }
 
 void Server::HandleConnection(int conn_fd) {
@@ -137,10 +352,344 @@ void Server::HandleConnection(int conn_fd) {
     WLOG("Bad request, ignoring.");
     return;
   }
-  HandleRequestDefault(request);
+  requestsHandled.Add();
+  HandleRequest(request);
   request.WritePartial();
 }
 
+#ifdef HAVE_EPOLL
+
+// A connection belongs to one event loop, and is only touched by that loop's thread - except
+// while a handler runs on it, during which it's not armed in epoll at all (EPOLLONESHOT), so
+// the loop leaves it alone.
+struct Server::Connection {
+  enum State {
+    READING,   // Waiting for the rest of the headers or body.
+    HANDLING,  // Handler queued or running on the executor.
+    WRITING,   // Sending out the response.
+    CLOSED,    // The handler closed the socket itself, waiting to be swept up.
+  };
+
+  Connection(EventLoop *l, int f)
+      : loop(l), fd(f), request(0), state(READING), headersDone(false), requests(0), lastActive(real_time_now()) {
+    NextRequest();
+  }
+  ~Connection() {
+    DeleteRequest();
+  }
+
+  // Starts over for the next request on the same socket. Anything pipelined after the last
+  // one is still in input.
+  void NextRequest() {
+    if (request) {
+      // Don't close the socket with it.
+      request->fd_ = 0;
+      DeleteRequest();
+    }
+    request = new Request();
+    request->fd_ = fd;
+    request->event_loop_ = true;
+    headersDone = false;
+  }
+
+  void DeleteRequest() {
+    // Whatever the handler didn't read, or we didn't get to write.
+    request->in_buffer_->clear();
+    request->out_buffer_->clear();
+    delete request;
+  }
+
+  EventLoop *loop;
+  // A copy that the handler can't close, so arming doesn't need to look inside the request.
+  const int fd;
+  Request *request;
+  std::atomic<int> state;
+  // What we've read off the socket but not yet handed to a request. With pipelining, this can
+  // hold several requests.
+  Buffer input;
+  bool headersDone;
+  // Requests started on this connection so far.
+  int requests;
+  // Written by whoever owns the connection at the time, see above.
+  std::atomic<double> lastActive;
+};
+
+struct Server::EventLoop {
+  EventLoop() : epollFd(-1), listener(-1), thread(0) {}
+  int epollFd;
+  int listener;
+  std::thread *thread;
+  // Only for finding idle ones. Only touched by the loop's own thread.
+  std::set<Connection *> connections;
+};
+
+bool Server::RunEventLoops() {
+  // With SO_REUSEPORT, each loop gets its own listener and the kernel spreads connections
+  // over them. Without it, there's just the one loop.
+  int count = numEventLoops_;
+  for (int i = 0; i < count; i++) {
+    int listener = OpenListener(count > 1);
+    if (listener < 0 && i == 0 && count > 1) {
+      WLOG("SO_REUSEPORT not available, using a single event loop");
+      count = 1;
+      listener = OpenListener(false);
+    }
+    if (listener < 0) {
+      break;
+    }
+    fd_util::SetNonBlocking(listener, true);
+    EventLoop *loop = new EventLoop();
+    loop->listener = listener;
+    loop->epollFd = epoll_create(1024);
+    // The listener is level triggered and always armed, data.ptr stays null for it.
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0;
+    epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, listener, &ev);
+    loops_.push_back(loop);
+  }
+  if (loops_.empty()) {
+    return false;
+  }
+
+  for (size_t i = 1; i < loops_.size(); i++) {
+    loops_[i]->thread = new std::thread(std::bind(&Server::RunEventLoop, this, loops_[i]));
+  }
+  RunEventLoop(loops_[0]);
+  // Never gets here.
+  return true;
+}
+
+void Server::RunEventLoop(EventLoop *loop) {
+  epoll_event events[MAX_EVENTS];
+  double lastSweep = real_time_now();
+  while (true) {
+    int count = epoll_wait(loop->epollFd, events, MAX_EVENTS, 1000);
+    if (count < 0 && errno != EINTR) {
+      FLOG("epoll_wait failed: %i", errno);
+    }
+    for (int i = 0; i < count; i++) {
+      Connection *conn = (Connection *)events[i].data.ptr;
+      if (!conn) {
+        OnAccept(loop);
+      } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+        CloseConnection(conn);
+      } else if (conn->state == Connection::WRITING) {
+        OnWritable(conn);
+      } else {
+        OnReadable(conn);
+      }
+    }
+
+    double now = real_time_now();
+    if (now - lastSweep >= 1.0) {
+      CloseIdleConnections(loop);
+      lastSweep = now;
+    }
+  }
+}
+
+void Server::OnAccept(EventLoop *loop) {
+  // Take all that are waiting, so a burst doesn't need a round trip through epoll each.
+  while (true) {
+    sockaddr client_addr;
+    socklen_t client_addr_size = sizeof(client_addr);
+    int conn_fd = accept4(loop->listener, &client_addr, &client_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn_fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        ELOG("socket accept failed: %i", errno);
+      }
+      return;
+    }
+    // Responses go out whole, so there's nothing for Nagle to coalesce - it would only hold
+    // back the response to the next pipelined request until the client ACKs the previous one.
+    int opt = 1;
+    setsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&opt, sizeof(opt));
+    Connection *conn = new Connection(loop, conn_fd);
+    loop->connections.insert(conn);
+    openConnections.Add(1);
+
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, conn_fd, &ev);
+  }
+}
+
+void Server::Arm(Connection *conn, bool write) {
+  epoll_event ev;
+  ev.events = (write ? EPOLLOUT : EPOLLIN | EPOLLRDHUP) | EPOLLONESHOT;
+  ev.data.ptr = conn;
+  epoll_ctl(conn->loop->epollFd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+void Server::OnReadable(Connection *conn) {
+  // Enough for the headers, or for the body plus the headers of a request pipelined after it.
+  // Anything beyond that stays in the socket until this request is done, and epoll reports
+  // it again then.
+  const RequestHeader &header = conn->request->header_;
+  size_t limit = MAX_HEADER_SIZE;
+  if (conn->headersDone && header.content_length > 0)
+    limit += header.content_length;
+  bool peerClosed = false;
+  while (conn->input.size() <= limit) {
+    int retval = conn->input.ReadSome(conn->fd, READ_CHUNK_SIZE);
+    if (retval > 0) {
+      conn->lastActive = real_time_now();
+      continue;
+    }
+    if (retval == 0) {
+      peerClosed = true;
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      peerClosed = true;
+    }
+    break;
+  }
+  ProcessInput(conn, peerClosed);
+}
+
+void Server::ProcessInput(Connection *conn, bool peerClosed) {
+  Request *request = conn->request;
+  Buffer *in = &conn->input;
+  RequestHeader &header = request->header_;
+  if (!conn->headersDone) {
+    if (header.ParseHeaders(in)) {
+      conn->headersDone = true;
+      if (!header.ok) {
+        WLOG("Bad request, ignoring.");
+        CloseConnection(conn);
+        return;
+      }
+      if (header.content_length > maxBodySize_) {
+        WLOG("Request body of %d bytes too big, refusing.", header.content_length);
+        // The body would be next on the connection, so it can't be used for anything else.
+        request->keep_alive_allowed_ = false;
+        request->WriteHttpResponse(413, "<html><body>413 request entity too large</body></html>\r\n");
+        conn->state = Connection::WRITING;
+        OnWritable(conn);
+        return;
+      }
+    } else if (in->size() > MAX_HEADER_SIZE) {
+      WLOG("Request headers too big, dropping.");
+      CloseConnection(conn);
+      return;
+    }
+  }
+
+  size_t bodyLength = header.content_length > 0 ? header.content_length : 0;
+  if (conn->headersDone && in->size() >= bodyLength) {
+    // The handler gets exactly its own body, whatever follows is the next request.
+    in->Take(bodyLength, request->in_buffer_);
+    conn->requests++;
+    request->keep_alive_allowed_ = header.keep_alive && conn->requests < maxRequestsPerConnection_;
+    // The rest is up to the handler. Half-closed clients still get their response.
+    conn->state = Connection::HANDLING;
+    // Waiting for room would hold up every connection on this loop.
+    if (!executor_->TryRun(std::bind(&Server::HandleEventRequest, this, conn))) {
+      WLOG("Too busy, refusing a request.");
+      request->in_buffer_->clear();
+      request->keep_alive_allowed_ = false;
+      request->WriteHttpResponse(503, "<html><body>503 service unavailable</body></html>\r\n");
+      conn->state = Connection::WRITING;
+      OnWritable(conn);
+    }
+  } else if (peerClosed) {
+    CloseConnection(conn);
+  } else {
+    Arm(conn, false);
+  }
+}
+
+// On an executor thread.
+void Server::HandleEventRequest(Connection *conn) {
+  requestsHandled.Add();
+  HandleRequest(*conn->request);
+  conn->lastActive = real_time_now();
+  if (!conn->request->fd_) {
+    // The handler called Request::Close(), which also took it out of epoll. Only the loop may
+    // free it.
+    conn->state = Connection::CLOSED;
+    return;
+  }
+  conn->state = Connection::WRITING;
+  // The loop takes it from here. The socket is usually writable right away.
+  Arm(conn, true);
+}
+
+void Server::OnWritable(Connection *conn) {
+  Request *request = conn->request;
+  Buffer *out = request->out_buffer_;
+  while (!out->empty()) {
+    ssize_t written = out->WriteSome(conn->fd);
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        Arm(conn, true);
+        return;
+      }
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    conn->lastActive = real_time_now();
+  }
+  // Then the file, if WriteFile left one. A client that stops taking it gets swept up by
+  // CloseIdleConnections like any other.
+  while (out->empty() && request->send_remaining_ > 0) {
+    errno = 0;
+    int64_t sent = fd_util::SendFile(conn->fd, request->send_file_, request->send_offset_, request->send_remaining_, 0.0);
+    if (sent > 0) {
+      request->send_offset_ += sent;
+      request->send_remaining_ -= sent;
+      conn->lastActive = real_time_now();
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      Arm(conn, true);
+      return;
+    }
+    // An error, or the file got shorter.
+    ELOG("Failed to send a file, %lld bytes short", (long long)request->send_remaining_);
+    break;
+  }
+  if (!out->empty() || request->send_remaining_ > 0 || !request->keep_alive_) {
+    CloseConnection(conn);
+    return;
+  }
+
+  // Wait for the next one, unless it's already here.
+  conn->NextRequest();
+  conn->state = Connection::READING;
+  ProcessInput(conn, false);
+}
+
+void Server::CloseConnection(Connection *conn) {
+  conn->loop->connections.erase(conn);
+  // Closing takes it out of epoll too.
+  conn->request->Close();
+  openConnections.Add(-1);
+  delete conn;
+}
+
+void Server::CloseIdleConnections(EventLoop *loop) {
+  double now = real_time_now();
+  std::vector<Connection *> idle;
+  for (auto iter = loop->connections.begin(); iter != loop->connections.end(); ++iter) {
+    Connection *conn = *iter;
+    // Handlers can take as long as they like. Once they're done, the clock starts again.
+    int state = conn->state;
+    bool waitingForNext = state == Connection::READING && conn->requests > 0 && !conn->headersDone && conn->input.empty();
+    double timeout = waitingForNext ? keepAliveTimeout_ : idleTimeout_;
+    if (state == Connection::CLOSED || (state != Connection::HANDLING && now - conn->lastActive > timeout)) {
+      idle.push_back(conn);
+    }
+  }
+  for (size_t i = 0; i < idle.size(); i++) {
+    CloseConnection(idle[i]);
+  }
+}
+
+#endif  // HAVE_EPOLL
+
 void Server::HandleRequest(const Request &request) {
   HandleRequestDefault(request);
 }
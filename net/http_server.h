@@ -2,6 +2,7 @@
 #define _HTTP_SERVER_H
 
 #include <map>
+#include <vector>
 
 #include "base/functional.h"
 #include "base/buffer.h"
@@ -12,6 +13,7 @@ namespace http {
 
 class Request {
  public:
+  // Reads and parses the request from fd, blocking.
   Request(int fd);
   ~Request();
 
@@ -29,27 +31,87 @@ class Request {
   // TODO: Remove, in favor of PartialWrite and friends.
   int fd() const { return fd_; }
 
+  // Sends what's in out_buffer() so far. Under an event loop, that's left to the loop, which
+  // sends it all once the handler returns.
   void WritePartial() const;
+  // Sends the response and closes the connection.
   void Write();
   void Close();
 
   bool IsOK() const { return fd_ > 0; }
 
-  // If size is negative, no Content-Length: line is written.
-  void WriteHttpResponseHeader(int status, int size = -1) const;
+  // The byte range the client asked for, end inclusive and -1 if open ended. False if it
+  // didn't ask for one, or for one we don't handle, in which case the whole thing is fine.
+  bool GetRange(int64_t *start, int64_t *end) const;
+
+  // If size is negative, no Content-Length: line is written, and the connection gets closed
+  // after the response since that's the only way to tell where it ends. Otherwise it's kept
+  // open for more requests if the client asked for that. otherHeaders, if set, must be
+  // complete lines, each ending in \r\n.
+  void WriteHttpResponseHeader(int status, int64_t size = -1, const char *mimeType = "text/html", const char *otherHeaders = nullptr) const;
+
+  // The whole response, header included. Text, like HTML, JSON or XML, gets compressed if the
+  // client takes gzip or deflate and it makes it any smaller.
+  void WriteHttpResponse(int status, const std::string &body, const char *mimeType = "text/html") const;
+
+  // Responds with the file, header included, or just the part of it asked for with a Range
+  // header. The contents go straight from the file to the socket where the OS allows it.
+  // If the client takes gzip and there's a filename.gz next to it, that's sent instead.
+  // Returns false, without writing anything, if the file can't be opened. Under an event loop
+  // the file goes out after out_buffer(), as the socket takes it, so write nothing after this.
+  bool WriteFile(const char *filename, const char *mimeType) const;
 
  private:
+  friend class Server;
+  // For the event loop, which feeds in the request as it arrives.
+  Request();
+
   Buffer *in_buffer_;
   Buffer *out_buffer_;
   RequestHeader header_;
   int fd_;
+  // Set when an event loop owns the socket, which then does all the writing.
+  bool event_loop_;
+  // What WriteFile left for the event loop to send, after out_buffer_. -1 if nothing.
+  mutable int send_file_;
+  mutable int64_t send_offset_;
+  mutable int64_t send_remaining_;
+  // Set by the server if the connection may serve more requests after this one.
+  bool keep_alive_allowed_;
+  // Whether the response said so. Handlers that don't write a header get the connection closed.
+  mutable bool keep_alive_;
 };
 
 // Register handlers on this class to serve stuff.
+// Handlers run on the executor, so pass a threading::ThreadPoolExecutor to serve several at
+// once. Requests it has no room for get a 503.
+//
+// Where epoll is available (Linux, Android), sockets are non-blocking and driven by event
+// loops: requests are read and parsed as they trickle in, and responses written out as the
+// socket takes them, so only handlers ever occupy an executor thread and idle or slow
+// connections cost nothing but their buffers. Connections are kept alive between requests
+// (HTTP/1.1 persistent connections), and pipelined requests are answered in order, one at a
+// time. Elsewhere, each connection is read, handled and written in one blocking go on the
+// executor, and closed after one request.
 class Server {
  public:
   Server(threading::Executor *executor);
 
+  // Event loop threads, each with its own listening socket on the same port (SO_REUSEPORT),
+  // so the kernel spreads connections over them. One is plenty unless you're pushing a lot of
+  // bytes. Call before Run.
+  void SetEventLoops(int count);
+  // Connections that neither send nor take anything for this long get closed. Default 60.
+  void SetIdleTimeout(double seconds);
+  // Kept-alive connections waiting for their next request get closed after this. Default 5.
+  void SetKeepAliveTimeout(double seconds);
+  // After this many requests, a connection gets closed even if the client wants to keep it
+  // open, so no client holds on to one forever. Default 1000.
+  void SetMaxRequestsPerConnection(int count);
+  // Requests with a bigger body are answered with 413 without reading it, and the connection
+  // closed. Default 16 MB.
+  void SetMaxBodySize(int bytes);
+
   typedef std::function<void(const Request &)> UrlHandlerFunc;
   typedef std::map<std::string, UrlHandlerFunc> UrlHandlerMap;
 
@@ -66,8 +128,23 @@ class Server {
   virtual void HandleRequest(const Request &request);
 
  private:
+  struct Connection;
+  struct EventLoop;
+
   void HandleConnection(int conn_fd);
 
+  bool RunEventLoops();
+  int OpenListener(bool reusePort);
+  void RunEventLoop(EventLoop *loop);
+  void OnAccept(EventLoop *loop);
+  void OnReadable(Connection *conn);
+  void ProcessInput(Connection *conn, bool peerClosed);
+  void OnWritable(Connection *conn);
+  void HandleEventRequest(Connection *conn);
+  void Arm(Connection *conn, bool write);
+  void CloseConnection(Connection *conn);
+  void CloseIdleConnections(EventLoop *loop);
+
   void GetRequest(Request *request);
 
   // Things like default 404, etc.
@@ -81,6 +158,15 @@ class Server {
   UrlHandlerMap handlers_;
 
   threading::Executor *executor_;
+
+  int numEventLoops_;
+  double idleTimeout_;
+  double keepAliveTimeout_;
+  int maxRequestsPerConnection_;
+  int maxBodySize_;
+  std::vector<EventLoop *> loops_;
+
+  DISALLOW_COPY_AND_ASSIGN(Server);
 };
 
 }  // namespace http
@@ -0,0 +1,47 @@
+#include "net/rate_limiter.h"
+
+#include <algorithm>
+
+#include "base/timeutil.h"
+
+namespace net {
+
+#define MIN_BURST 16384
+
+RateLimiter::RateLimiter() : rate_(0), burst_(0), tokens_(0.0), lastRefill_(0.0) {
+}
+
+void RateLimiter::SetRate(int64_t bytesPerSecond, int64_t burst) {
+	lock_guard guard(mutex_);
+	rate_ = std::max((int64_t)0, bytesPerSecond);
+	burst_ = burst > 0 ? burst : std::max((int64_t)MIN_BURST, rate_ / 4);
+	// Start out full.
+	tokens_ = (double)burst_;
+	lastRefill_ = real_time_now();
+}
+
+int64_t RateLimiter::Rate() {
+	lock_guard guard(mutex_);
+	return rate_;
+}
+
+void RateLimiter::Consume(int64_t bytes) {
+	double wait;
+	{
+		lock_guard guard(mutex_);
+		if (rate_ <= 0)
+			return;
+		double now = real_time_now();
+		tokens_ = std::min((double)burst_, tokens_ + (now - lastRefill_) * rate_);
+		lastRefill_ = now;
+		tokens_ -= bytes;
+		wait = tokens_ < 0.0 ? -tokens_ / rate_ : 0.0;
+	}
+	// Other readers meanwhile dig the hole deeper and wait longer, so together they average
+	// out at the rate.
+	if (wait > 0.0) {
+		sleep_ms((int)(wait * 1000.0) + 1);
+	}
+}
+
+}	// namespace net
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "base/basictypes.h"
+#include "base/mutex.h"
+
+namespace net {
+
+// A token bucket for bandwidth: lets through a set number of bytes per second on average, with
+// bursts of up to a set size. Readers report what they've read, and get put to sleep when
+// they're ahead of the rate. Share one between connections to limit them all together.
+//
+// Thread safe.
+class RateLimiter {
+public:
+	RateLimiter();
+
+	// 0, the default, means no limit. A burst of 0 means a quarter of a second's worth.
+	void SetRate(int64_t bytesPerSecond, int64_t burst = 0);
+	int64_t Rate();
+
+	// Takes bytes out of the bucket. If that leaves it short, sleeps until it's caught up.
+	void Consume(int64_t bytes);
+
+private:
+	recursive_mutex mutex_;
+	int64_t rate_;
+	int64_t burst_;
+	// Can go negative, that's how long the next reader waits.
+	double tokens_;
+	double lastRefill_;
+
+	DISALLOW_COPY_AND_ASSIGN(RateLimiter);
+};
+
+}	// namespace net
@@ -1,6 +1,8 @@
 #include "net/resolve.h"
 #include "base/logging.h"
+#include "base/stats.h"
 #include "base/timeutil.h"
+#include "thread/executor.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -74,6 +76,42 @@ char *DNSResolve(const char *host)
 	return ip;
 }
 
+#define DEFAULT_TTL 60.0
+#define DEFAULT_NEGATIVE_TTL 5.0
+#define MAX_CACHED_NAMES 256
+#define MAX_QUEUED_LOOKUPS 64
+
+static StatCounter dnsHits("net.dns.cache_hits");
+static StatCounter dnsMisses("net.dns.cache_misses");
+static StatCounter dnsCoalesced("net.dns.coalesced");
+
+// Everything we hand out is one of these, so that a cached answer can be given to any number
+// of callers, each with their own to free.
+static addrinfo *CopyAddrInfo(const addrinfo *src)
+{
+	addrinfo *head = NULL;
+	addrinfo **tail = &head;
+	for (const addrinfo *p = src; p != NULL; p = p->ai_next) {
+		addrinfo *copy = (addrinfo *)malloc(sizeof(addrinfo));
+		*copy = *p;
+		copy->ai_next = NULL;
+		copy->ai_addr = NULL;
+		copy->ai_canonname = NULL;
+		if (p->ai_addr != NULL) {
+			copy->ai_addr = (sockaddr *)malloc(p->ai_addrlen);
+			memcpy(copy->ai_addr, p->ai_addr, p->ai_addrlen);
+		}
+		if (p->ai_canonname != NULL) {
+			size_t len = strlen(p->ai_canonname) + 1;
+			copy->ai_canonname = (char *)malloc(len);
+			memcpy(copy->ai_canonname, p->ai_canonname, len);
+		}
+		*tail = copy;
+		tail = &copy->ai_next;
+	}
+	return head;
+}
+
 bool DNSResolve(const std::string &host, const std::string &service, addrinfo **res, std::string &error)
 {
 	addrinfo hints = {0};
@@ -112,13 +150,199 @@ bool DNSResolve(const std::string &host, const std::string &service, addrinfo **
 		return false;
 	}
 
+	addrinfo *copy = CopyAddrInfo(*res);
+	freeaddrinfo(*res);
+	*res = copy;
 	return true;
 }
 
 void DNSResolveFree(addrinfo *res)
 {
-	if (res != NULL)
-		freeaddrinfo(res);
+	while (res != NULL) {
+		addrinfo *next = res->ai_next;
+		free(res->ai_addr);
+		free(res->ai_canonname);
+		free(res);
+		res = next;
+	}
+}
+
+typedef bool (*DNSResolveFunc)(const std::string &, const std::string &, addrinfo **, std::string &);
+
+Resolver::Resolver(int numThreads)
+	: lookup_((DNSResolveFunc)&DNSResolve), ttl_(DEFAULT_TTL), negativeTTL_(DEFAULT_NEGATIVE_TTL)
+{
+	executor_ = new threading::ThreadPoolExecutor(numThreads, MAX_QUEUED_LOOKUPS);
+}
+
+Resolver::~Resolver()
+{
+	delete executor_;
+	Clear();
+}
+
+Resolver *Resolver::Default()
+{
+	// Never deleted, lookups may still be finishing during shutdown.
+	static Resolver *resolver = new Resolver();
+	return resolver;
+}
+
+void Resolver::ResolveAsync(const std::string &host, const std::string &service, Callback callback)
+{
+	std::string key = host + ":" + service;
+	addrinfo *res = NULL;
+	std::string error;
+	bool cached = false;
+	{
+		lock_guard guard(mutex_);
+		auto iter = cache_.find(key);
+		if (iter != cache_.end() && iter->second.expires > real_time_now()) {
+			dnsHits.Add();
+			cached = true;
+			res = CopyAddrInfo(iter->second.res);
+			error = iter->second.error;
+		} else {
+			auto pending = pending_.find(key);
+			if (pending != pending_.end()) {
+				dnsCoalesced.Add();
+				if (callback)
+					pending->second.push_back(callback);
+				return;
+			}
+			dnsMisses.Add();
+			std::vector<Callback> &waiters = pending_[key];
+			if (callback)
+				waiters.push_back(callback);
+		}
+	}
+
+	if (cached) {
+		if (callback)
+			callback(res, error);
+		else
+			DNSResolveFree(res);
+		return;
+	}
+	// Outside the lock, Run may block while the queue is full.
+	executor_->Run(std::bind(&Resolver::Lookup, this, key, host, service));
+}
+
+bool Resolver::Resolve(const std::string &host, const std::string &service, addrinfo **res, std::string &error)
+{
+	recursive_mutex doneMutex;
+	condition_variable doneCond;
+	bool done = false;
+	*res = NULL;
+	ResolveAsync(host, service, [&](addrinfo *result, const std::string &err) {
+		lock_guard guard(doneMutex);
+		*res = result;
+		error = err;
+		done = true;
+		doneCond.notify_all();
+	});
+
+	lock_guard guard(doneMutex);
+	while (!done)
+		doneCond.wait(doneMutex);
+	return *res != NULL;
+}
+
+void Resolver::Prefetch(const std::string &host, const std::string &service)
+{
+	ResolveAsync(host, service, Callback());
+}
+
+void Resolver::SetTTL(double seconds, double negativeSeconds)
+{
+	lock_guard guard(mutex_);
+	ttl_ = seconds;
+	negativeTTL_ = negativeSeconds;
+}
+
+void Resolver::SetLookupFunc(LookupFunc func)
+{
+	lock_guard guard(mutex_);
+	lookup_ = func;
+}
+
+void Resolver::Clear()
+{
+	lock_guard guard(mutex_);
+	for (auto iter = cache_.begin(); iter != cache_.end(); ++iter) {
+		DNSResolveFree(iter->second.res);
+	}
+	cache_.clear();
+}
+
+void Resolver::Lookup(const std::string &key, const std::string &host, const std::string &service)
+{
+	LookupFunc lookup;
+	{
+		lock_guard guard(mutex_);
+		lookup = lookup_;
+	}
+
+	addrinfo *res = NULL;
+	std::string error;
+	if (!lookup(host, service, &res, error) || res == NULL) {
+		DNSResolveFree(res);
+		res = NULL;
+		if (error.empty())
+			error = "Can't resolve host";
+	}
+
+	std::vector<Callback> waiters;
+	{
+		lock_guard guard(mutex_);
+		Store(key, res, error);
+		waiters.swap(pending_[key]);
+		pending_.erase(key);
+	}
+
+	// Everyone gets their own copy, the cache keeps the original.
+	for (size_t i = 0; i < waiters.size(); i++) {
+		waiters[i](CopyAddrInfo(res), error);
+	}
+}
+
+void Resolver::Store(const std::string &key, addrinfo *res, const std::string &error)
+{
+	double now = real_time_now();
+	EvictExpired(now);
+
+	auto iter = cache_.find(key);
+	if (iter != cache_.end()) {
+		DNSResolveFree(iter->second.res);
+		cache_.erase(iter);
+	}
+	// Still full of live names? Make room by dropping whichever would expire first.
+	while (cache_.size() >= MAX_CACHED_NAMES) {
+		auto oldest = cache_.begin();
+		for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+			if (it->second.expires < oldest->second.expires)
+				oldest = it;
+		}
+		DNSResolveFree(oldest->second.res);
+		cache_.erase(oldest);
+	}
+
+	Entry &entry = cache_[key];
+	entry.res = res;
+	entry.error = error;
+	entry.expires = now + (res != NULL ? ttl_ : negativeTTL_);
+}
+
+void Resolver::EvictExpired(double now)
+{
+	for (auto iter = cache_.begin(); iter != cache_.end(); ) {
+		if (iter->second.expires <= now) {
+			DNSResolveFree(iter->second.res);
+			cache_.erase(iter++);
+		} else {
+			++iter;
+		}
+	}
 }
 
 int inet_pton(int af, const char* src, void* dst)
@@ -1,9 +1,19 @@
 #pragma once
 
+#include <map>
 #include <string>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/functional.h"
+#include "base/mutex.h"
 
 struct addrinfo;
 
+namespace threading {
+class ThreadPoolExecutor;
+}
+
 namespace net {
 
 // Strictly only required on Win32, but all platforms should call it.
@@ -23,8 +33,68 @@ struct AutoInit {
 char *DNSResolveTry(const char *host, const char **err);
 char *DNSResolve(const char *host);
 
+// Blocking and uncached, straight from getaddrinfo. Free the result with DNSResolveFree, and
+// only with that - it's a copy, not what getaddrinfo returned.
 bool DNSResolve(const std::string &host, const std::string &service, addrinfo **res, std::string &error);
 void DNSResolveFree(addrinfo *res);
 
+// Looks up host names on threads of its own, and remembers the answers for a while, failures
+// included. A lookup of a name that's already being looked up waits for that one rather than
+// starting another, so a burst of connections to one host costs a single query.
+//
+// getaddrinfo doesn't tell us the real TTLs, so it's a fixed time, by default a minute for
+// answers and five seconds for failures.
+//
+// Thread safe.
+class Resolver {
+public:
+	// res is null on failure. Otherwise it belongs to the callback, free with DNSResolveFree.
+	typedef std::function<void(addrinfo *res, const std::string &error)> Callback;
+	// What does the actual lookups. DNSResolve by default, tests can put in a stub.
+	typedef std::function<bool(const std::string &host, const std::string &service, addrinfo **res, std::string &error)> LookupFunc;
+
+	explicit Resolver(int numThreads = 2);
+	// Waits for lookups in flight.
+	~Resolver();
+
+	// The one Connection uses. Never deleted.
+	static Resolver *Default();
+
+	// Calls back right away if the answer is cached, otherwise from a lookup thread.
+	void ResolveAsync(const std::string &host, const std::string &service, Callback callback);
+	// Same as DNSResolve, but through the cache.
+	bool Resolve(const std::string &host, const std::string &service, addrinfo **res, std::string &error);
+	// Gets a lookup going if the answer isn't cached, for a connection that's coming up.
+	void Prefetch(const std::string &host, const std::string &service);
+
+	void SetTTL(double seconds, double negativeSeconds);
+	void SetLookupFunc(LookupFunc func);
+	void Clear();
+
+private:
+	struct Entry {
+		addrinfo *res;
+		std::string error;
+		double expires;
+	};
+
+	void Lookup(const std::string &key, const std::string &host, const std::string &service);
+	// Lock must be held for these.
+	void Store(const std::string &key, addrinfo *res, const std::string &error);
+	void EvictExpired(double now);
+
+	recursive_mutex mutex_;
+	LookupFunc lookup_;
+	double ttl_;
+	double negativeTTL_;
+	std::map<std::string, Entry> cache_;
+	// Whoever is waiting on the lookups in flight.
+	std::map<std::string, std::vector<Callback>> pending_;
+	// Last, so it's gone (and done with the lookups) before the rest is.
+	threading::ThreadPoolExecutor *executor_;
+
+	DISALLOW_COPY_AND_ASSIGN(Resolver);
+};
+
 int inet_pton(int af, const char* src, void* dst);
 }  // namespace net
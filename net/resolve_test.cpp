@@ -0,0 +1,98 @@
+// Resolver's cache, with a stub lookup that counts how often it's asked: lookups of the same
+// name coalescing into one, failures expiring after the negative TTL, and the cache staying at
+// 256 names.
+
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "base/testutil.h"
+#include "base/timeutil.h"
+#include "net/resolve.h"
+#include "thread/thread.h"
+
+static std::atomic<int> lookups(0);
+
+// Names ending in .invalid don't exist. example.test is slow enough that lookups of it started
+// together overlap.
+static bool StubLookup(const std::string &host, const std::string &service, addrinfo **res, std::string &error) {
+	lookups++;
+	if (host == "example.test")
+		sleep_ms(100);
+	if (host.size() > 8 && host.compare(host.size() - 8, 8, ".invalid") == 0) {
+		error = "No such host";
+		return false;
+	}
+	return net::DNSResolve("127.0.0.1", service, res, error);
+}
+
+static bool Resolve(net::Resolver *resolver, const std::string &host) {
+	addrinfo *res;
+	std::string error;
+	bool ok = resolver->Resolve(host, "80", &res, error);
+	net::DNSResolveFree(res);
+	return ok;
+}
+
+static void ResolveExample(net::Resolver *resolver, std::atomic<int> *resolved) {
+	if (Resolve(resolver, "example.test"))
+		(*resolved)++;
+}
+
+int main() {
+	net::AutoInit netInit;
+
+	// Eight at once, one lookup.
+	{
+		net::Resolver resolver(4);
+		resolver.SetLookupFunc(&StubLookup);
+		lookups = 0;
+		std::atomic<int> resolved(0);
+		std::vector<std::thread *> threads;
+		for (int i = 0; i < 8; i++)
+			threads.push_back(new std::thread(std::bind(&ResolveExample, &resolver, &resolved)));
+		for (size_t i = 0; i < threads.size(); i++) {
+			threads[i]->join();
+			delete threads[i];
+		}
+		Check("coalescing", lookups == 1 && resolved == 8);
+		Check("cached", Resolve(&resolver, "example.test") && lookups == 1);
+	}
+
+	// Failures are remembered too, but not for as long.
+	{
+		net::Resolver resolver;
+		resolver.SetLookupFunc(&StubLookup);
+		resolver.SetTTL(60.0, 0.3);
+		lookups = 0;
+		bool first = Resolve(&resolver, "nothere.invalid");
+		bool again = Resolve(&resolver, "nothere.invalid");
+		Check("failure cached", !first && !again && lookups == 1);
+		sleep_ms(400);
+		Check("negative TTL", !Resolve(&resolver, "nothere.invalid") && lookups == 2);
+		Check("answers outlast it", Resolve(&resolver, "example.test") && Resolve(&resolver, "example.test") && lookups == 3);
+	}
+
+	// 300 names in a cache of 256: the first ones in, which expire first, make room.
+	{
+		net::Resolver resolver;
+		resolver.SetLookupFunc(&StubLookup);
+		for (int i = 0; i < 300; i++) {
+			char host[64];
+			snprintf(host, sizeof(host), "host%d.test", i);
+			Resolve(&resolver, host);
+		}
+		lookups = 0;
+		bool ok = true;
+		for (int i = 300 - 256; i < 300; i++) {
+			char host[64];
+			snprintf(host, sizeof(host), "host%d.test", i);
+			ok = ok && Resolve(&resolver, host);
+		}
+		Check("newest kept", ok && lookups == 0);
+		Check("oldest evicted", Resolve(&resolver, "host0.test") && lookups == 1);
+	}
+
+	return TestResult();
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+// For the client tests that need to control exactly what goes over the wire: where reads end,
+// when connections close, and bodies http::Server would never send. Runs in the same process,
+// a thread per connection, and never stops, so tests should end with _Exit.
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "base/functional.h"
+#include "base/timeutil.h"
+#include "thread/thread.h"
+
+class TestServer {
+public:
+	// Called for each request, headers and body, with the number of requests on the connection
+	// before this one. Sends the response itself, and returns false to close the connection.
+	typedef std::function<bool(int fd, const std::string &request, int previous)> Handler;
+
+	TestServer(int port, Handler handler) : handler_(handler), connections_(0), requests_(0) {
+		listener_ = socket(AF_INET, SOCK_STREAM, 0);
+		int opt = 1;
+		setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr.sin_port = htons(port);
+		if (bind(listener_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener_, 64) < 0) {
+			perror("TestServer");
+			exit(1);
+		}
+		std::thread thread(std::bind(&TestServer::AcceptLoop, this));
+		thread.detach();
+	}
+
+	int Connections() const { return connections_; }
+	int Requests() const { return requests_; }
+
+	// Sent right away, without waiting for more to fill a packet.
+	static void Send(int fd, const std::string &data) {
+		size_t pos = 0;
+		while (pos < data.size()) {
+			ssize_t n = send(fd, data.data() + pos, data.size() - pos, MSG_NOSIGNAL);
+			if (n <= 0)
+				return;
+			pos += n;
+		}
+	}
+
+	// Each piece after a pause, so the client gets them in separate reads.
+	static void SendPieces(int fd, const std::vector<std::string> &pieces) {
+		for (size_t i = 0; i < pieces.size(); i++) {
+			if (i > 0)
+				sleep_ms(20);
+			Send(fd, pieces[i]);
+		}
+	}
+
+private:
+	void AcceptLoop() {
+		while (true) {
+			int fd = accept(listener_, 0, 0);
+			if (fd < 0)
+				continue;
+			int opt = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+			connections_++;
+			std::thread thread(std::bind(&TestServer::Serve, this, fd));
+			thread.detach();
+		}
+	}
+
+	void Serve(int fd) {
+		std::string data;
+		int previous = 0;
+		while (true) {
+			size_t end;
+			while ((end = data.find("\r\n\r\n")) == std::string::npos) {
+				if (!ReadMore(fd, &data)) {
+					close(fd);
+					return;
+				}
+			}
+			end += 4;
+			// Only Content-Length bodies, that's all the client sends.
+			const char *length = strstr(data.substr(0, end).c_str(), "Content-Length: ");
+			if (length)
+				end += atoi(length + 16);
+			while (data.size() < end) {
+				if (!ReadMore(fd, &data)) {
+					close(fd);
+					return;
+				}
+			}
+			std::string request = data.substr(0, end);
+			data.erase(0, end);
+			requests_++;
+			if (!handler_(fd, request, previous++))
+				break;
+		}
+		close(fd);
+	}
+
+	static bool ReadMore(int fd, std::string *data) {
+		char buf[4096];
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n <= 0)
+			return false;
+		data->append(buf, n);
+		return true;
+	}
+
+	Handler handler_;
+	int listener_;
+	std::atomic<int> connections_;
+	std::atomic<int> requests_;
+};
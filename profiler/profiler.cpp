@@ -1,159 +1,564 @@
 // Ultra-lightweight category profiler with history.
 
+#include <algorithm>
+#include <atomic>
+#include <fstream>
 #include <vector>
 #include <string>
 #include <map>
 
+#include <math.h>
 #include <string.h>
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "base/basictypes.h"
 #include "base/logging.h"
+#include "base/mutex.h"
 #include "base/timeutil.h"
 #include "gfx_es2/draw_buffer.h"
+#include "json/json_writer.h"
 #include "profiler/profiler.h"
+#include "thread/threadutil.h"
+
+// Everything below is declared only when the profiler is compiled in.
+#ifdef USE_PROFILER
 
-#define MAX_CATEGORIES 32 // Can be any number
+#define MAX_CATEGORIES 32 // With a flat history. Any number of names can be used, the rest only show up in the call tree
 #define MAX_DEPTH 16      // Can be any number
 #define HISTORY_SIZE 256  // Must be power of 2
+#define MAX_THREADS 64    // Threads alive and profiled at the same time, slots are reused after exit
+#define EVENT_RING_SIZE 8192  // Per thread, per frame. Must be power of 2
+#define MAX_CAPTURE_EVENTS (1024 * 1024)
+#define TREE_WINDOW 128   // Frames of per-node history for the call tree percentiles
 
-#ifndef _DEBUG
-// If the compiler can collapse identical strings, we don't even need the strcmp.
-#define UNIFIED_CONST_STR
-#endif
-
-struct Category {
-	const char *name;
-};
+// Every thread records raw enter/leave events into its own ring, which only it writes to.
+// At the end of each frame, the thread calling PROFILE_END_FRAME drains all the rings and
+// replays them into the per-category history. So the hot path is a timestamp and a store,
+// and no thread ever touches another thread's scope stack.
+//
+// Optionally, the same events are also replayed into a call tree (one root per thread), which
+// keeps per-frame inclusive and exclusive time per node over a rolling window of frames.
 
 struct CategoryFrame {
 	CategoryFrame() {
 		memset(time_taken, 0, sizeof(time_taken));
+		memset(count, 0, sizeof(count));
 	}
 	float time_taken[MAX_CATEGORIES];
 	int count[MAX_CATEGORIES];
 };
 
-struct Profiler {
-	int frameCount;
-	int historyPos;
+struct ProfileEvent {
+	double time;
+	// Category index for enter, ~category for leave.
+	int category;
+};
+
+// The call tree stack of one thread.
+struct TreeFrame {
+	int node;
+	double start;
+	// Inclusive time of finished children, to compute exclusive time.
+	double childTime;
+};
+
+struct ThreadProfile {
+	ProfileEvent events[EVENT_RING_SIZE];
+	// Written by the owning thread, read at end of frame.
+	std::atomic<uint32_t> writePos;
+	// Written at end of frame, read by the owning thread to check for overflow.
+	std::atomic<uint32_t> readPos;
+	std::atomic<int> dropped;
+	// Cleared once the thread has exited and its last events are merged, then the slot can be
+	// handed to a new thread.
+	std::atomic<bool> active;
+	std::atomic<bool> exited;
+	int index;
+	const char *name;
+
+	// Replay state. Only touched by whoever ends the frame.
 	int depth;
 	int parentCategory[MAX_DEPTH];
 	double eventStart[MAX_CATEGORIES];
+
+	int treeRoot;
+	std::vector<TreeFrame> treeStack;
+};
+
+struct TreeNode {
+	int name;  // -1 for the root of a thread.
+	int thread;
+	int parent;
+	int depth;
+	std::vector<int> children;
+
+	// Accumulated during the current frame.
+	double frameInclusive;
+	double frameExclusive;
+	int frameCalls;
+
+	// Per-frame totals for the last TREE_WINDOW frames.
+	float inclusive[TREE_WINDOW];
+	float exclusive[TREE_WINDOW];
+	int calls[TREE_WINDOW];
+};
+
+struct CallTree {
+	bool enabled;
+	int pos;
+	int frames;
+	std::vector<TreeNode *> nodes;
+};
+
+struct Profiler {
+	int frameCount;
+	int historyPos;
 	double curFrameStart;
 };
 
+// Raw events from all threads, kept while a capture is running.
+struct CaptureEvent {
+	double time;
+	int category;  // Same encoding as ProfileEvent, or FRAME_MARKER.
+	int thread;
+};
+#define FRAME_MARKER 0x7FFFFFFF
+
+struct Capture {
+	int framesLeft;
+	double start;
+	// Per thread, to drop leaves of scopes that were entered before the capture started.
+	int depth[MAX_THREADS];
+	std::vector<CaptureEvent> events;
+};
+
 static Profiler profiler;
-static Category categories[MAX_CATEGORIES];
 static CategoryFrame *history;
 
+// Guards the names and the thread list.
+static recursive_mutex registerMutex;
+static std::map<std::string, int> nameIds;
+static std::vector<const char *> names;
+
+static ThreadProfile *threads[MAX_THREADS];
+static std::atomic<int> numThreads;
+// Slots of exited threads, ready for reuse.
+static std::vector<int> freeSlots;
+static __THREAD ThreadProfile *currentThread;
+static Capture capture;
+static CallTree tree;
+
 void internal_profiler_init() {
 	memset(&profiler, 0, sizeof(profiler));
+	history = new CategoryFrame[HISTORY_SIZE];
+}
+
+static void internal_profiler_reset_replay(ThreadProfile *thread) {
+	thread->depth = 0;
 	for (int i = 0; i < MAX_DEPTH; i++) {
-		profiler.parentCategory[i] = -1;
+		thread->parentCategory[i] = -1;
 	}
-	history = new CategoryFrame[HISTORY_SIZE];
+	memset(thread->eventStart, 0, sizeof(thread->eventStart));
+	thread->treeStack.clear();
 }
 
-int internal_profiler_find_cat(const char *category_name) {
-	int i;
-	for (i = 0; i < MAX_CATEGORIES; i++) {
-		const char *catname = categories[i].name;
-		if (!catname)
-			break;
-#ifdef UNIFIED_CONST_STR
-		if (catname == category_name) {
+// Runs on the exiting thread. The slot is freed at the next end of frame, after the events
+// still in the ring have been merged.
+static void internal_profiler_thread_exit(void *arg) {
+	ThreadProfile *thread = (ThreadProfile *)arg;
+	thread->exited.store(true, std::memory_order_release);
+}
+
+#ifdef _WIN32
+struct ThreadExitHook {
+	ThreadExitHook() : thread(NULL) {}
+	~ThreadExitHook() {
+		if (thread)
+			internal_profiler_thread_exit(thread);
+	}
+	ThreadProfile *thread;
+};
+static thread_local ThreadExitHook exitHook;
+
+static void internal_profiler_watch_exit(ThreadProfile *thread) {
+	exitHook.thread = thread;
+}
 #else
-		if (!strcmp(catname, category_name)) {
+static pthread_key_t exitKey;
+static pthread_once_t exitKeyOnce = PTHREAD_ONCE_INIT;
+
+static void internal_profiler_create_exit_key() {
+	pthread_key_create(&exitKey, &internal_profiler_thread_exit);
+}
+
+static void internal_profiler_watch_exit(ThreadProfile *thread) {
+	pthread_once(&exitKeyOnce, &internal_profiler_create_exit_key);
+	pthread_setspecific(exitKey, thread);
+}
 #endif
-			return i;
+
+static ThreadProfile *internal_profiler_register_thread() {
+	lock_guard guard(registerMutex);
+	ThreadProfile *thread;
+	if (!freeSlots.empty()) {
+		// Nobody else touches an inactive slot, its replay state was reset when it was freed.
+		// The tree root is kept, so a thread pool that replaces its threads keeps one tree.
+		thread = threads[freeSlots.back()];
+		freeSlots.pop_back();
+	} else {
+		int index = numThreads;
+		if (index >= MAX_THREADS) {
+			static bool warned = false;
+			if (!warned) {
+				ELOG("profiler: more than %d threads alive at once, scopes on the rest are not recorded", MAX_THREADS);
+				warned = true;
+			}
+			return NULL;
 		}
+		thread = new ThreadProfile();
+		thread->index = index;
+		thread->treeRoot = -1;
+		internal_profiler_reset_replay(thread);
+		threads[index] = thread;
+		numThreads = index + 1;
 	}
+	thread->writePos = 0;
+	thread->readPos = 0;
+	thread->dropped = 0;
+	thread->exited = false;
+	thread->name = GetCurrentThreadName();
+	thread->active.store(true, std::memory_order_release);
+	internal_profiler_watch_exit(thread);
+	return thread;
+}
 
-	if (i < MAX_CATEGORIES && category_name) {
-		categories[i].name = category_name;
-		return i;
-	}
+// Any number of names can be interned. PROFILE_THIS_SCOPE caches the result per call site,
+// so this is only slow-ish the first time around.
+int internal_profiler_find_cat(const char *category_name) {
+	if (!category_name)
+		return -1;
 
-	return -1;
+	lock_guard guard(registerMutex);
+	std::string key(category_name);
+	auto iter = nameIds.find(key);
+	if (iter != nameIds.end()) {
+		return iter->second;
+	}
+	int id = (int)names.size();
+	names.push_back(category_name);
+	nameIds[key] = id;
+	return id;
 }
 
-// Suspend, also used to prepare for leaving.
-static void internal_profiler_suspend(int category, double now) {
-	double diff = now - profiler.eventStart[category];
-	history[profiler.historyPos].time_taken[category] += (float)diff;
-	profiler.eventStart[category] = 0.0;
+static const char *internal_profiler_name(int id) {
+	lock_guard guard(registerMutex);
+	return id >= 0 && id < (int)names.size() ? names[id] : "N/A";
 }
 
-// Resume, also used as part of entering.
-static void internal_profiler_resume(int category, double now) {
-	profiler.eventStart[category] = now;
+static void internal_profiler_record(int category) {
+	ThreadProfile *thread = currentThread;
+	if (!thread) {
+		thread = internal_profiler_register_thread();
+		if (!thread)
+			return;
+		currentThread = thread;
+	}
+
+	uint32_t pos = thread->writePos.load(std::memory_order_relaxed);
+	if (pos - thread->readPos.load(std::memory_order_acquire) >= EVENT_RING_SIZE) {
+		// This thread is producing events faster than frames end. Not much we can do.
+		thread->dropped++;
+		return;
+	}
+	ProfileEvent &event = thread->events[pos & (EVENT_RING_SIZE - 1)];
+	event.time = real_time_now();
+	event.category = category;
+	thread->writePos.store(pos + 1, std::memory_order_release);
 }
 
 int internal_profiler_enter(const char *category_name) {
 	int category = internal_profiler_find_cat(category_name);
+	internal_profiler_enter_cat(category);
+	return category;
+}
+
+void internal_profiler_enter_cat(int category) {
 	if (category == -1 || !history) {
-		return category;
+		return;
 	}
+	internal_profiler_record(category);
+}
 
-	if (profiler.eventStart[category] == 0.0f) {
-		double now = real_time_now();
-		int parent = profiler.parentCategory[profiler.depth];
-		// Temporarily suspend the parent on entering a child.
-		if (parent != -1) {
-			internal_profiler_suspend(parent, now);
-		}
-		internal_profiler_resume(category, now);
-	} else {
-		DLOG("profiler: recursive enter (%i - %s)", category, category_name);
+void internal_profiler_leave(int category) {
+	if (category == -1 || !history) {
+		return;
+	}
+	if (category < 0) {
+		ELOG("Bad category index %d", category);
+		return;
 	}
+	internal_profiler_record(~category);
+}
 
-	profiler.depth++;
-	profiler.parentCategory[profiler.depth] = category;
+// Suspend, also used to prepare for leaving.
+static void internal_profiler_suspend(ThreadProfile *thread, int category, double now) {
+	double diff = now - thread->eventStart[category];
+	history[profiler.historyPos].time_taken[category] += (float)diff;
+	thread->eventStart[category] = 0.0;
+}
 
-	return category;
+// Resume, also used as part of entering.
+static void internal_profiler_resume(ThreadProfile *thread, int category, double now) {
+	thread->eventStart[category] = now;
 }
 
-void internal_profiler_leave(int category) {
-	if (category == -1 || !history) {
+static void internal_profiler_replay_enter(ThreadProfile *thread, int category, double now) {
+	if (category >= MAX_CATEGORIES) {
+		// Not in the flat history, its time stays with the parent.
 		return;
 	}
-	if (category < 0 || category >= MAX_CATEGORIES) {
-		ELOG("Bad category index %d", category);
-		profiler.depth--;
+	if (thread->depth >= MAX_DEPTH - 1) {
+		ELOG("profiler: scopes nested too deep (%s)", internal_profiler_name(category));
 		return;
 	}
+	if (thread->eventStart[category] == 0.0) {
+		int parent = thread->parentCategory[thread->depth];
+		// Temporarily suspend the parent on entering a child.
+		if (parent != -1) {
+			internal_profiler_suspend(thread, parent, now);
+		}
+		internal_profiler_resume(thread, category, now);
+	} else {
+		DLOG("profiler: recursive enter (%i - %s)", category, internal_profiler_name(category));
+	}
 
-	double now = real_time_now();
+	thread->depth++;
+	thread->parentCategory[thread->depth] = category;
+}
 
-	profiler.depth--;
-	if (profiler.depth < 0) {
-		FLOG("Profiler enter/leave mismatch!");
+static void internal_profiler_replay_leave(ThreadProfile *thread, int category, double now) {
+	if (category >= MAX_CATEGORIES) {
+		return;
+	}
+	if (thread->depth <= 0) {
+		ELOG("Profiler enter/leave mismatch!");
+		return;
 	}
 
-	int parent = profiler.parentCategory[profiler.depth];
+	thread->depth--;
+	int parent = thread->parentCategory[thread->depth];
 	// When there's recursion, we don't suspend or resume.
 	if (parent != category) {
-		internal_profiler_suspend(category, now);
+		internal_profiler_suspend(thread, category, now);
 		history[profiler.historyPos].count[category]++;
 
 		if (parent != -1) {
 			// Resume tracking the parent.
-			internal_profiler_resume(parent, now);
+			internal_profiler_resume(thread, parent, now);
+		}
+	}
+}
+
+static int internal_profiler_tree_child(int parent, int name) {
+	TreeNode *node = tree.nodes[parent];
+	for (size_t i = 0; i < node->children.size(); i++) {
+		if (tree.nodes[node->children[i]]->name == name)
+			return node->children[i];
+	}
+
+	TreeNode *child = new TreeNode();
+	child->name = name;
+	child->thread = node->thread;
+	child->parent = parent;
+	child->depth = node->depth + 1;
+	child->frameInclusive = 0.0;
+	child->frameExclusive = 0.0;
+	child->frameCalls = 0;
+	memset(child->inclusive, 0, sizeof(child->inclusive));
+	memset(child->exclusive, 0, sizeof(child->exclusive));
+	memset(child->calls, 0, sizeof(child->calls));
+	int index = (int)tree.nodes.size();
+	tree.nodes.push_back(child);
+	// Careful, push_back may have moved things around. node itself stays put though.
+	node->children.push_back(index);
+	return index;
+}
+
+static void internal_profiler_tree_enter(ThreadProfile *thread, int name, double now) {
+	if (thread->treeRoot == -1) {
+		TreeNode *root = new TreeNode();
+		memset(root->inclusive, 0, sizeof(root->inclusive));
+		memset(root->exclusive, 0, sizeof(root->exclusive));
+		memset(root->calls, 0, sizeof(root->calls));
+		root->name = -1;
+		root->thread = thread->index;
+		root->parent = -1;
+		root->depth = 0;
+		root->frameInclusive = 0.0;
+		root->frameExclusive = 0.0;
+		root->frameCalls = 0;
+		thread->treeRoot = (int)tree.nodes.size();
+		tree.nodes.push_back(root);
+	}
+	int parent = thread->treeStack.empty() ? thread->treeRoot : thread->treeStack.back().node;
+	TreeFrame frame = { internal_profiler_tree_child(parent, name), now, 0.0 };
+	thread->treeStack.push_back(frame);
+}
+
+static void internal_profiler_tree_leave(ThreadProfile *thread, int name, double now) {
+	// Leaves of scopes entered before the tree was enabled don't match anything, skip them.
+	if (thread->treeStack.empty() || tree.nodes[thread->treeStack.back().node]->name != name) {
+		return;
+	}
+	TreeFrame frame = thread->treeStack.back();
+	thread->treeStack.pop_back();
+
+	TreeNode *node = tree.nodes[frame.node];
+	double inclusive = now - frame.start;
+	node->frameInclusive += inclusive;
+	node->frameExclusive += inclusive - frame.childTime;
+	node->frameCalls++;
+	if (!thread->treeStack.empty()) {
+		thread->treeStack.back().childTime += inclusive;
+	} else {
+		// The thread root just sums up its top level scopes.
+		tree.nodes[thread->treeRoot]->frameInclusive += inclusive;
+	}
+}
+
+// Charges scopes still open at the end of the frame up to now, and restarts them from now.
+static void internal_profiler_tree_split(ThreadProfile *thread, double frameEnd) {
+	for (int i = (int)thread->treeStack.size() - 1; i >= 0; i--) {
+		TreeFrame &frame = thread->treeStack[i];
+		TreeNode *node = tree.nodes[frame.node];
+		double inclusive = frameEnd - frame.start;
+		node->frameInclusive += inclusive;
+		node->frameExclusive += inclusive - frame.childTime;
+		if (i > 0) {
+			thread->treeStack[i - 1].childTime += inclusive;
+		} else {
+			tree.nodes[thread->treeRoot]->frameInclusive += inclusive;
 		}
+		frame.start = frameEnd;
+		frame.childTime = 0.0;
+	}
+}
+
+static void internal_profiler_tree_end_frame() {
+	for (size_t i = 0; i < tree.nodes.size(); i++) {
+		TreeNode *node = tree.nodes[i];
+		node->inclusive[tree.pos] = (float)node->frameInclusive;
+		node->exclusive[tree.pos] = (float)node->frameExclusive;
+		node->calls[tree.pos] = node->frameCalls;
+		node->frameInclusive = 0.0;
+		node->frameExclusive = 0.0;
+		node->frameCalls = 0;
+	}
+	tree.pos = (tree.pos + 1) % TREE_WINDOW;
+	if (tree.frames < TREE_WINDOW)
+		tree.frames++;
+}
+
+static void internal_profiler_capture(ThreadProfile *thread, const ProfileEvent &event) {
+	if (event.time < capture.start || capture.events.size() >= MAX_CAPTURE_EVENTS) {
+		return;
+	}
+	int &depth = capture.depth[thread->index];
+	if (event.category >= 0) {
+		depth++;
+	} else if (depth > 0) {
+		depth--;
+	} else {
+		return;
+	}
+	CaptureEvent captured = { event.time, event.category, thread->index };
+	capture.events.push_back(captured);
+}
+
+static void internal_profiler_merge_thread(ThreadProfile *thread, double frameEnd) {
+	if (!thread->active.load(std::memory_order_acquire))
+		return;
+	// Checked before reading writePos, so that everything the thread did before exiting is seen.
+	bool exited = thread->exited.load(std::memory_order_acquire);
+	uint32_t end = thread->writePos.load(std::memory_order_acquire);
+	uint32_t pos = thread->readPos.load(std::memory_order_relaxed);
+	for (; pos != end; pos++) {
+		const ProfileEvent &event = thread->events[pos & (EVENT_RING_SIZE - 1)];
+		if (capture.framesLeft > 0) {
+			internal_profiler_capture(thread, event);
+		}
+		if (event.category >= 0) {
+			internal_profiler_replay_enter(thread, event.category, event.time);
+			if (tree.enabled)
+				internal_profiler_tree_enter(thread, event.category, event.time);
+		} else {
+			internal_profiler_replay_leave(thread, ~event.category, event.time);
+			if (tree.enabled)
+				internal_profiler_tree_leave(thread, ~event.category, event.time);
+		}
+	}
+	thread->readPos.store(end, std::memory_order_release);
+	if (tree.enabled) {
+		internal_profiler_tree_split(thread, frameEnd);
+	}
+
+	// Scopes still open on other threads (loaders etc.) keep running across frames. Charge
+	// what they've done so far to this frame, and keep counting from here in the next.
+	int open = thread->parentCategory[thread->depth];
+	if (thread->depth > 0 && open != -1 && thread->eventStart[open] != 0.0) {
+		internal_profiler_suspend(thread, open, frameEnd);
+		internal_profiler_resume(thread, open, frameEnd);
+	}
+
+	int dropped = thread->dropped.exchange(0);
+	if (dropped) {
+		WLOG("profiler: dropped %d events on a thread, frames too long?", dropped);
+	}
+
+	if (exited) {
+		internal_profiler_reset_replay(thread);
+		capture.depth[thread->index] = 0;
+		lock_guard guard(registerMutex);
+		thread->active.store(false, std::memory_order_relaxed);
+		freeSlots.push_back(thread->index);
 	}
 }
 
 void internal_profiler_end_frame() {
-	if (profiler.depth != 0) {
+	if (!history)
+		return;
+
+	double now = real_time_now();
+	int count = numThreads;
+	for (int i = 0; i < count; i++) {
+		internal_profiler_merge_thread(threads[i], now);
+	}
+
+	if (currentThread && currentThread->depth != 0) {
 		FLOG("Can't be inside a profiler scope at end of frame!");
 	}
-	profiler.curFrameStart = real_time_now();
+	if (capture.framesLeft > 0) {
+		CaptureEvent marker = { now, FRAME_MARKER, currentThread ? currentThread->index : 0 };
+		capture.events.push_back(marker);
+		if (--capture.framesLeft == 0) {
+			ILOG("Profiler capture done, %d events", (int)capture.events.size());
+		}
+	}
+	if (tree.enabled) {
+		internal_profiler_tree_end_frame();
+	}
+	profiler.curFrameStart = now;
+	profiler.frameCount++;
 	profiler.historyPos++;
 	profiler.historyPos &= (HISTORY_SIZE - 1);
 	memset(&history[profiler.historyPos], 0, sizeof(history[profiler.historyPos]));
 }
 
 const char *Profiler_GetCategoryName(int i) {
-	return i >= 0 ? categories[i].name : "N/A";
+	return internal_profiler_name(i);
 }
 
 int Profiler_GetHistoryLength() {
@@ -161,15 +566,12 @@ int Profiler_GetHistoryLength() {
 }
 
 int Profiler_GetNumCategories() {
-	for (int i = 0; i < MAX_CATEGORIES; i++) {
-		if (!categories[i].name)
-			return i;
-	}
-	return 0;
+	lock_guard guard(registerMutex);
+	return std::min((int)names.size(), MAX_CATEGORIES);
 }
 
 void Profiler_GetHistory(int category, float *data, int count) {
-	for (int i = 0; i < HISTORY_SIZE; i++) {
+	for (int i = 0; i < count; i++) {
 		int x = i - count + profiler.historyPos + 1;
 		while (x < 0)
 			x += HISTORY_SIZE;
@@ -178,3 +580,158 @@ void Profiler_GetHistory(int category, float *data, int count) {
 		data[i] = history[x].time_taken[category];
 	}
 }
+
+void Profiler_StartCapture(int frames) {
+	capture.framesLeft = frames;
+	capture.start = real_time_now();
+	memset(capture.depth, 0, sizeof(capture.depth));
+	capture.events.clear();
+}
+
+bool Profiler_IsCapturing() {
+	return capture.framesLeft > 0;
+}
+
+void Profiler_WriteChromeTrace(std::ostream &out) {
+	JsonWriter writer(out);
+	writer.begin();
+	writer.writeString("displayTimeUnit", "ms");
+	writer.pushArray("traceEvents");
+
+	int count = numThreads;
+	for (int i = 0; i < count; i++) {
+		char temp[32];
+		const char *name = threads[i]->name;
+		if (!name) {
+			snprintf(temp, sizeof(temp), "Thread %d", i);
+			name = temp;
+		}
+		writer.pushDict();
+		writer.writeString("name", "thread_name");
+		writer.writeString("ph", "M");
+		writer.writeInt("pid", 0);
+		writer.writeInt("tid", i);
+		writer.pushDict("args");
+		writer.writeString("name", name);
+		writer.pop();
+		writer.pop();
+	}
+
+	for (size_t i = 0; i < capture.events.size(); i++) {
+		const CaptureEvent &event = capture.events[i];
+		writer.pushDict();
+		if (event.category == FRAME_MARKER) {
+			writer.writeString("name", "Frame");
+			writer.writeString("ph", "i");
+			writer.writeString("s", "g");
+		} else {
+			int category = event.category >= 0 ? event.category : ~event.category;
+			writer.writeString("name", internal_profiler_name(category));
+			writer.writeString("ph", event.category >= 0 ? "B" : "E");
+		}
+		writer.writeInt64("ts", (int64_t)((event.time - capture.start) * 1000000.0));
+		writer.writeInt("pid", 0);
+		writer.writeInt("tid", event.thread);
+		writer.pop();
+	}
+
+	writer.pop();
+	writer.end();
+}
+
+bool Profiler_WriteChromeTrace(const char *filename) {
+	std::ofstream out(filename);
+	if (!out) {
+		ELOG("Failed to open %s for writing the profiler trace", filename);
+		return false;
+	}
+	Profiler_WriteChromeTrace(out);
+	return out.good();
+}
+
+void Profiler_EnableCallTree(bool enable) {
+	if (enable && !tree.enabled) {
+		// Start from a clean slate, the old stacks are stale.
+		int count = numThreads;
+		for (int i = 0; i < count; i++) {
+			threads[i]->treeStack.clear();
+		}
+	}
+	tree.enabled = enable;
+}
+
+bool Profiler_IsCallTreeEnabled() {
+	return tree.enabled;
+}
+
+static void internal_profiler_percentiles(const float *window, int frames, float *p50, float *p95, float *p99, float *mean) {
+	std::vector<float> sorted;
+	sorted.reserve(frames);
+	double sum = 0.0;
+	// The most recent frames, oldest first. Order doesn't matter after sorting anyway.
+	for (int i = 0; i < frames; i++) {
+		float value = window[(tree.pos - frames + i + TREE_WINDOW) % TREE_WINDOW];
+		sorted.push_back(value);
+		sum += value;
+	}
+	std::sort(sorted.begin(), sorted.end());
+	// Nearest rank.
+	*p50 = sorted[std::max(0, (int)ceil(frames * 0.50) - 1)];
+	*p95 = sorted[std::max(0, (int)ceil(frames * 0.95) - 1)];
+	*p99 = sorted[std::max(0, (int)ceil(frames * 0.99) - 1)];
+	*mean = (float)(sum / frames);
+}
+
+static void internal_profiler_report_node(int index, int parent, std::vector<ProfilerTreeNode> *result) {
+	const TreeNode *node = tree.nodes[index];
+	ProfilerTreeNode out;
+	if (node->name == -1) {
+		const char *threadName = threads[node->thread]->name;
+		out.name = threadName ? threadName : "(unnamed thread)";
+	} else {
+		out.name = internal_profiler_name(node->name);
+	}
+	out.parent = parent;
+	out.depth = node->depth;
+
+	int calls = 0;
+	for (int i = 0; i < tree.frames; i++) {
+		calls += node->calls[(tree.pos - 1 - i + TREE_WINDOW) % TREE_WINDOW];
+	}
+	out.callsPerFrame = (float)calls / (float)tree.frames;
+	internal_profiler_percentiles(node->inclusive, tree.frames, &out.inclusiveP50, &out.inclusiveP95, &out.inclusiveP99, &out.inclusiveMean);
+	internal_profiler_percentiles(node->exclusive, tree.frames, &out.exclusiveP50, &out.exclusiveP95, &out.exclusiveP99, &out.exclusiveMean);
+
+	int self = (int)result->size();
+	result->push_back(out);
+	for (size_t i = 0; i < node->children.size(); i++) {
+		internal_profiler_report_node(node->children[i], self, result);
+	}
+}
+
+void Profiler_GetCallTree(std::vector<ProfilerTreeNode> *result) {
+	result->clear();
+	if (tree.frames == 0)
+		return;
+	for (size_t i = 0; i < tree.nodes.size(); i++) {
+		if (tree.nodes[i]->parent == -1) {
+			internal_profiler_report_node((int)i, -1, result);
+		}
+	}
+}
+
+void Profiler_LogCallTree() {
+	std::vector<ProfilerTreeNode> nodes;
+	Profiler_GetCallTree(&nodes);
+	ILOG("%-40s %8s %9s %9s %9s %9s %9s", "scope (ms per frame)", "calls", "incl", "incl p50", "incl p95", "incl p99", "excl p99");
+	for (size_t i = 0; i < nodes.size(); i++) {
+		const ProfilerTreeNode &node = nodes[i];
+		char label[64];
+		snprintf(label, sizeof(label), "%*s%s", node.depth * 2, "", node.name);
+		ILOG("%-40s %8.1f %9.3f %9.3f %9.3f %9.3f %9.3f", label, node.callsPerFrame,
+			node.inclusiveMean * 1000.0f, node.inclusiveP50 * 1000.0f, node.inclusiveP95 * 1000.0f,
+			node.inclusiveP99 * 1000.0f, node.exclusiveP99 * 1000.0f);
+	}
+}
+
+#endif  // USE_PROFILER
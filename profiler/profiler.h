@@ -1,9 +1,14 @@
 #pragma once
 
 #include <inttypes.h>
+#include <iosfwd>
+#include <vector>
 
 // #define USE_PROFILER
 
+// PROFILE_THIS_SCOPE can be used from any thread. Each thread records its own events, and they're
+// all collected into the history when PROFILE_END_FRAME is called (from the main thread).
+
 #ifdef USE_PROFILER
 
 class DrawBuffer;
@@ -11,7 +16,9 @@ class DrawBuffer;
 void internal_profiler_init();
 void internal_profiler_end_frame();
 
+int internal_profiler_find_cat(const char *category_name);
 int internal_profiler_enter(const char *category_name);  // Returns the category number.
+void internal_profiler_enter_cat(int category);
 void internal_profiler_leave(int category);
 
 
@@ -20,11 +27,47 @@ int Profiler_GetNumCategories();
 int Profiler_GetHistoryLength();
 void Profiler_GetHistory(int i, float *data, int count);
 
+// Records every scope from every thread for the next number of frames, for inspection in
+// chrome://tracing or Perfetto. Call from the same thread as PROFILE_END_FRAME.
+void Profiler_StartCapture(int frames);
+bool Profiler_IsCapturing();
+// Writes the last capture as Chrome trace event JSON.
+void Profiler_WriteChromeTrace(std::ostream &out);
+bool Profiler_WriteChromeTrace(const char *filename);
+
+// Call tree mode: time is tracked per call path ("DrawText" under "ListView" is separate from
+// "DrawText" under "PopupScreen"), with one root per thread, over a rolling window of frames.
+// Like the capture, only touch it from the thread calling PROFILE_END_FRAME.
+struct ProfilerTreeNode {
+	const char *name;  // The thread name for roots.
+	int parent;  // Index in the same vector, -1 for roots.
+	int depth;
+	float callsPerFrame;
+	// Seconds per frame. Percentiles are over the frames in the window.
+	float inclusiveMean;
+	float inclusiveP50;
+	float inclusiveP95;
+	float inclusiveP99;
+	float exclusiveMean;
+	float exclusiveP50;
+	float exclusiveP95;
+	float exclusiveP99;
+};
+
+void Profiler_EnableCallTree(bool enable);
+bool Profiler_IsCallTreeEnabled();
+// Depth first, so parents always come before their children.
+void Profiler_GetCallTree(std::vector<ProfilerTreeNode> *nodes);
+void Profiler_LogCallTree();
+
 class ProfileThis {
 public:
 	ProfileThis(const char *category) {
 		cat_ = internal_profiler_enter(category);
 	}
+	ProfileThis(int category) : cat_(category) {
+		internal_profiler_enter_cat(category);
+	}
 	~ProfileThis() {
 		internal_profiler_leave(cat_);
 	}
@@ -33,7 +76,8 @@ private:
 };
 
 #define PROFILE_INIT() internal_profiler_init();
-#define PROFILE_THIS_SCOPE(cat) ProfileThis _profile_scoped(cat);
+// The category lookup is done once per call site, so cat should be a constant string.
+#define PROFILE_THIS_SCOPE(cat) static const int _profile_cat = internal_profiler_find_cat(cat); ProfileThis _profile_scoped(_profile_cat);
 #define PROFILE_END_FRAME() internal_profiler_end_frame();
 
 #else
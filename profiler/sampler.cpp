@@ -0,0 +1,242 @@
+// SIGPROF based sampling profiler. See sampler.h.
+
+#include <fstream>
+#include <map>
+#include <string>
+
+#include "base/logging.h"
+#include "profiler/sampler.h"
+
+#if defined(__GLIBC__) && !defined(__UCLIBC__)
+
+#include <atomic>
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "base/backtrace.h"
+#include "thread/threadutil.h"
+
+#define MAX_SAMPLES 32768      // About 30 seconds of one busy thread at 1000 Hz
+#define MAX_SAMPLE_FRAMES 48
+// The signal handler and the kernel's signal return trampoline.
+#define SKIP_FRAMES 2
+
+// Everything the signal handler touches is preallocated. A sample slot is claimed with an
+// atomic increment, and flagged ready once filled in, so the handler never blocks or allocates
+// and can interrupt any thread at any point, including a thread that's inside the handler.
+struct Sample {
+	std::atomic<int> ready;
+	int depth;
+	int threadId;
+	const char *threadName;
+	void *pcs[MAX_SAMPLE_FRAMES];
+};
+
+static Sample *samples;
+static std::atomic<int> nextSample;
+static std::atomic<int> dropped;
+static std::atomic<bool> running;
+// Handlers currently executing, so that Stop can wait for them to finish.
+static std::atomic<int> inHandler;
+// Once installed, the handler stays, see Sampler_Stop.
+static bool handlerInstalled;
+
+static void SamplerHandler(int sig, siginfo_t *info, void *context) {
+	int savedErrno = errno;
+	inHandler++;
+	if (running.load(std::memory_order_acquire)) {
+		if (nextSample.load(std::memory_order_relaxed) >= MAX_SAMPLES) {
+			dropped++;
+		} else {
+			int index = nextSample.fetch_add(1);
+			if (index < MAX_SAMPLES) {
+				Sample &sample = samples[index];
+				void *pcs[MAX_SAMPLE_FRAMES + SKIP_FRAMES];
+				int depth = GetBacktrace(pcs, MAX_SAMPLE_FRAMES + SKIP_FRAMES) - SKIP_FRAMES;
+				if (depth < 0)
+					depth = 0;
+				memcpy(sample.pcs, pcs + SKIP_FRAMES, depth * sizeof(void *));
+				sample.depth = depth;
+				sample.threadId = (int)syscall(SYS_gettid);
+				sample.threadName = GetCurrentThreadName();
+				sample.ready.store(1, std::memory_order_release);
+			} else {
+				dropped++;
+			}
+		}
+	}
+	inHandler--;
+	errno = savedErrno;
+}
+
+static void SetTimer(int hz) {
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	if (hz > 0) {
+		timer.it_interval.tv_sec = 0;
+		timer.it_interval.tv_usec = 1000000 / hz;
+		timer.it_value = timer.it_interval;
+	}
+	setitimer(ITIMER_PROF, &timer, 0);
+}
+
+bool Sampler_Start(int hz) {
+	if (running || hz <= 0 || hz > 1000000) {
+		return false;
+	}
+	if (!samples) {
+		samples = new Sample[MAX_SAMPLES];
+	}
+	for (int i = 0; i < MAX_SAMPLES; i++) {
+		samples[i].ready.store(0, std::memory_order_relaxed);
+	}
+	nextSample = 0;
+	dropped = 0;
+
+	// The first backtrace() call loads libgcc's unwinder, which isn't safe to do in a handler.
+	void *warmup[4];
+	GetBacktrace(warmup, 4);
+
+	if (!handlerInstalled) {
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_sigaction = &SamplerHandler;
+		action.sa_flags = SA_RESTART | SA_SIGINFO;
+		sigemptyset(&action.sa_mask);
+		if (sigaction(SIGPROF, &action, 0) != 0) {
+			ELOG("Sampler: failed to install the SIGPROF handler");
+			return false;
+		}
+		handlerInstalled = true;
+	}
+
+	running.store(true, std::memory_order_release);
+	// ITIMER_PROF counts CPU time of the whole process, and the kernel delivers the signal to a
+	// thread that is running at the time. So busy threads get sampled in proportion to their
+	// CPU use, and idle ones not at all.
+	SetTimer(hz);
+	ILOG("Sampler: started at %d Hz", hz);
+	return true;
+}
+
+void Sampler_Stop() {
+	if (!running) {
+		return;
+	}
+	SetTimer(0);
+	running.store(false, std::memory_order_release);
+	// A signal may still be in flight on another thread.
+	while (inHandler.load() > 0) {
+		sched_yield();
+	}
+	// The handler stays installed and just returns from now on. One more SIGPROF can still be
+	// pending on some thread, and under the default action that would kill the process.
+	ILOG("Sampler: stopped, %d samples, %d dropped", Sampler_GetNumSamples(), Sampler_GetNumDropped());
+}
+
+bool Sampler_IsRunning() {
+	return running;
+}
+
+int Sampler_GetNumSamples() {
+	int count = nextSample;
+	return count < MAX_SAMPLES ? count : MAX_SAMPLES;
+}
+
+int Sampler_GetNumDropped() {
+	return dropped;
+}
+
+static std::string SymbolizeAddress(void *pc) {
+	char temp[64];
+	Dl_info info;
+	memset(&info, 0, sizeof(info));
+	if (dladdr(pc, &info) && info.dli_sname) {
+		int status = 0;
+		char *demangled = abi::__cxa_demangle(info.dli_sname, 0, 0, &status);
+		std::string name = status == 0 && demangled ? demangled : info.dli_sname;
+		free(demangled);
+		return name;
+	}
+	if (info.dli_fname && info.dli_fname[0]) {
+		const char *module = strrchr(info.dli_fname, '/');
+		module = module ? module + 1 : info.dli_fname;
+		snprintf(temp, sizeof(temp), "+0x%lx", (unsigned long)((char *)pc - (char *)info.dli_fbase));
+		return std::string(module) + temp;
+	}
+	snprintf(temp, sizeof(temp), "0x%lx", (unsigned long)pc);
+	return temp;
+}
+
+void Sampler_WriteCollapsed(std::ostream &out) {
+	Sampler_Stop();
+
+	std::map<void *, std::string> symbols;
+	std::map<std::string, int> stacks;
+	int count = Sampler_GetNumSamples();
+	for (int i = 0; i < count; i++) {
+		const Sample &sample = samples[i];
+		if (!sample.ready.load(std::memory_order_acquire))
+			continue;
+
+		std::string stack;
+		if (sample.threadName) {
+			stack = sample.threadName;
+		} else {
+			char temp[32];
+			snprintf(temp, sizeof(temp), "thread-%d", sample.threadId);
+			stack = temp;
+		}
+		// Outermost first.
+		for (int f = sample.depth - 1; f >= 0; f--) {
+			// Except for the interrupted one, these are return addresses. Step back into the
+			// call instruction so that they resolve to the right function (and line).
+			void *pc = f == 0 ? sample.pcs[f] : (char *)sample.pcs[f] - 1;
+			auto iter = symbols.find(pc);
+			if (iter == symbols.end()) {
+				iter = symbols.insert(std::make_pair(pc, SymbolizeAddress(pc))).first;
+			}
+			stack += ";";
+			stack += iter->second;
+		}
+		stacks[stack]++;
+	}
+
+	for (auto iter = stacks.begin(); iter != stacks.end(); ++iter) {
+		out << iter->first << " " << iter->second << "\n";
+	}
+}
+
+#else
+
+bool Sampler_Start(int hz) {
+	WLOG("Sampler: not supported on this platform");
+	return false;
+}
+
+void Sampler_Stop() {}
+bool Sampler_IsRunning() { return false; }
+int Sampler_GetNumSamples() { return 0; }
+int Sampler_GetNumDropped() { return 0; }
+void Sampler_WriteCollapsed(std::ostream &out) {}
+
+#endif
+
+bool Sampler_WriteCollapsed(const char *filename) {
+	std::ofstream out(filename);
+	if (!out) {
+		ELOG("Failed to open %s for writing the samples", filename);
+		return false;
+	}
+	Sampler_WriteCollapsed(out);
+	return out.good();
+}
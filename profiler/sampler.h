@@ -0,0 +1,34 @@
+#pragma once
+
+#include <iosfwd>
+
+// Statistical profiler. Unlike PROFILE_THIS_SCOPE, it needs no annotations and no USE_PROFILER,
+// so it works on plain release builds.
+//
+// While running, a SIGPROF timer interrupts whichever thread is currently burning CPU, and the
+// signal handler stores the raw return addresses of its stack into a preallocated buffer. Nothing
+// is symbolized until the samples are written out, in the "collapsed stack" format that
+// flamegraph.pl and speedscope read:
+//
+//   main;RunLoop;DrawText;MeasureString 412
+//
+// Functions that aren't exported show up as module+0xoffset, which addr2line can resolve later.
+// Link with -rdynamic to get more names directly.
+//
+// Only supported on glibc based platforms. Elsewhere Sampler_Start just returns false.
+
+// Starts sampling at the given rate (in samples per second of CPU time), throwing away any
+// earlier samples. Returns false if not supported or already running.
+bool Sampler_Start(int hz = 1000);
+// Leaves the SIGPROF handler installed, doing nothing, since a signal can still be pending.
+void Sampler_Stop();
+bool Sampler_IsRunning();
+
+// Samples taken, and samples lost because the buffer was full.
+int Sampler_GetNumSamples();
+int Sampler_GetNumDropped();
+
+// Symbolizes the samples and writes them as collapsed stacks, one line per unique stack, with
+// the thread name as the outermost frame. Stops the sampler if it's still running.
+void Sampler_WriteCollapsed(std::ostream &out);
+bool Sampler_WriteCollapsed(const char *filename);
@@ -1,10 +1,178 @@
 #include "thread/executor.h"
 #include "base/functional.h"
+#include "base/logging.h"
+#include "base/timeutil.h"
+#include "thread/threadutil.h"
 
 namespace threading {
 
-void SameThreadExecutor::Run(std::function<void()> func) {
+bool SameThreadExecutor::Run(std::function<void()> func) {
   func();
+  return true;
+}
+
+bool QueuedExecutor::Run(std::function<void()> func) {
+  lock_guard guard(mutex_);
+  queue_.push_back(func);
+  return true;
+}
+
+int QueuedExecutor::RunPending() {
+  int count = 0;
+  std::vector<std::function<void()>> pending;
+  while (true) {
+    mutex_.lock();
+    pending.swap(queue_);
+    mutex_.unlock();
+    if (pending.empty())
+      break;
+    for (size_t i = 0; i < pending.size(); i++) {
+      pending[i]();
+    }
+    count += (int)pending.size();
+    pending.clear();
+  }
+  return count;
+}
+
+ThreadPoolExecutor::ThreadPoolExecutor(int numThreads, int maxQueued, Backpressure backpressure)
+    : backpressure_(backpressure), mutex_("ThreadPoolExecutor"), head_(0), count_(0), stop_(false) {
+  if (numThreads <= 0) {
+    ILOG("ThreadPoolExecutor: Bad number of threads %i", numThreads);
+    numThreads = 1;
+  }
+  if (maxQueued <= 0) {
+    ILOG("ThreadPoolExecutor: Bad queue size %i", maxQueued);
+    maxQueued = 1;
+  }
+  queue_.resize(maxQueued);
+  stats_.queueDepth = 0;
+  ClearStats();
+  for (int i = 0; i < numThreads; i++) {
+    threads_.push_back(new std::thread(std::bind(&ThreadPoolExecutor::WorkerFunc, this)));
+  }
+}
+
+ThreadPoolExecutor::~ThreadPoolExecutor() {
+  mutex_.lock();
+  stop_ = true;
+  notEmpty_.notify_all();
+  notFull_.notify_all();
+  mutex_.unlock();
+  for (size_t i = 0; i < threads_.size(); i++) {
+    threads_[i]->join();
+    delete threads_[i];
+  }
+}
+
+bool ThreadPoolExecutor::Run(std::function<void()> func) {
+  mutex_.lock();
+  stats_.submitted++;
+  if (count_ == queue_.size() && !stop_) {
+    switch (backpressure_) {
+    case BLOCK:
+      while (count_ == queue_.size() && !stop_) {
+        notFull_.wait(mutex_);
+      }
+      break;
+    case REJECT:
+      stats_.rejected++;
+      mutex_.unlock();
+      return false;
+    case CALLER_RUNS:
+      stats_.callerRuns++;
+      mutex_.unlock();
+      func();
+      return true;
+    }
+  }
+  if (stop_) {
+    // Shutting down, nobody would pick it up.
+    stats_.rejected++;
+    mutex_.unlock();
+    return false;
+  }
+  Enqueue(func);
+  mutex_.unlock();
+  return true;
+}
+
+bool ThreadPoolExecutor::TryRun(std::function<void()> func) {
+  mutex_.lock();
+  stats_.submitted++;
+  if (count_ == queue_.size() || stop_) {
+    stats_.rejected++;
+    mutex_.unlock();
+    return false;
+  }
+  Enqueue(func);
+  mutex_.unlock();
+  return true;
+}
+
+void ThreadPoolExecutor::Enqueue(std::function<void()> func) {
+  Task &task = queue_[(head_ + count_) % queue_.size()];
+  task.func = func;
+  task.queuedAt = real_time_now();
+  count_++;
+  stats_.queueDepth = (int)count_;
+  if (stats_.queueDepth > stats_.maxQueueDepth)
+    stats_.maxQueueDepth = stats_.queueDepth;
+  notEmpty_.notify_one();
+}
+
+void ThreadPoolExecutor::WorkerFunc() {
+  setCurrentThreadName("ExecutorWorker");
+  mutex_.lock();
+  while (true) {
+    while (count_ == 0 && !stop_) {
+      notEmpty_.wait(mutex_);
+    }
+    if (count_ == 0) {
+      // Stopped, and everything has been run.
+      break;
+    }
+
+    std::function<void()> func;
+    func.swap(queue_[head_].func);
+    double start = real_time_now();
+    double queueTime = start - queue_[head_].queuedAt;
+    head_ = (head_ + 1) % queue_.size();
+    count_--;
+    stats_.queueDepth = (int)count_;
+    stats_.totalQueueTime += queueTime;
+    if (queueTime > stats_.maxQueueTime)
+      stats_.maxQueueTime = queueTime;
+    notFull_.notify_one();
+    mutex_.unlock();
+
+    func();
+
+    double runTime = real_time_now() - start;
+    mutex_.lock();
+    stats_.completed++;
+    stats_.totalRunTime += runTime;
+    if (runTime > stats_.maxRunTime)
+      stats_.maxRunTime = runTime;
+  }
+  mutex_.unlock();
+}
+
+void ThreadPoolExecutor::GetStats(Stats *stats) {
+  lock_guard guard(mutex_);
+  *stats = stats_;
+}
+
+void ThreadPoolExecutor::ResetStats() {
+  lock_guard guard(mutex_);
+  ClearStats();
+}
+
+void ThreadPoolExecutor::ClearStats() {
+  int depth = stats_.queueDepth;
+  memset(&stats_, 0, sizeof(stats_));
+  stats_.queueDepth = depth;
+  stats_.maxQueueDepth = depth;
 }
 
 }  // namespace threading
@@ -1,18 +1,106 @@
 #pragma once
 
+#include <vector>
+
+#include "base/basictypes.h"
 #include "base/functional.h"
+#include "base/mutex.h"
+#include "thread/thread.h"
 
 namespace threading {
 
 // Stuff that can execute other stuff, like threadpools, should inherit from this.
 class Executor {
  public:
-  virtual void Run(std::function<void()> func) = 0;
+  virtual ~Executor() {}
+  // Returns false if func was dropped and will never run.
+  virtual bool Run(std::function<void()> func) = 0;
+  // Like Run, but never waits for room, for callers that can't block. Returns false if func
+  // wasn't taken, and then it's up to the caller what to do with it.
+  virtual bool TryRun(std::function<void()> func) { return Run(func); }
 };
 
 class SameThreadExecutor : public Executor {
  public:
-  virtual void Run(std::function<void()> func);
+  virtual bool Run(std::function<void()> func);
+};
+
+// Queues everything until the owning thread calls RunPending, for example once per frame.
+// This is how to get work onto the main or render thread.
+class QueuedExecutor : public Executor {
+ public:
+  virtual bool Run(std::function<void()> func);
+  // Runs everything queued so far, including things queued by the functions themselves.
+  // Returns how many functions were run.
+  int RunPending();
+
+ private:
+  recursive_mutex mutex_;
+  std::vector<std::function<void()>> queue_;
+};
+
+// A fixed set of threads running tasks from a bounded queue.
+class ThreadPoolExecutor : public Executor {
+ public:
+  // What Run does when the queue is full.
+  enum Backpressure {
+    BLOCK,        // Wait for a free slot.
+    REJECT,       // Drop the task (counted in Stats::rejected).
+    CALLER_RUNS,  // Run the task on the calling thread.
+  };
+
+  ThreadPoolExecutor(int numThreads, int maxQueued, Backpressure backpressure = BLOCK);
+  // Runs whatever is still queued, then joins the threads.
+  virtual ~ThreadPoolExecutor();
+
+  virtual bool Run(std::function<void()> func);
+  // Full queue or not, never blocks or runs func on the calling thread. A task not taken
+  // counts as rejected.
+  virtual bool TryRun(std::function<void()> func);
+
+  struct Stats {
+    int queueDepth;
+    int maxQueueDepth;
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t rejected;
+    uint64_t callerRuns;
+    // In seconds. Queue time is from Run until a thread picks the task up.
+    double totalQueueTime;
+    double maxQueueTime;
+    double totalRunTime;
+    double maxRunTime;
+  };
+  void GetStats(Stats *stats);
+  // Clears the counters and maximums, but not the current queue depth.
+  void ResetStats();
+
+ private:
+  struct Task {
+    std::function<void()> func;
+    double queuedAt;
+  };
+
+  void WorkerFunc();
+  void ClearStats();
+  // Lock must be held, and the queue not full.
+  void Enqueue(std::function<void()> func);
+
+  std::vector<std::thread *> threads_;
+  Backpressure backpressure_;
+
+  recursive_mutex mutex_;
+  condition_variable notEmpty_;
+  condition_variable notFull_;
+  // Fixed-size ring.
+  std::vector<Task> queue_;
+  size_t head_;
+  size_t count_;
+  bool stop_;
+
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadPoolExecutor);
 };
 
 }  // namespace threading
@@ -0,0 +1,245 @@
+#pragma once
+
+// Lightweight futures and continuations on top of threading::Executor, for chaining up jobs
+// like "read file -> decode -> upload texture" without a hand written workqueue item per step.
+//
+//   Future<Buffer *> data = Async(&pool, std::bind(&ReadFile, path));
+//   Future<Image *> image = data.Then(&pool, &DecodePNG);
+//   image.Then(&mainThread, std::bind(&CreateTexture, thin3d, placeholder::_1));
+//
+// Continuations are submitted to their executor as soon as their input is ready. To get one onto
+// the main or render thread, pass a QueuedExecutor that the thread drains with RunPending().
+// Tasks that return void produce a Future<Unit>.
+//
+// Values are copied into each continuation, so prefer small types (pointers, shared_ptrs).
+// T must be default constructible.
+//
+// If an executor drops a task (a full ThreadPoolExecutor set to REJECT, or one shutting down),
+// its future fails instead: it becomes ready with Failed() true and a default constructed value.
+// Continuations of a failed future don't run, they fail too, and so does a WhenAll that has one.
+
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/functional.h"
+#include "base/mutex.h"
+#include "thread/executor.h"
+
+namespace threading {
+
+struct Unit {};
+
+namespace detail {
+
+template <typename T>
+class SharedState {
+ public:
+  SharedState() : ready_(false), failed_(false) {}
+
+  void Set(const T &value) {
+    Complete(value, false);
+  }
+
+  void Fail() {
+    Complete(T(), true);
+  }
+
+  bool Ready() {
+    lock_guard guard(mutex_);
+    return ready_;
+  }
+
+  bool Failed() {
+    lock_guard guard(mutex_);
+    return failed_;
+  }
+
+  const T &Wait() {
+    lock_guard guard(mutex_);
+    while (!ready_) {
+      cond_.wait(mutex_);
+    }
+    return value_;
+  }
+
+  // Runs callback right away if the value is already set, otherwise on the thread that sets it.
+  void OnReady(const std::function<void()> &callback) {
+    mutex_.lock();
+    if (!ready_) {
+      callbacks_.push_back(callback);
+      mutex_.unlock();
+      return;
+    }
+    mutex_.unlock();
+    callback();
+  }
+
+ private:
+  void Complete(const T &value, bool failed) {
+    std::vector<std::function<void()>> callbacks;
+    mutex_.lock();
+    value_ = value;
+    ready_ = true;
+    failed_ = failed;
+    callbacks.swap(callbacks_);
+    cond_.notify_all();
+    mutex_.unlock();
+    for (size_t i = 0; i < callbacks.size(); i++) {
+      callbacks[i]();
+    }
+  }
+
+  recursive_mutex mutex_;
+  condition_variable cond_;
+  bool ready_;
+  bool failed_;
+  T value_;
+  std::vector<std::function<void()>> callbacks_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedState);
+};
+
+// Maps void results to Unit so that everything can flow through a SharedState.
+template <typename R>
+struct Invoke {
+  typedef R Type;
+  template <typename F>
+  static R Call(F &func) { return func(); }
+  template <typename F, typename A>
+  static R Call(F &func, const A &arg) { return func(arg); }
+};
+
+template <>
+struct Invoke<void> {
+  typedef Unit Type;
+  template <typename F>
+  static Unit Call(F &func) { func(); return Unit(); }
+  template <typename F, typename A>
+  static Unit Call(F &func, const A &arg) { func(arg); return Unit(); }
+};
+
+// These take std::function rather than the functor type, so that std::bind expressions passed
+// in by the user don't get treated as nested binds.
+template <typename R>
+void RunAsync(std::shared_ptr<SharedState<typename Invoke<R>::Type>> out, std::function<R()> func) {
+  out->Set(Invoke<R>::Call(func));
+}
+
+template <typename T, typename R>
+void RunContinuation(std::shared_ptr<SharedState<T>> in, std::shared_ptr<SharedState<typename Invoke<R>::Type>> out, std::function<R(const T &)> func) {
+  out->Set(Invoke<R>::Call(func, in->Wait()));
+}
+
+// Once in is ready. A failed input, or a continuation the executor drops, fails out.
+template <typename T, typename R>
+void SubmitContinuation(Executor *executor, std::shared_ptr<SharedState<T>> in, std::shared_ptr<SharedState<typename Invoke<R>::Type>> out, std::function<R(const T &)> func) {
+  if (in->Failed() || !executor->Run(std::bind(&RunContinuation<T, R>, in, out, func))) {
+    out->Fail();
+  }
+}
+
+template <typename T>
+struct Join {
+  recursive_mutex mutex;
+  size_t remaining;
+  bool failed;
+  std::vector<T> values;
+  std::shared_ptr<SharedState<std::vector<T>>> out;
+};
+
+template <typename T>
+void JoinOne(std::shared_ptr<Join<T>> join, size_t index, std::shared_ptr<SharedState<T>> in) {
+  join->mutex.lock();
+  join->values[index] = in->Wait();
+  if (in->Failed())
+    join->failed = true;
+  bool last = --join->remaining == 0;
+  join->mutex.unlock();
+  if (last) {
+    if (join->failed)
+      join->out->Fail();
+    else
+      join->out->Set(join->values);
+  }
+}
+
+}  // namespace detail
+
+template <typename T>
+class Future {
+ public:
+  Future() {}
+  explicit Future(std::shared_ptr<detail::SharedState<T>> state) : state_(state) {}
+
+  bool Valid() const { return state_ != nullptr; }
+  bool Ready() const { return state_->Ready(); }
+  // Ready, but without a value, see the top of the file.
+  bool Failed() const { return state_->Failed(); }
+  // Blocks until the value is available. Don't call this on a thread that's needed to produce it,
+  // like waiting on the main thread for a continuation pinned to the main thread.
+  const T &Get() const { return state_->Wait(); }
+
+  // Runs func(value) on executor once this future is ready.
+  template <typename F>
+  Future<typename detail::Invoke<typename std::result_of<F(const T &)>::type>::Type> Then(Executor *executor, F func) const {
+    typedef typename std::result_of<F(const T &)>::type R;
+    typedef typename detail::Invoke<R>::Type Result;
+    std::shared_ptr<detail::SharedState<Result>> next(new detail::SharedState<Result>());
+    std::function<R(const T &)> f(func);
+    state_->OnReady(std::bind(&detail::SubmitContinuation<T, R>, executor, state_, next, f));
+    return Future<Result>(next);
+  }
+
+  std::shared_ptr<detail::SharedState<T>> state() const { return state_; }
+
+ private:
+  std::shared_ptr<detail::SharedState<T>> state_;
+};
+
+// For values produced by something that isn't a task, like a callback from another system.
+template <typename T>
+class Promise {
+ public:
+  Promise() : state_(new detail::SharedState<T>()) {}
+
+  void Set(const T &value) { state_->Set(value); }
+  void Fail() { state_->Fail(); }
+  Future<T> GetFuture() const { return Future<T>(state_); }
+
+ private:
+  std::shared_ptr<detail::SharedState<T>> state_;
+};
+
+// Runs func() on executor.
+template <typename F>
+Future<typename detail::Invoke<typename std::result_of<F()>::type>::Type> Async(Executor *executor, F func) {
+  typedef typename std::result_of<F()>::type R;
+  typedef typename detail::Invoke<R>::Type Result;
+  std::shared_ptr<detail::SharedState<Result>> state(new detail::SharedState<Result>());
+  std::function<R()> f(func);
+  if (!executor->Run(std::bind(&detail::RunAsync<R>, state, f))) {
+    state->Fail();
+  }
+  return Future<Result>(state);
+}
+
+// Ready when all the futures are, with their values in the same order. Fails if any of them did.
+template <typename T>
+Future<std::vector<T>> WhenAll(const std::vector<Future<T>> &futures) {
+  std::shared_ptr<detail::Join<T>> join(new detail::Join<T>());
+  join->remaining = futures.size();
+  join->failed = false;
+  join->values.resize(futures.size());
+  join->out.reset(new detail::SharedState<std::vector<T>>());
+  Future<std::vector<T>> result(join->out);
+  if (futures.empty()) {
+    join->out->Set(join->values);
+    return result;
+  }
+  for (size_t i = 0; i < futures.size(); i++) {
+    futures[i].state()->OnReady(std::bind(&detail::JoinOne<T>, join, i, futures[i].state()));
+  }
+  return result;
+}
+
+}  // namespace threading
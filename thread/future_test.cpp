@@ -0,0 +1,118 @@
+// Futures: Async and Then across executors, WhenAll, and what happens when an executor drops
+// a task.
+
+#include <string.h>
+#include <atomic>
+#include <vector>
+
+#include "base/testutil.h"
+#include "base/timeutil.h"
+#include "thread/executor.h"
+#include "thread/future.h"
+#include "thread/threadutil.h"
+
+using namespace threading;
+
+static int Square(int x) {
+	return x * x;
+}
+
+static int Seven() {
+	return 7;
+}
+
+static std::atomic<int> ran(0);
+
+static void CountRun() {
+	ran++;
+}
+
+static int CountRunAndDouble(int x) {
+	ran++;
+	return x * 2;
+}
+
+static int ReturnAfter(int value, int ms) {
+	sleep_ms(ms);
+	return value;
+}
+
+// Takes up a thread of the pool until gate is set.
+static int Block(Promise<int> started, Future<int> gate) {
+	started.Set(1);
+	return gate.Get();
+}
+
+static const char *threadName;
+
+static int RecordThread(int x) {
+	threadName = GetCurrentThreadName();
+	return x + 1;
+}
+
+int main() {
+	setCurrentThreadName("FutureTestMain");
+	ThreadPoolExecutor pool(4, 64);
+
+	Future<int> squared = Async(&pool, &Seven).Then(&pool, &Square);
+	Check("Async then Then", squared.Get() == 49 && squared.Ready() && !squared.Failed());
+
+	ran = 0;
+	Future<Unit> done = Async(&pool, &CountRun);
+	done.Get();
+	Check("void gives Unit", ran == 1);
+
+	// Finishing in reverse order doesn't change the order of the values.
+	std::vector<Future<int>> parts;
+	for (int i = 0; i < 10; i++)
+		parts.push_back(Async(&pool, std::bind(&ReturnAfter, i, 50 - i * 5)));
+	std::vector<int> values = WhenAll(parts).Get();
+	bool inOrder = values.size() == 10;
+	for (size_t i = 0; i < values.size(); i++)
+		inOrder = inOrder && values[i] == (int)i;
+	Check("WhenAll", inOrder);
+	Check("WhenAll of nothing", WhenAll(std::vector<Future<int>>()).Ready());
+
+	// A continuation pinned to a QueuedExecutor waits for RunPending, and runs on its thread.
+	QueuedExecutor mainThread;
+	threadName = nullptr;
+	Future<int> onMain = Async(&pool, &Seven).Then(&mainThread, &RecordThread);
+	double start = real_time_now();
+	while (!onMain.Ready() && real_time_now() - start < 5.0) {
+		mainThread.RunPending();
+		sleep_ms(1);
+	}
+	Check("QueuedExecutor", onMain.Get() == 8 && threadName && !strcmp(threadName, "FutureTestMain"));
+
+	// One thread, room for one more task, and no waiting for room.
+	{
+		ThreadPoolExecutor rejecting(1, 1, ThreadPoolExecutor::REJECT);
+		Promise<int> started, gate;
+		Future<int> blocker = Async(&rejecting, std::bind(&Block, started, gate.GetFuture()));
+		started.GetFuture().Get();
+		Future<int> queued = Async(&rejecting, &Seven);
+
+		Future<int> dropped = Async(&rejecting, &Seven);
+		Check("dropped task fails", dropped.Ready() && dropped.Failed());
+
+		ran = 0;
+		Future<int> droppedThen = Async(&pool, &Seven).Then(&rejecting, &CountRunAndDouble);
+		droppedThen.Get();
+		Check("dropped continuation fails", droppedThen.Failed() && ran == 0);
+
+		Future<int> afterFailed = dropped.Then(&pool, &CountRunAndDouble);
+		afterFailed.Get();
+		Check("continuation of a failed future fails", afterFailed.Failed() && ran == 0);
+
+		std::vector<Future<int>> some;
+		some.push_back(queued);
+		some.push_back(dropped);
+		Future<std::vector<int>> all = WhenAll(some);
+		Check("WhenAll waits for the rest", !all.Ready());
+		gate.Set(3);
+		all.Get();
+		Check("WhenAll with a failed one fails", all.Failed() && queued.Get() == 7 && blocker.Get() == 3);
+	}
+
+	return TestResult();
+}
@@ -1,8 +1,20 @@
+#include <algorithm>
+#include <map>
+
 #include "base/functional.h"
 #include "base/logging.h"
 #include "base/timeutil.h"
 #include "thread/thread.h"
 #include "thread/prioritizedworkqueue.h"
+#include "thread/threadutil.h"
+
+// Re-evaluate all priorities every this many pops.
+// An epoch costs one priority() call per item, so it's scaled with the queue size, which keeps
+// it at EPOCH_FRACTION calls per pop on average however slowly the consumer pops.
+#define MIN_EPOCH_POPS 16
+#define EPOCH_FRACTION 8
+// When the top turns out to be stale, this is how many times we retry before taking it anyway.
+#define MAX_REVALIDATE 4
 
 PrioritizedWorkQueue::~PrioritizedWorkQueue() {
 	if (!done_) {
@@ -11,15 +23,27 @@ PrioritizedWorkQueue::~PrioritizedWorkQueue() {
 }
 
 void PrioritizedWorkQueue::Add(PrioritizedWorkQueueItem *item) {
+	// Ask outside the lock, no need to make the consumer wait for it.
+	Entry entry = { item->priority(), item };
 	lock_guard guard(mutex_);
-	queue_.push_back(item);
+	queue_.push_back(entry);
+	std::push_heap(queue_.begin(), queue_.end());
 	notEmpty_.notify_one();
 }
 
 void PrioritizedWorkQueue::Stop() {
 	lock_guard guard(mutex_);
 	done_ = true;
-	notEmpty_.notify_one();
+	notEmpty_.notify_all();
+}
+
+void PrioritizedWorkQueue::Drain() {
+	lock_guard guard(mutex_);
+	draining_ = true;
+	if (queue_.empty()) {
+		done_ = true;
+	}
+	notEmpty_.notify_all();
 }
 
 void PrioritizedWorkQueue::Flush() {
@@ -27,11 +51,18 @@ void PrioritizedWorkQueue::Flush() {
 		return;
 	lock_guard guard(mutex_);
 	for (auto iter = queue_.begin(); iter != queue_.end(); ++iter) {
-		delete *iter;
+		delete iter->item;
 	}
 	queue_.clear();
 }
 
+void PrioritizedWorkQueue::Refresh() {
+	for (auto iter = queue_.begin(); iter != queue_.end(); ++iter) {
+		iter->priority = iter->item->priority();
+	}
+	std::make_heap(queue_.begin(), queue_.end());
+	popsSinceRefresh_ = 0;
+}
 
 // The worker should simply call this in a loop. Will block when appropriate.
 PrioritizedWorkQueueItem *PrioritizedWorkQueue::Pop() {
@@ -41,37 +72,42 @@ PrioritizedWorkQueueItem *PrioritizedWorkQueue::Pop() {
 	}
 
 	while (queue_.empty()) {
+		if (draining_) {
+			done_ = true;
+			return 0;
+		}
 		notEmpty_.wait(mutex_);
 		if (done_) {
 			return 0;
 		}
 	}
 
-	// Find the top priority item (lowest value).
-	float best_prio = std::numeric_limits<float>::infinity();
-	std::vector<PrioritizedWorkQueueItem *>::iterator best = queue_.end();
-	for (auto iter = queue_.begin(); iter != queue_.end(); ++iter) {
-		if ((*iter)->priority() < best_prio) {
-			best = iter;
-			best_prio = (*iter)->priority();
-		}
+	int epochPops = std::max(MIN_EPOCH_POPS, (int)queue_.size() / EPOCH_FRACTION);
+	if (popsSinceRefresh_ >= epochPops) {
+		Refresh();
 	}
+	popsSinceRefresh_++;
 
-	if (best != queue_.end()) {
-		PrioritizedWorkQueueItem *poppedItem = *best;
-		queue_.erase(best);
-		return poppedItem;
-	} else {
-		// Not really sure how this can happen, but let's be safe.
-		return 0;
+	// The top may have become less urgent since we last looked. If so, put it back where it
+	// belongs and try the next one.
+	std::pop_heap(queue_.begin(), queue_.end());
+	for (int tries = 0; tries < MAX_REVALIDATE && queue_.size() > 1; ++tries) {
+		Entry &top = queue_.back();
+		top.priority = top.item->priority();
+		if (top.priority <= queue_.front().priority) {
+			break;
+		}
+		std::push_heap(queue_.begin(), queue_.end());
+		std::pop_heap(queue_.begin(), queue_.end());
 	}
-}
 
-// TODO: This feels ugly. Revisit later.
-
-static std::thread *workThread;
+	PrioritizedWorkQueueItem *poppedItem = queue_.back().item;
+	queue_.pop_back();
+	return poppedItem;
+}
 
 static void threadfunc(PrioritizedWorkQueue *wq) {
+	setCurrentThreadName("WorkQueueConsumer");
 	while (true) {
 		PrioritizedWorkQueueItem *item = wq->Pop();
 		if (!item) {
@@ -84,13 +120,62 @@ static void threadfunc(PrioritizedWorkQueue *wq) {
 	}
 }
 
+WorkQueueConsumerGroup::WorkQueueConsumerGroup(PrioritizedWorkQueue *wq, int numThreads) : wq_(wq) {
+	if (numThreads <= 0) {
+		ILOG("WorkQueueConsumerGroup: Bad number of threads %i", numThreads);
+		numThreads = 1;
+	}
+	for (int i = 0; i < numThreads; ++i) {
+		threads_.push_back(new std::thread(std::bind(&threadfunc, wq)));
+	}
+}
+
+WorkQueueConsumerGroup::~WorkQueueConsumerGroup() {
+	if (!threads_.empty()) {
+		Stop();
+	}
+}
+
+void WorkQueueConsumerGroup::Drain() {
+	wq_->Drain();
+	Join();
+}
+
+void WorkQueueConsumerGroup::Stop() {
+	wq_->Stop();
+	Join();
+}
+
+void WorkQueueConsumerGroup::Join() {
+	for (size_t i = 0; i < threads_.size(); ++i) {
+		threads_[i]->join();
+		delete threads_[i];
+	}
+	threads_.clear();
+}
+
+static recursive_mutex consumersMutex;
+static std::map<PrioritizedWorkQueue *, WorkQueueConsumerGroup *> consumers;
+
 void ProcessWorkQueueOnThreadWhile(PrioritizedWorkQueue *wq) {
-	workThread = new std::thread(std::bind(&threadfunc, wq));
+	lock_guard guard(consumersMutex);
+	if (consumers.find(wq) != consumers.end()) {
+		ELOG("Workqueue already has a thread processing it");
+		return;
+	}
+	consumers[wq] = new WorkQueueConsumerGroup(wq, 1);
 }
 
 void StopProcessingWorkQueue(PrioritizedWorkQueue *wq) {
-	wq->Stop();
-	workThread->join();
-	delete workThread;
-	workThread = 0;
+	WorkQueueConsumerGroup *group;
+	{
+		lock_guard guard(consumersMutex);
+		auto iter = consumers.find(wq);
+		if (iter == consumers.end())
+			return;
+		group = iter->second;
+		consumers.erase(iter);
+	}
+	group->Stop();
+	delete group;
 }
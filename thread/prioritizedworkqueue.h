@@ -5,10 +5,14 @@
 
 #include "base/basictypes.h"
 #include "base/mutex.h"
+#include "thread/thread.h"
 #include "thread/threadutil.h"
 
 // Priorities can change dynamically.
 // Try to make priority() fast, it will be called a lot.
+// The queue keeps a heap of cached priorities. The top is re-checked on every Pop, and the whole
+// heap is re-evaluated in epochs (every so many pops, more for bigger queues), so items that
+// become more urgent are noticed within one epoch rather than immediately.
 
 class PrioritizedWorkQueueItem {
 public:
@@ -23,7 +27,7 @@ private:
 
 class PrioritizedWorkQueue {
 public:
-	PrioritizedWorkQueue() : done_(false) {}
+	PrioritizedWorkQueue() : done_(false), draining_(false), mutex_("PrioritizedWorkQueue"), popsSinceRefresh_(0) {}
 	~PrioritizedWorkQueue();
 	// Takes ownership.
 	void Add(PrioritizedWorkQueueItem *item);
@@ -33,20 +37,61 @@ public:
 
 	void Flush();
 	bool Done() { return done_; }
+	// Pop returns 0 right away from now on. Whatever is still queued stays there until Flush.
 	void Stop();
+	// Pop keeps handing out what's queued, and starts returning 0 once the queue runs empty.
+	void Drain();
 
 private:
+	struct Entry {
+		float priority;
+		PrioritizedWorkQueueItem *item;
+
+		// std heaps are max-heaps, and low priority value = high priority.
+		bool operator <(const Entry &other) const {
+			return priority > other.priority;
+		}
+	};
+
+	void Refresh();
+
 	bool done_;
+	bool draining_;
 	recursive_mutex mutex_;
 	condition_variable notEmpty_;
 
-	std::vector<PrioritizedWorkQueueItem *> queue_;
+	// Min-heap on the cached priority.
+	std::vector<Entry> queue_;
+	int popsSinceRefresh_;
 
 	DISALLOW_COPY_AND_ASSIGN(PrioritizedWorkQueue);
 };
 
 
+// A set of threads that all keep running items from the same workqueue.
+class WorkQueueConsumerGroup {
+public:
+	WorkQueueConsumerGroup(PrioritizedWorkQueue *wq, int numThreads);
+	// Stops (not drains) the workqueue if that hasn't been done already.
+	~WorkQueueConsumerGroup();
+
+	// Lets the workers finish everything that's queued, then waits for them to exit.
+	void Drain();
+	// Waits only for the items currently running. The rest stay queued until PrioritizedWorkQueue::Flush.
+	void Stop();
+
+	int NumThreads() const { return (int)threads_.size(); }
+
+private:
+	void Join();
+
+	PrioritizedWorkQueue *wq_;
+	std::vector<std::thread *> threads_;
+
+	DISALLOW_COPY_AND_ASSIGN(WorkQueueConsumerGroup);
+};
+
 // Starts up a thread that keeps trying to run this workqueue.
-// TODO: This feels ugly. Revisit later.
+// Each workqueue can have its own. Use WorkQueueConsumerGroup for more threads per queue.
 void ProcessWorkQueueOnThreadWhile(PrioritizedWorkQueue *wq);
 void StopProcessingWorkQueue(PrioritizedWorkQueue *wq);
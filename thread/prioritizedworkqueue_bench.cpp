@@ -0,0 +1,110 @@
+// Measures PrioritizedWorkQueue::Pop latency against the old linear scan, at a few queue sizes.
+// Only the first MAX_POPS pops are timed, the linear scan would take forever to drain 100k items.
+// Then the heap again with a slow consumer, which sleeps between pops, to show that how often
+// Pop re-evaluates everything doesn't depend on how slowly it's called.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits>
+#include <vector>
+
+#include "base/timeutil.h"
+#include "thread/prioritizedworkqueue.h"
+
+#define MAX_POPS 1000
+#define SLOW_POPS 200
+#define SLOW_DELAY_MS 5
+
+class BenchItem : public PrioritizedWorkQueueItem {
+public:
+	BenchItem(float prio) : prio_(prio) {}
+	virtual void run() {}
+	virtual float priority() { return prio_; }
+
+private:
+	float prio_;
+};
+
+// What PrioritizedWorkQueue::Pop used to do.
+static PrioritizedWorkQueueItem *LinearPop(std::vector<PrioritizedWorkQueueItem *> &queue) {
+	float best_prio = std::numeric_limits<float>::infinity();
+	std::vector<PrioritizedWorkQueueItem *>::iterator best = queue.end();
+	for (auto iter = queue.begin(); iter != queue.end(); ++iter) {
+		if ((*iter)->priority() < best_prio) {
+			best = iter;
+			best_prio = (*iter)->priority();
+		}
+	}
+	PrioritizedWorkQueueItem *item = *best;
+	queue.erase(best);
+	return item;
+}
+
+static void Fill(std::vector<PrioritizedWorkQueueItem *> &items, int count) {
+	srand(1337);
+	for (int i = 0; i < count; i++) {
+		items.push_back(new BenchItem((float)rand() / (float)RAND_MAX));
+	}
+}
+
+// Only the Pop calls are timed, not the sleeps.
+static double BenchHeap(int count, int pops, int delayMs) {
+	std::vector<PrioritizedWorkQueueItem *> items;
+	Fill(items, count);
+	PrioritizedWorkQueue wq;
+	for (size_t i = 0; i < items.size(); i++) {
+		wq.Add(items[i]);
+	}
+
+	double elapsed = 0.0;
+	for (int i = 0; i < pops; i++) {
+		if (delayMs > 0)
+			sleep_ms(delayMs);
+		double start = real_time_now();
+		PrioritizedWorkQueueItem *item = wq.Pop();
+		elapsed += real_time_now() - start;
+		delete item;
+	}
+
+	wq.Flush();
+	wq.Stop();
+	return elapsed / pops;
+}
+
+static double BenchLinear(int count, int pops) {
+	std::vector<PrioritizedWorkQueueItem *> items;
+	Fill(items, count);
+
+	double start = real_time_now();
+	for (int i = 0; i < pops; i++) {
+		delete LinearPop(items);
+	}
+	double elapsed = real_time_now() - start;
+
+	for (size_t i = 0; i < items.size(); i++) {
+		delete items[i];
+	}
+	return elapsed / pops;
+}
+
+int main() {
+	const int sizes[] = { 10, 1000, 100000 };
+	printf("%10s %16s %16s\n", "items", "heap (us/pop)", "linear (us/pop)");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int count = sizes[i];
+		int pops = count < MAX_POPS ? count : MAX_POPS;
+		double heap = BenchHeap(count, pops, 0);
+		double linear = BenchLinear(count, pops);
+		printf("%10d %16.3f %16.3f\n", count, heap * 1000000.0, linear * 1000000.0);
+	}
+
+	printf("\n%10s %16s %16s\n", "items", "heap (us/pop)", "slow (us/pop)");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int count = sizes[i];
+		int pops = count < SLOW_POPS ? count : SLOW_POPS;
+		double heap = BenchHeap(count, pops, 0);
+		double slow = BenchHeap(count, pops, SLOW_DELAY_MS);
+		printf("%10d %16.3f %16.3f\n", count, heap * 1000000.0, slow * 1000000.0);
+	}
+	return 0;
+}
@@ -0,0 +1,269 @@
+#pragma once
+
+// Bounded lock-free queues for handing work between threads.
+//
+// MPMCRingQueue: any number of producers and consumers. Each slot carries a sequence number
+// that tells producers and consumers whose turn it is, so the only shared write is a single
+// compare-and-swap on the head or tail index.
+// SPSCRingQueue: exactly one producer thread and one consumer thread, no CAS at all.
+// BlockingRingQueue: wraps either of them and parks the calling thread when the queue is
+// empty (or full), but only then - the fast path never touches a mutex.
+//
+// Capacity is rounded up to a power of two. T must be default constructible and copyable.
+
+#include <atomic>
+#include <vector>
+
+#include "base/basictypes.h"
+#include "base/mutex.h"
+
+namespace threading {
+
+// Keeps the indices written by producers and consumers on separate cache lines.
+#define RINGQUEUE_CACHE_LINE 64
+
+inline size_t RoundUpToPowerOf2(size_t value) {
+	size_t p = 1;
+	while (p < value)
+		p <<= 1;
+	return p;
+}
+
+template <typename T>
+class MPMCRingQueue {
+public:
+	MPMCRingQueue(size_t capacity) : cells_(RoundUpToPowerOf2(capacity < 2 ? 2 : capacity)), head_(0), tail_(0) {
+		mask_ = cells_.size() - 1;
+		for (size_t i = 0; i < cells_.size(); i++) {
+			cells_[i].sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	bool TryPush(const T &value) {
+		size_t pos = tail_.load(std::memory_order_relaxed);
+		while (true) {
+			Cell &cell = cells_[pos & mask_];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				// The slot is free for this position, try to claim it.
+				if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.value = value;
+					cell.sequence.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				// The consumer of the previous lap hasn't freed it yet: full.
+				return false;
+			} else {
+				pos = tail_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool TryPop(T *value) {
+		size_t pos = head_.load(std::memory_order_relaxed);
+		while (true) {
+			Cell &cell = cells_[pos & mask_];
+			size_t seq = cell.sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					*value = cell.value;
+					// Drop our reference to the value before handing the slot back.
+					cell.value = T();
+					cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				// Nothing has been published at this position yet: empty.
+				return false;
+			} else {
+				pos = head_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Only a hint when other threads are active.
+	size_t SizeApprox() const {
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		size_t head = head_.load(std::memory_order_relaxed);
+		return tail >= head ? tail - head : 0;
+	}
+	size_t capacity() const { return cells_.size(); }
+
+private:
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T value;
+
+		Cell() {}
+		// Only for the vector's benefit, cells are never copied after construction.
+		Cell(const Cell &other) : sequence(other.sequence.load()), value(other.value) {}
+	};
+
+	std::vector<Cell> cells_;
+	size_t mask_;
+	char pad0_[RINGQUEUE_CACHE_LINE];
+	std::atomic<size_t> head_;
+	char pad1_[RINGQUEUE_CACHE_LINE];
+	std::atomic<size_t> tail_;
+	char pad2_[RINGQUEUE_CACHE_LINE];
+
+	DISALLOW_COPY_AND_ASSIGN(MPMCRingQueue);
+};
+
+template <typename T>
+class SPSCRingQueue {
+public:
+	SPSCRingQueue(size_t capacity) : buffer_(RoundUpToPowerOf2(capacity < 2 ? 2 : capacity)), head_(0), tail_(0) {
+		mask_ = buffer_.size() - 1;
+	}
+
+	// Producer thread only.
+	bool TryPush(const T &value) {
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) == buffer_.size())
+			return false;
+		buffer_[tail & mask_] = value;
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer thread only.
+	bool TryPop(T *value) {
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire))
+			return false;
+		*value = buffer_[head & mask_];
+		buffer_[head & mask_] = T();
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	size_t SizeApprox() const {
+		return tail_.load(std::memory_order_relaxed) - head_.load(std::memory_order_relaxed);
+	}
+	size_t capacity() const { return buffer_.size(); }
+
+private:
+	std::vector<T> buffer_;
+	size_t mask_;
+	char pad0_[RINGQUEUE_CACHE_LINE];
+	std::atomic<size_t> head_;
+	char pad1_[RINGQUEUE_CACHE_LINE];
+	std::atomic<size_t> tail_;
+	char pad2_[RINGQUEUE_CACHE_LINE];
+
+	DISALLOW_COPY_AND_ASSIGN(SPSCRingQueue);
+};
+
+// Lets threads sleep until "something changed" without a lost wakeup, while keeping the
+// notify side down to an atomic increment and a load when nobody is waiting.
+//
+// Waiter:   key = PrepareWait(); if (condition) { CancelWait(); return; } Wait(key);
+// Notifier: make condition true; Notify();
+class EventCount {
+public:
+	EventCount() : epoch_(0), waiters_(0) {}
+
+	unsigned int PrepareWait() {
+		waiters_++;
+		return epoch_.load();
+	}
+
+	void CancelWait() {
+		waiters_--;
+	}
+
+	void Wait(unsigned int key) {
+		mutex_.lock();
+		while (epoch_.load() == key) {
+			cond_.wait(mutex_);
+		}
+		mutex_.unlock();
+		waiters_--;
+	}
+
+	void NotifyOne() {
+		epoch_++;
+		if (waiters_.load() > 0) {
+			lock_guard guard(mutex_);
+			cond_.notify_one();
+		}
+	}
+
+	void NotifyAll() {
+		epoch_++;
+		if (waiters_.load() > 0) {
+			lock_guard guard(mutex_);
+			cond_.notify_all();
+		}
+	}
+
+private:
+	std::atomic<unsigned int> epoch_;
+	std::atomic<int> waiters_;
+	recursive_mutex mutex_;
+	condition_variable cond_;
+
+	DISALLOW_COPY_AND_ASSIGN(EventCount);
+};
+
+// Queue is MPMCRingQueue<T> or SPSCRingQueue<T>. With the latter, the single producer /
+// single consumer rule of course still applies.
+template <typename T, typename Queue = MPMCRingQueue<T> >
+class BlockingRingQueue {
+public:
+	BlockingRingQueue(size_t capacity) : queue_(capacity) {}
+
+	bool TryPush(const T &value) {
+		if (!queue_.TryPush(value))
+			return false;
+		notEmpty_.NotifyOne();
+		return true;
+	}
+
+	bool TryPop(T *value) {
+		if (!queue_.TryPop(value))
+			return false;
+		notFull_.NotifyOne();
+		return true;
+	}
+
+	// Blocks while the queue is full.
+	void Push(const T &value) {
+		while (!TryPush(value)) {
+			unsigned int key = notFull_.PrepareWait();
+			if (TryPush(value)) {
+				notFull_.CancelWait();
+				return;
+			}
+			notFull_.Wait(key);
+		}
+	}
+
+	// Blocks while the queue is empty.
+	void Pop(T *value) {
+		while (!TryPop(value)) {
+			unsigned int key = notEmpty_.PrepareWait();
+			if (TryPop(value)) {
+				notEmpty_.CancelWait();
+				return;
+			}
+			notEmpty_.Wait(key);
+		}
+	}
+
+	size_t SizeApprox() const { return queue_.SizeApprox(); }
+	size_t capacity() const { return queue_.capacity(); }
+
+private:
+	Queue queue_;
+	EventCount notEmpty_;
+	EventCount notFull_;
+
+	DISALLOW_COPY_AND_ASSIGN(BlockingRingQueue);
+};
+
+}  // namespace threading
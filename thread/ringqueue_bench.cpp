@@ -0,0 +1,118 @@
+// Contention benchmark for the ring queues, against the recursive_mutex + condition_variable
+// queue that PrioritizedWorkQueue and friends use today.
+
+#include <stdio.h>
+#include <deque>
+#include <vector>
+
+#include "base/functional.h"
+#include "base/mutex.h"
+#include "base/timeutil.h"
+#include "thread/ringqueue.h"
+#include "thread/thread.h"
+
+using namespace threading;
+
+#define ITEMS_PER_PRODUCER 200000
+#define QUEUE_CAPACITY 1024
+
+class MutexQueue {
+public:
+	MutexQueue(size_t capacity) : capacity_(capacity) {}
+
+	void Push(int value) {
+		lock_guard guard(mutex_);
+		while (queue_.size() >= capacity_) {
+			notFull_.wait(mutex_);
+		}
+		queue_.push_back(value);
+		notEmpty_.notify_one();
+	}
+
+	void Pop(int *value) {
+		lock_guard guard(mutex_);
+		while (queue_.empty()) {
+			notEmpty_.wait(mutex_);
+		}
+		*value = queue_.front();
+		queue_.pop_front();
+		notFull_.notify_one();
+	}
+
+private:
+	size_t capacity_;
+	recursive_mutex mutex_;
+	condition_variable notEmpty_;
+	condition_variable notFull_;
+	std::deque<int> queue_;
+};
+
+template <typename Q>
+static void Produce(Q *queue, int count) {
+	for (int i = 1; i <= count; i++) {
+		queue->Push(i);
+	}
+}
+
+template <typename Q>
+static void Consume(Q *queue, int count, long long *sum) {
+	long long total = 0;
+	for (int i = 0; i < count; i++) {
+		int value;
+		queue->Pop(&value);
+		total += value;
+	}
+	*sum = total;
+}
+
+// Returns millions of items per second, or a negative number if items got lost or duplicated.
+template <typename Q>
+static double Bench(int producers, int consumers) {
+	Q queue(QUEUE_CAPACITY);
+	int total = producers * ITEMS_PER_PRODUCER;
+	std::vector<long long> sums(consumers);
+	std::vector<std::thread *> threads;
+
+	double start = real_time_now();
+	for (int i = 0; i < consumers; i++) {
+		// Spread the items so that every consumer gets an exact share.
+		int count = total / consumers + (i < total % consumers ? 1 : 0);
+		threads.push_back(new std::thread(std::bind(&Consume<Q>, &queue, count, &sums[i])));
+	}
+	for (int i = 0; i < producers; i++) {
+		threads.push_back(new std::thread(std::bind(&Produce<Q>, &queue, ITEMS_PER_PRODUCER)));
+	}
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+	double elapsed = real_time_now() - start;
+
+	long long sum = 0;
+	for (int i = 0; i < consumers; i++) {
+		sum += sums[i];
+	}
+	long long expected = (long long)producers * ITEMS_PER_PRODUCER * (ITEMS_PER_PRODUCER + 1) / 2;
+	if (sum != expected)
+		return -1.0;
+	return total / elapsed / 1000000.0;
+}
+
+int main() {
+	const int threadCounts[] = { 1, 2, 4, 8 };
+	printf("%-12s %14s %14s %14s\n", "prod/cons", "mutex (M/s)", "mpmc (M/s)", "spsc (M/s)");
+	for (size_t i = 0; i < sizeof(threadCounts) / sizeof(threadCounts[0]); i++) {
+		int n = threadCounts[i];
+		double mutex = Bench<MutexQueue>(n, n);
+		double mpmc = Bench<BlockingRingQueue<int> >(n, n);
+		char label[32];
+		snprintf(label, sizeof(label), "%d/%d", n, n);
+		if (n == 1) {
+			double spsc = Bench<BlockingRingQueue<int, SPSCRingQueue<int> > >(1, 1);
+			printf("%-12s %14.2f %14.2f %14.2f\n", label, mutex, mpmc, spsc);
+		} else {
+			printf("%-12s %14.2f %14.2f %14s\n", label, mutex, mpmc, "-");
+		}
+	}
+	return 0;
+}
@@ -1,4 +1,8 @@
+#include <algorithm>
+
+#include "base/basictypes.h"
 #include "base/logging.h"
+#include "thread/threadutil.h"
 #include "threadpool.h"
 
 ///////////////////////////// WorkerThread
@@ -74,48 +78,177 @@ void LoopWorkerThread::WorkFunc() {
 
 ///////////////////////////// ThreadPool
 
-ThreadPool::ThreadPool(int numThreads) : workersStarted(false) {
+// Lets nested ParallelLoop calls from a worker push onto that worker's own queue.
+static __THREAD ThreadPool *currentPool;
+static __THREAD int currentQueue;
+
+struct ThreadPool::Loop {
+	const std::function<void(int,int)> *func;
+	int grain;
+	// Iterations not yet executed. The loop is complete when this hits zero.
+	std::atomic<int> remaining;
+};
+
+ThreadPool::ThreadPool(int numThreads)
+	: queued_(0), sleepers_(0), stop_(false), sleepMutex_("ThreadPool::sleep"), startMutex_("ThreadPool::start"), workersStarted(false) {
 	if (numThreads <= 0) {
 		numThreads_ = 1;
 		ILOG("ThreadPool: Bad number of threads %i", numThreads);
-	} else if (numThreads > 8) {
-		ILOG("ThreadPool: Capping number of threads to 8 (was %i)", numThreads);
-		numThreads_ = 8;
 	} else {
 		numThreads_ = numThreads;
 	}
+	for (int i = 0; i < numThreads_; ++i) {
+		queues_.push_back(new TaskQueue());
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	stop_ = true;
+	sleepMutex_.lock();
+	wake_.notify_all();
+	sleepMutex_.unlock();
+	for (size_t i = 0; i < workers_.size(); ++i) {
+		workers_[i]->join();
+		delete workers_[i];
+	}
+	for (size_t i = 0; i < queues_.size(); ++i) {
+		delete queues_[i];
+	}
 }
 
 void ThreadPool::StartWorkers() {
+	lock_guard guard(startMutex_);
 	if (!workersStarted) {
-		for(int i = 0; i < numThreads_; ++i) {
-			workers.push_back(std::make_shared<LoopWorkerThread>());
+		// The thread calling ParallelLoop does its share of the work, so we need one less.
+		for (int i = 1; i < numThreads_; ++i) {
+			workers_.push_back(new std::thread(std::bind(&ThreadPool::WorkerFunc, this, i)));
 		}
 		workersStarted = true;
 	}
 }
 
-void ThreadPool::ParallelLoop(const std::function<void(int,int)> &loop, int lower, int upper) {
-	int range = upper - lower;
-	if (range >= numThreads_ * 2) { // don't parallelize tiny loops (this could be better, maybe add optional parameter that estimates work per iteration)
-		lock_guard guard(mutex);
-		StartWorkers();
-
-		// could do slightly better load balancing for the generic case, 
-		// but doesn't matter since all our loops are power of 2
-		int chunk = range / numThreads_;
-		int s = lower;
-		for (int i = 0; i < numThreads_ - 1; ++i) {
-			workers[i]->Process(loop, s, s+chunk);
-			s+=chunk;
+void ThreadPool::WorkerFunc(int index) {
+	setCurrentThreadName("ThreadPoolWorker");
+	currentPool = this;
+	currentQueue = index;
+
+	while (!stop_) {
+		Task task;
+		if (FindTask(index, &task)) {
+			RunTask(index, task);
+			continue;
 		}
-		// This is the final chunk.
-		loop(s, upper);
-		for (int i = 0; i < numThreads_ - 1; ++i) {
-			workers[i]->WaitForCompletion();
+
+		lock_guard guard(sleepMutex_);
+		sleepers_++;
+		if (queued_ == 0 && !stop_) {
+			wake_.wait(sleepMutex_);
 		}
-	} else {
-		loop(lower, upper);
+		sleepers_--;
+	}
+}
+
+void ThreadPool::Push(int queue, const Task &task) {
+	TaskQueue *q = queues_[queue];
+	q->mutex.lock();
+	q->tasks.push_back(task);
+	q->mutex.unlock();
+
+	queued_++;
+	if (sleepers_ > 0) {
+		lock_guard guard(sleepMutex_);
+		wake_.notify_one();
 	}
 }
 
+bool ThreadPool::PopOwn(int queue, Task *task) {
+	TaskQueue *q = queues_[queue];
+	lock_guard guard(q->mutex);
+	if (q->tasks.empty())
+		return false;
+	// Newest first, it's the smallest piece and the closest to what we just ran.
+	*task = q->tasks.back();
+	q->tasks.pop_back();
+	queued_--;
+	return true;
+}
+
+bool ThreadPool::Steal(int thief, Task *task) {
+	for (int i = 1; i < numThreads_; ++i) {
+		TaskQueue *q = queues_[(thief + i) % numThreads_];
+		lock_guard guard(q->mutex);
+		if (!q->tasks.empty()) {
+			// Oldest first, it's the biggest piece, so we steal as rarely as possible.
+			*task = q->tasks.front();
+			q->tasks.pop_front();
+			queued_--;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool ThreadPool::FindTask(int queue, Task *task) {
+	if (queued_ == 0)
+		return false;
+	return PopOwn(queue, task) || Steal(queue, task);
+}
+
+void ThreadPool::RunTask(int queue, const Task &task) {
+	Loop *loop = task.loop;
+	int lower = task.lower;
+	int upper = task.upper;
+	// Keep the lower half for ourselves and offer the upper half to anyone idle.
+	while (upper - lower > loop->grain) {
+		int mid = lower + (upper - lower) / 2;
+		Task rest = { loop, mid, upper };
+		Push(queue, rest);
+		upper = mid;
+	}
+	(*loop->func)(lower, upper);
+
+	// Must not touch loop after this, its owner may return as soon as remaining hits zero.
+	int count = upper - lower;
+	if (loop->remaining.fetch_sub(count) == count && sleepers_ > 0) {
+		lock_guard guard(sleepMutex_);
+		wake_.notify_all();
+	}
+}
+
+void ThreadPool::ParallelLoop(const std::function<void(int,int)> &loop, int lower, int upper, int minGrain) {
+	int range = upper - lower;
+	// Don't parallelize tiny loops, unless the caller knows better.
+	if (numThreads_ <= 1 || range <= 1 || (minGrain <= 0 && range < numThreads_ * 2) || range <= minGrain) {
+		loop(lower, upper);
+		return;
+	}
+
+	StartWorkers();
+
+	// Aim for a handful of pieces per thread, enough to even out uneven iterations.
+	int grain = minGrain > 0 ? minGrain : std::max(1, range / (numThreads_ * 8));
+	int queue = currentPool == this ? currentQueue : 0;
+
+	Loop state;
+	state.func = &loop;
+	state.grain = grain;
+	state.remaining = range;
+
+	Task task = { &state, lower, upper };
+	RunTask(queue, task);
+
+	// Help out with whatever is queued (ours or not) until our own loop is done.
+	while (state.remaining > 0) {
+		if (FindTask(queue, &task)) {
+			RunTask(queue, task);
+			continue;
+		}
+
+		lock_guard guard(sleepMutex_);
+		sleepers_++;
+		if (queued_ == 0 && state.remaining > 0) {
+			wake_.wait(sleepMutex_);
+		}
+		sleepers_--;
+	}
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <vector>
+
 #include "thread.h"
 #include "base/mutex.h"
 #include "base/functional.h"
@@ -48,26 +52,59 @@ private:
 	std::function<void(int, int)> work_; // the work to be done by this thread
 };
 
-// A thread pool manages a set of worker threads, and allows the execution of parallel loops on them
-// individual parallel loops are fully sequentialized to simplify synchronization, which should not 
-// be a problem as they should each use the entire system
+// A thread pool manages a set of worker threads, and allows the execution of parallel loops on them.
+// Loops are split lazily into halves down to a grain size, and idle workers steal the largest
+// remaining pieces from each other's queues, so uneven per-iteration cost still balances out.
+// Several loops can run at once, and a loop body may itself call ParallelLoop - the waiting
+// thread keeps executing queued work instead of blocking, so nesting can't deadlock.
 class ThreadPool {
 public:
 	ThreadPool(int numThreads);
-	// don't need a destructor, "workers" is cleared on delete, 
-	// leading to the stopping and joining of all worker threads (RAII and all that)
+	~ThreadPool();
+
+	// minGrain is the smallest range handed to a single call of loop. 0 picks one automatically
+	// based on the range and the number of threads.
+	void ParallelLoop(const std::function<void(int,int)> &loop, int lower, int upper, int minGrain = 0);
 
-	void ParallelLoop(const std::function<void(int,int)> &loop, int lower, int upper);
+	int NumThreads() const { return numThreads_; }
 
 private:
+	struct Loop;
+	struct Task {
+		Loop *loop;
+		int lower;
+		int upper;
+	};
+	struct TaskQueue {
+		TaskQueue() : mutex("ThreadPool::TaskQueue") {}
+		::recursive_mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	void StartWorkers();
+	void WorkerFunc(int index);
+
+	void Push(int queue, const Task &task);
+	bool PopOwn(int queue, Task *task);
+	bool Steal(int thief, Task *task);
+	bool FindTask(int queue, Task *task);
+	void RunTask(int queue, const Task &task);
+
 	int numThreads_;
-	std::vector<std::shared_ptr<LoopWorkerThread>> workers;
-	::recursive_mutex mutex; // used to sequentialize loop execution
+	// Queue 0 is shared by all threads that aren't workers of this pool, the rest belong to one worker each.
+	std::vector<TaskQueue *> queues_;
+	std::vector<std::thread *> workers_;
+
+	std::atomic<int> queued_;
+	std::atomic<int> sleepers_;
+	std::atomic<bool> stop_;
+	// Guards sleeping, both for idle workers and for threads waiting on a loop to complete.
+	::recursive_mutex sleepMutex_;
+	::condition_variable wake_;
 
+	::recursive_mutex startMutex_;
 	bool workersStarted;
-	void StartWorkers();
-	
+
 	ThreadPool(const ThreadPool& other); // prevent copies
 	void operator =(const ThreadPool &other);
 };
-
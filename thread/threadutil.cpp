@@ -1,7 +1,7 @@
 #ifdef _WIN32
 #include <windows.h>
 #define TLS_SUPPORTED
-#elif defined(ANDROID)
+#elif defined(ANDROID) || defined(__linux__)
 #define TLS_SUPPORTED
 #endif
 
@@ -57,10 +57,18 @@ void setCurrentThreadName(const char* threadName) {
 #endif
 }
 
+const char *GetCurrentThreadName() {
+#ifdef TLS_SUPPORTED
+	return curThreadName;
+#else
+	return 0;
+#endif
+}
+
 void AssertCurrentThreadName(const char *threadName) {
 #ifdef TLS_SUPPORTED
-	if (strcmp(curThreadName, threadName) != 0) {
-		ELOG("Thread name assert failed: Expected %s, was %s", threadName, curThreadName);
+	if (!curThreadName || strcmp(curThreadName, threadName) != 0) {
+		ELOG("Thread name assert failed: Expected %s, was %s", threadName, curThreadName ? curThreadName : "(unnamed)");
 	}
 #endif
 }
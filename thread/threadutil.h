@@ -4,3 +4,5 @@
 // for assertThreadName to work.
 void setCurrentThreadName(const char *threadName);
 void AssertCurrentThreadName(const char *threadName);
+// Returns NULL if no name was set, or if the platform can't keep track.
+const char *GetCurrentThreadName();